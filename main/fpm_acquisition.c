@@ -0,0 +1,227 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+#define ACQUISITION_JUMP_PERIODS 10
+
+static const char *TAG = "ACQ";
+
+static bool acquisition_full_rate = false;
+static bool acquisition_scheduled = false;
+static bool acquisition_wall_base = false;
+static uint32_t acquisition_active_period;
+static uint64_t acquisition_next_ms;
+static uint64_t acquisition_start_ms;
+static bool acquisition_sample_running = false;
+fpm_acquisition_stats_t acquisition_stats;
+
+static bool acquisition_demand(void)
+{
+    uint8_t i;
+    for(i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if((fpm_wsockets[i].fd != 0) && (fpm_wsockets[i].auth_status == AUTHENTICATED_TRUE))
+        {
+            return true;
+        }
+    }
+    if(ViewersWatching() == true)
+    {
+        return true;
+    }
+    if((mbslave_request_count != 0) && (xTaskGetTickCount() - mbslave_request_timestamp < CONFIG_FPM_ACQ_DEMAND_HOLD))
+    {
+        return true;
+    }
+    return false;
+}
+
+// Demand is evaluated once per main loop pass, from fpm_acquisition_due, so a newly
+// connected client shortens the period immediately and the next sweep starts as soon
+// as the full period has elapsed.
+static void acquisition_update_rate(void)
+{
+    bool demand;
+    demand = acquisition_demand();
+    if(demand != acquisition_full_rate)
+    {
+        acquisition_full_rate = demand;
+        ESP_LOGI(TAG, "Acquisition %s rate", demand ? "full" : "background");
+    }
+}
+
+// Current period from the last demand check; cheap and safe from any task, it is read
+// per CID by the sample quality check and by the httpd and Modbus slave tasks.
+uint32_t fpm_acquisition_period(void)
+{
+    return acquisition_full_rate ? CONFIG_FPM_ACQ_FULL_PERIOD : CONFIG_FPM_ACQ_IDLE_PERIOD;
+}
+
+bool fpm_acquisition_full_rate(void)
+{
+    return acquisition_full_rate;
+}
+
+// Milliseconds on the scheduling time base: UTC once SNTP has set the clock so that
+// boundaries fall on wall clock multiples of the period, otherwise the monotonic timer.
+static uint64_t acquisition_now_ms(bool wall_base)
+{
+    static struct timeval tv;
+    if(wall_base == true)
+    {
+        gettimeofday(&tv, NULL);
+        return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+    }
+    return (uint64_t)esp_timer_get_time() / 1000;
+}
+
+static void acquisition_realign(uint64_t now_ms)
+{
+    acquisition_next_ms = ((now_ms / acquisition_active_period) + 1) * acquisition_active_period;
+    acquisition_scheduled = true;
+    acquisition_stats.realigned++;
+}
+
+// Fixed rate: the next boundary is always the previous boundary plus the period,
+// never "period after the last sweep finished", so sweep time does not accumulate.
+// Returns true once per boundary. Boundaries reached while a sweep is still busy
+// are skipped and counted rather than queued.
+bool fpm_acquisition_due(bool busy)
+{
+    static uint32_t period;
+    static bool wall_base;
+    static uint64_t now_ms;
+    acquisition_update_rate();
+    period = fpm_acquisition_period();
+    wall_base = sntp_time_valid;
+    now_ms = acquisition_now_ms(wall_base);
+    if((acquisition_scheduled == false) || (period != acquisition_active_period) || (wall_base != acquisition_wall_base))
+    {
+        acquisition_active_period = period;
+        acquisition_wall_base = wall_base;
+        acquisition_stats.aligned = wall_base;
+        acquisition_realign(now_ms);
+        return false;
+    }
+    if((now_ms + acquisition_active_period < acquisition_next_ms) || (now_ms > acquisition_next_ms + ((uint64_t)acquisition_active_period * ACQUISITION_JUMP_PERIODS)))
+    {
+        ESP_LOGI(TAG, "Clock step detected, realigning");
+        acquisition_realign(now_ms);
+        return false;
+    }
+    if(now_ms < acquisition_next_ms)
+    {
+        return false;
+    }
+    if(busy == true)
+    {
+        acquisition_stats.skipped++;
+        acquisition_next_ms += acquisition_active_period;
+        return false;
+    }
+    acquisition_start_ms = acquisition_next_ms;
+    acquisition_next_ms += acquisition_active_period;
+    while(acquisition_next_ms <= now_ms)
+    {
+        acquisition_stats.skipped++;
+        acquisition_next_ms += acquisition_active_period;
+    }
+    acquisition_sample_running = false;
+    return true;
+}
+
+// Called on the first bus step of the sweep; lateness against the boundary is the jitter.
+void fpm_acquisition_sample_started(void)
+{
+    static uint32_t jitter;
+    if(acquisition_sample_running == true)
+    {
+        return;
+    }
+    acquisition_sample_running = true;
+    jitter = (uint32_t)(acquisition_now_ms(acquisition_wall_base) - acquisition_start_ms);
+    acquisition_stats.samples++;
+    acquisition_stats.jitter_last = jitter;
+    acquisition_stats.jitter_sum += jitter;
+    if(jitter > acquisition_stats.jitter_max)
+    {
+        acquisition_stats.jitter_max = jitter;
+    }
+}
+
+void fpm_acquisition_sample_done(void)
+{
+    static uint32_t duration;
+    duration = (uint32_t)(acquisition_now_ms(acquisition_wall_base) - acquisition_start_ms);
+    acquisition_stats.sweep_last = duration;
+    if(duration > acquisition_stats.sweep_max)
+    {
+        acquisition_stats.sweep_max = duration;
+    }
+    if(duration > acquisition_active_period)
+    {
+        acquisition_stats.overruns++;
+    }
+}
+
+// Shortens the main loop sleep when a boundary is closer than the normal loop delay.
+uint32_t fpm_acquisition_loop_delay(uint32_t loop_delay)
+{
+    static uint64_t now_ms;
+    if(fpm_burst_active() == true)
+    {
+        // block reads are chained back to back while a burst is captured
+        return 1;
+    }
+    if(acquisition_scheduled == false)
+    {
+        return loop_delay;
+    }
+    now_ms = acquisition_now_ms(acquisition_wall_base);
+    if(now_ms >= acquisition_next_ms)
+    {
+        return 0;
+    }
+    if(acquisition_next_ms - now_ms < loop_delay)
+    {
+        return (uint32_t)(acquisition_next_ms - now_ms);
+    }
+    return loop_delay;
+}
+
+char *fpm_acquisition_stats_json(void)
+{
+    cJSON *valuejSON;
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    valuejSON = cJSON_CreateBool(acquisition_stats.aligned);
+    cJSON_AddItemToObject(stats_json_obj, "aligned", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_active_period);
+    cJSON_AddItemToObject(stats_json_obj, "period", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.samples);
+    cJSON_AddItemToObject(stats_json_obj, "samples", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.jitter_last);
+    cJSON_AddItemToObject(stats_json_obj, "jitterlast", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.jitter_max);
+    cJSON_AddItemToObject(stats_json_obj, "jittermax", valuejSON);
+    valuejSON = cJSON_CreateNumber((acquisition_stats.samples != 0) ? (double)acquisition_stats.jitter_sum / acquisition_stats.samples : 0);
+    cJSON_AddItemToObject(stats_json_obj, "jitteravg", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.sweep_last);
+    cJSON_AddItemToObject(stats_json_obj, "sweeplast", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.sweep_max);
+    cJSON_AddItemToObject(stats_json_obj, "sweepmax", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.overruns);
+    cJSON_AddItemToObject(stats_json_obj, "overruns", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.skipped);
+    cJSON_AddItemToObject(stats_json_obj, "skipped", valuejSON);
+    valuejSON = cJSON_CreateNumber(acquisition_stats.realigned);
+    cJSON_AddItemToObject(stats_json_obj, "realigned", valuejSON);
+    char *json_print = cJSON_Print(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
@@ -0,0 +1,288 @@
+#include "stdbool.h"
+#include "string.h"
+#include "stdlib.h"
+#include "inttypes.h"
+#include <math.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+// ESP-DSP comes in through main/idf_component.yml; the portable loop below is the
+// same arithmetic and is what a host build without the component compiles.
+#if __has_include("dsps_math.h")
+#include "dsps_math.h"
+#define AGGREGATE_USE_DSP 1
+#else
+#define AGGREGATE_USE_DSP 0
+#endif
+
+#define AGGREGATE_INTERVAL_COUNT HISTORY_RECORD_TYPE_COUNT
+
+// Structure of arrays: one float vector per statistic, indexed by CID, so the update
+// runs as a handful of straight vector passes instead of a loop over structs.
+typedef struct
+{
+    float mean[AGGREGATE_MAX_CIDS];
+    float m2[AGGREGATE_MAX_CIDS];
+    float min[AGGREGATE_MAX_CIDS];
+    float max[AGGREGATE_MAX_CIDS];
+    uint16_t n[AGGREGATE_MAX_CIDS];
+    uint16_t bad[AGGREGATE_MAX_CIDS];
+    uint32_t start_time;
+    uint16_t samples;
+    bool utc;
+}fpm_aggregate_interval_t;
+
+static const char *TAG = "AGGR";
+
+static const uint32_t aggregate_period[AGGREGATE_INTERVAL_COUNT] = {60, 900};
+static fpm_aggregate_interval_t aggregate_intervals[AGGREGATE_INTERVAL_COUNT];
+static float aggregate_x[AGGREGATE_MAX_CIDS];
+static float aggregate_xs[AGGREGATE_MAX_CIDS];
+static float aggregate_w[AGGREGATE_MAX_CIDS];
+static float aggregate_delta[AGGREGATE_MAX_CIDS];
+static float aggregate_tmp[AGGREGATE_MAX_CIDS];
+static uint8_t aggregate_quality[AGGREGATE_MAX_CIDS];
+static uint16_t aggregate_reg[AGGREGATE_MAX_CIDS];
+static uint16_t aggregate_cid_count;
+char metermsg_aggregate[AGGREGATE_INTERVAL_COUNT][AGGREGATE_MSG_SIZE];
+uint16_t metermsg_aggregate_len[AGGREGATE_INTERVAL_COUNT];
+fpm_aggregate_stats_t aggregate_stats;
+
+static void aggregate_reset(fpm_aggregate_interval_t *iv, uint32_t start_time, bool utc)
+{
+    static uint16_t i;
+    memset(iv, 0, sizeof(fpm_aggregate_interval_t));
+    for(i = 0; i < AGGREGATE_MAX_CIDS; i++)
+    {
+        iv->min[i] = INFINITY;
+        iv->max[i] = -INFINITY;
+    }
+    iv->start_time = start_time;
+    iv->utc = utc;
+}
+
+// Welford's update for all CIDs at once. The scalar pass handles what does not
+// vectorise (validity, counts, extremes); a CID without a good value this sweep gets
+// weight 0 and x = mean, which leaves its mean and M2 unchanged in the vector pass.
+static void aggregate_update(fpm_aggregate_interval_t *iv, uint16_t count)
+{
+    static uint16_t i;
+    for(i = 0; i < count; i++)
+    {
+        if(isnan(aggregate_x[i]) || (aggregate_quality[i] != SAMPLE_QUALITY_GOOD))
+        {
+            if(isnan(aggregate_x[i]) == false)
+            {
+                iv->bad[i]++;
+            }
+            aggregate_w[i] = 0;
+            aggregate_xs[i] = iv->mean[i];
+            continue;
+        }
+        iv->n[i]++;
+        aggregate_w[i] = 1.0f / iv->n[i];
+        aggregate_xs[i] = aggregate_x[i];
+        iv->min[i] = (aggregate_x[i] < iv->min[i]) ? aggregate_x[i] : iv->min[i];
+        iv->max[i] = (aggregate_x[i] > iv->max[i]) ? aggregate_x[i] : iv->max[i];
+    }
+#if AGGREGATE_USE_DSP
+    dsps_sub_f32(aggregate_xs, iv->mean, aggregate_delta, count, 1, 1, 1);
+    dsps_mul_f32(aggregate_delta, aggregate_w, aggregate_tmp, count, 1, 1, 1);
+    dsps_add_f32(iv->mean, aggregate_tmp, iv->mean, count, 1, 1, 1);
+    dsps_sub_f32(aggregate_xs, iv->mean, aggregate_tmp, count, 1, 1, 1);
+    dsps_mul_f32(aggregate_delta, aggregate_tmp, aggregate_tmp, count, 1, 1, 1);
+    dsps_add_f32(iv->m2, aggregate_tmp, iv->m2, count, 1, 1, 1);
+#else
+    for(i = 0; i < count; i++)
+    {
+        aggregate_delta[i] = aggregate_xs[i] - iv->mean[i];
+        iv->mean[i] += aggregate_delta[i] * aggregate_w[i];
+        iv->m2[i] += aggregate_delta[i] * (aggregate_xs[i] - iv->mean[i]);
+    }
+#endif
+    iv->samples++;
+}
+
+// Population standard deviation over the interval.
+static float aggregate_stddev(const fpm_aggregate_interval_t *iv, uint16_t cid)
+{
+    return (iv->n[cid] > 1) ? sqrtf(iv->m2[cid] / iv->n[cid]) : 0;
+}
+
+static double aggregate_round(float value)
+{
+    return round((double)value * 1000) / 1000;
+}
+
+// "&console#aggr=" push for the websocket clients: every CID that had a good value,
+// keyed by register address as [min,max,avg,stddev,n].
+static void aggregate_build_msg(uint8_t type, const fpm_aggregate_interval_t *iv)
+{
+    static char reg_str[8];
+    static uint16_t i;
+    static size_t len;
+    cJSON *cid_json;
+    cJSON *data_json_obj = cJSON_CreateObject();
+    cJSON *aggr_json_obj = cJSON_CreateObject();
+    cJSON_AddItemToObject(aggr_json_obj, "iv", cJSON_CreateNumber(aggregate_period[type]));
+    cJSON_AddItemToObject(aggr_json_obj, "t", cJSON_CreateNumber(iv->start_time + aggregate_period[type]));
+    cJSON_AddItemToObject(aggr_json_obj, "utc", cJSON_CreateBool(iv->utc));
+    cJSON_AddItemToObject(aggr_json_obj, "n", cJSON_CreateNumber(iv->samples));
+    for(i = 0; i < aggregate_cid_count; i++)
+    {
+        if(iv->n[i] == 0)
+        {
+            continue;
+        }
+        sprintf(reg_str, "%04X", aggregate_reg[i]);
+        cid_json = cJSON_CreateArray();
+        cJSON_AddItemToArray(cid_json, cJSON_CreateNumber(aggregate_round(iv->min[i])));
+        cJSON_AddItemToArray(cid_json, cJSON_CreateNumber(aggregate_round(iv->max[i])));
+        cJSON_AddItemToArray(cid_json, cJSON_CreateNumber(aggregate_round(iv->mean[i])));
+        cJSON_AddItemToArray(cid_json, cJSON_CreateNumber(aggregate_round(aggregate_stddev(iv, i))));
+        cJSON_AddItemToArray(cid_json, cJSON_CreateNumber(iv->n[i]));
+        cJSON_AddItemToObject(data_json_obj, reg_str, cid_json);
+    }
+    cJSON_AddItemToObject(aggr_json_obj, "d", data_json_obj);
+    char *json_print = cJSON_PrintUnformatted(aggr_json_obj);
+    cJSON_Delete(aggr_json_obj);
+    if(json_print == NULL)
+    {
+        return;
+    }
+    len = strlen(json_print);
+    // leaves room for the "*<cntid>" the sender appends
+    if(len + strlen("&console#aggr=") + 12 < AGGREGATE_MSG_SIZE)
+    {
+        strcpy(metermsg_aggregate[type], "&console#aggr=");
+        strcat(metermsg_aggregate[type], json_print);
+        metermsg_aggregate_len[type] = strlen(metermsg_aggregate[type]);
+        SetAggregateSend(type);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Aggregate message too long (%d)", len);
+    }
+    free(json_print);
+}
+
+// History keeps the interval mean of the trend channels, in their scaled units; a
+// channel that had any non-good sample in the interval is flagged.
+static void aggregate_to_history(uint8_t type, const fpm_aggregate_interval_t *iv)
+{
+    static int16_t value[TREND_CHANNEL_COUNT];
+    static uint16_t quality_mask;
+    static uint16_t i;
+    static uint8_t ch;
+    if(iv->utc == false)
+    {
+        return;
+    }
+    quality_mask = 0;
+    for(ch = 0; ch < TREND_CHANNEL_COUNT; ch++)
+    {
+        value[ch] = INT16_MIN;
+        quality_mask |= (1 << ch);
+        for(i = 0; i < aggregate_cid_count; i++)
+        {
+            if(aggregate_reg[i] != fpm_trend_channel_register(ch))
+            {
+                continue;
+            }
+            if(iv->n[i] != 0)
+            {
+                value[ch] = fpm_trend_scale(iv->mean[i], fpm_trend_channel_scale(ch));
+                if(iv->bad[i] == 0)
+                {
+                    quality_mask &= ~(1 << ch);
+                }
+            }
+            break;
+        }
+    }
+    fpm_history_interval(type, iv->start_time + aggregate_period[type], iv->samples, quality_mask, value);
+}
+
+static void aggregate_close(uint8_t type)
+{
+    static int64_t close_start;
+    close_start = esp_timer_get_time();
+    aggregate_to_history(type, &aggregate_intervals[type]);
+    aggregate_build_msg(type, &aggregate_intervals[type]);
+    aggregate_stats.closed++;
+    aggregate_stats.close_us_last = (uint32_t)(esp_timer_get_time() - close_start);
+    if(aggregate_stats.close_us_last > aggregate_stats.close_us_max)
+    {
+        aggregate_stats.close_us_max = aggregate_stats.close_us_last;
+    }
+}
+
+// Called once per completed sweep. Intervals are aligned on UTC once SNTP has set the
+// clock, on uptime before that; a change of time base restarts the open intervals.
+void fpm_aggregate_sample(void)
+{
+    static struct timeval tv;
+    static fpm_aggregate_interval_t *iv;
+    static int64_t sample_start;
+    static uint32_t now;
+    static uint32_t interval_start;
+    static uint32_t elapsed;
+    static bool utc;
+    static uint8_t type;
+    sample_start = esp_timer_get_time();
+    aggregate_cid_count = fpm_modbus_sample_vector(aggregate_x, aggregate_quality, aggregate_reg, AGGREGATE_MAX_CIDS);
+    utc = sntp_time_valid;
+    if(utc == true)
+    {
+        gettimeofday(&tv, NULL);
+        now = (uint32_t)tv.tv_sec;
+    }
+    else
+    {
+        now = (uint32_t)(esp_timer_get_time() / 1000000);
+    }
+    for(type = 0; type < AGGREGATE_INTERVAL_COUNT; type++)
+    {
+        iv = &aggregate_intervals[type];
+        interval_start = now - (now % aggregate_period[type]);
+        if((iv->samples == 0) || (interval_start != iv->start_time) || (utc != iv->utc))
+        {
+            if((iv->samples != 0) && (utc == iv->utc))
+            {
+                aggregate_close(type);
+            }
+            aggregate_reset(iv, interval_start, utc);
+        }
+        aggregate_update(iv, aggregate_cid_count);
+    }
+    elapsed = (uint32_t)(esp_timer_get_time() - sample_start);
+    aggregate_stats.sweeps++;
+    aggregate_stats.sweep_us_last = elapsed;
+    aggregate_stats.sweep_us_total += elapsed;
+    if(elapsed > aggregate_stats.sweep_us_max)
+    {
+        aggregate_stats.sweep_us_max = elapsed;
+    }
+}
+
+char *fpm_aggregate_stats_json(void)
+{
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    cJSON_AddItemToObject(stats_json_obj, "dsp", cJSON_CreateBool(AGGREGATE_USE_DSP));
+    cJSON_AddItemToObject(stats_json_obj, "cids", cJSON_CreateNumber(aggregate_cid_count));
+    cJSON_AddItemToObject(stats_json_obj, "intervals", cJSON_CreateNumber(AGGREGATE_INTERVAL_COUNT));
+    cJSON_AddItemToObject(stats_json_obj, "sweeps", cJSON_CreateNumber(aggregate_stats.sweeps));
+    cJSON_AddItemToObject(stats_json_obj, "sweepuslast", cJSON_CreateNumber(aggregate_stats.sweep_us_last));
+    cJSON_AddItemToObject(stats_json_obj, "sweepusmax", cJSON_CreateNumber(aggregate_stats.sweep_us_max));
+    cJSON_AddItemToObject(stats_json_obj, "sweepusavg", cJSON_CreateNumber((aggregate_stats.sweeps != 0) ? (double)aggregate_stats.sweep_us_total / aggregate_stats.sweeps : 0));
+    cJSON_AddItemToObject(stats_json_obj, "closed", cJSON_CreateNumber(aggregate_stats.closed));
+    cJSON_AddItemToObject(stats_json_obj, "closeuslast", cJSON_CreateNumber(aggregate_stats.close_us_last));
+    cJSON_AddItemToObject(stats_json_obj, "closeusmax", cJSON_CreateNumber(aggregate_stats.close_us_max));
+    char *json_print = cJSON_Print(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
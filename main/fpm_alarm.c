@@ -0,0 +1,336 @@
+#include "stdbool.h"
+#include "string.h"
+#include "stdlib.h"
+#include "inttypes.h"
+#include <stdio.h>
+#include <math.h>
+#include <sys/time.h>
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+#define ALARM_RULES_FILE "/data/alarms.json"
+#define ALARM_FILE_MAX 4096
+#define ALARM_MAX_RULES 32
+#define ALARM_NAME_SIZE 24
+#define ALARM_EVENT_COUNT 16
+
+typedef enum
+{
+    ALARM_OP_ABOVE,
+    ALARM_OP_BELOW,
+    ALARM_OP_RISE,
+    ALARM_OP_FALL
+}_enum_fpm_alarm_op;
+
+// Compiled rule: the register is resolved to its descriptor index and the clear level
+// is precomputed, so evaluating a rule is a value read and two compares.
+typedef struct
+{
+    char name[ALARM_NAME_SIZE];
+    int16_t sample_cid;
+    uint16_t reg;
+    uint8_t op;
+    uint8_t severity;
+    float trip;
+    float clear;
+    int64_t delay_us;
+    bool active;
+    bool pending;
+    bool have_last;
+    int64_t pending_since_us;
+    int64_t last_us;
+    float last_value;
+}fpm_alarm_rule_t;
+
+typedef struct
+{
+    uint32_t seq;
+    uint8_t rule;
+    bool active;
+    float value;
+    uint64_t utc_ms;
+    int64_t mono_us;
+}fpm_alarm_event_t;
+
+static const char *TAG = "ALARM";
+
+static fpm_alarm_rule_t alarm_rules[ALARM_MAX_RULES];
+static uint8_t alarm_rule_count;
+static fpm_alarm_event_t alarm_events[ALARM_EVENT_COUNT];
+static uint32_t alarm_seq_next = 1;
+static char alarm_file_buf[ALARM_FILE_MAX + 1];
+fpm_alarm_stats_t alarm_stats;
+
+// Names end up in JSON messages, so only plain printable characters are kept.
+static void alarm_copy_name(char *dst, const char *src)
+{
+    static uint8_t len;
+    len = 0;
+    while((*src != 0) && (len < ALARM_NAME_SIZE - 1))
+    {
+        if((*src >= ' ') && (*src <= '~') && (*src != '"') && (*src != '\\'))
+        {
+            dst[len++] = *src;
+        }
+        src++;
+    }
+    dst[len] = 0;
+}
+
+static bool alarm_compile_rule(cJSON *rule_json, fpm_alarm_rule_t *rule)
+{
+    static cJSON *item;
+    static float hysteresis;
+    memset(rule, 0, sizeof(fpm_alarm_rule_t));
+    item = cJSON_GetObjectItem(rule_json, "reg");
+    if(cJSON_IsNumber(item))
+    {
+        rule->reg = (uint16_t)item->valueint;
+    }
+    else if(cJSON_IsString(item))
+    {
+        rule->reg = (uint16_t)strtoul(item->valuestring, NULL, 0);
+    }
+    rule->sample_cid = fpm_modbus_sample_index(rule->reg);
+    item = cJSON_GetObjectItem(rule_json, "op");
+    if((rule->sample_cid < 0) || (cJSON_IsString(item) == false) || (cJSON_IsNumber(cJSON_GetObjectItem(rule_json, "limit")) == false))
+    {
+        return false;
+    }
+    if(strcmp(item->valuestring, ">") == 0)
+    {
+        rule->op = ALARM_OP_ABOVE;
+    }
+    else if(strcmp(item->valuestring, "<") == 0)
+    {
+        rule->op = ALARM_OP_BELOW;
+    }
+    else if(strcmp(item->valuestring, "roc>") == 0)
+    {
+        rule->op = ALARM_OP_RISE;
+    }
+    else if(strcmp(item->valuestring, "roc<") == 0)
+    {
+        rule->op = ALARM_OP_FALL;
+    }
+    else
+    {
+        return false;
+    }
+    rule->trip = (float)cJSON_GetObjectItem(rule_json, "limit")->valuedouble;
+    item = cJSON_GetObjectItem(rule_json, "hyst");
+    hysteresis = cJSON_IsNumber(item) ? fabsf((float)item->valuedouble) : 0;
+    rule->clear = ((rule->op == ALARM_OP_ABOVE) || (rule->op == ALARM_OP_RISE)) ? (rule->trip - hysteresis) : (rule->trip + hysteresis);
+    item = cJSON_GetObjectItem(rule_json, "delay");
+    rule->delay_us = cJSON_IsNumber(item) ? (int64_t)(item->valuedouble * 1000000) : 0;
+    item = cJSON_GetObjectItem(rule_json, "sev");
+    rule->severity = cJSON_IsNumber(item) ? (uint8_t)item->valueint : 1;
+    item = cJSON_GetObjectItem(rule_json, "name");
+    alarm_copy_name(rule->name, cJSON_IsString(item) ? item->valuestring : "");
+    return true;
+}
+
+// Rules come from /data/alarms.json, an array of
+// {"name","reg","op":">"|"<"|"roc>"|"roc<","limit","hyst","delay","sev"}; limit is in
+// the register's units (per second for roc), delay in seconds.
+void fpm_alarm_init(void)
+{
+    static FILE *f;
+    static size_t len;
+    static cJSON *rule_json;
+    alarm_rule_count = 0;
+    f = fopen(ALARM_RULES_FILE, "r");
+    if(f == NULL)
+    {
+        ESP_LOGI(TAG, "No alarm rules");
+        return;
+    }
+    len = fread(alarm_file_buf, 1, ALARM_FILE_MAX, f);
+    fclose(f);
+    alarm_file_buf[len] = 0;
+    cJSON *rules_json = cJSON_Parse(alarm_file_buf);
+    if(cJSON_IsArray(rules_json) == false)
+    {
+        ESP_LOGI(TAG, "Alarm rules unreadable");
+        cJSON_Delete(rules_json);
+        return;
+    }
+    cJSON_ArrayForEach(rule_json, rules_json)
+    {
+        if(alarm_rule_count >= ALARM_MAX_RULES)
+        {
+            break;
+        }
+        if(alarm_compile_rule(rule_json, &alarm_rules[alarm_rule_count]) == true)
+        {
+            alarm_rule_count++;
+        }
+        else
+        {
+            ESP_LOGI(TAG, "Alarm rule skipped");
+            alarm_stats.rejected++;
+        }
+    }
+    cJSON_Delete(rules_json);
+    ESP_LOGI(TAG, "%u alarm rules", alarm_rule_count);
+}
+
+static void alarm_event(uint8_t rule, bool active, float value, int64_t now_us)
+{
+    static fpm_alarm_event_t *event;
+    static struct timeval tv;
+    event = &alarm_events[alarm_seq_next % ALARM_EVENT_COUNT];
+    event->seq = alarm_seq_next;
+    event->rule = rule;
+    event->active = active;
+    event->value = value;
+    event->mono_us = now_us;
+    event->utc_ms = 0;
+    if(sntp_time_valid == true)
+    {
+        gettimeofday(&tv, NULL);
+        event->utc_ms = ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+    }
+    alarm_seq_next++;
+    alarm_stats.events++;
+    ESP_LOGI(TAG, "%s %s (%.3f)", alarm_rules[rule].name, (active == true) ? "raised" : "cleared", value);
+}
+
+// Runs after every completed poll sweep; one pass over the flat rule array.
+void fpm_alarm_evaluate(void)
+{
+    static fpm_alarm_rule_t *rule;
+    static int64_t now_us;
+    static int64_t sample_us;
+    static int64_t run_start;
+    static float value;
+    static float x;
+    static uint8_t quality;
+    static uint8_t i;
+    static bool upward;
+    if(alarm_rule_count == 0)
+    {
+        return;
+    }
+    run_start = now_us = esp_timer_get_time();
+    for(i = 0; i < alarm_rule_count; i++)
+    {
+        rule = &alarm_rules[i];
+        if((fpm_modbus_sample_at((uint16_t)rule->sample_cid, &value, &quality) == false) || (quality != SAMPLE_QUALITY_GOOD) || (isnan(value) == true))
+        {
+            // no verdict on a bad sample: the duration and the rate restart
+            rule->pending = false;
+            rule->have_last = false;
+            continue;
+        }
+        x = value;
+        if((rule->op == ALARM_OP_RISE) || (rule->op == ALARM_OP_FALL))
+        {
+            // the rate runs on the receive times of the two readings, not on when the
+            // sweeps finished, so poll jitter does not skew it
+            sample_us = fpm_modbus_sample_time((uint16_t)rule->sample_cid);
+            if((rule->have_last == true) && (sample_us == rule->last_us))
+            {
+                // not read again since the last pass, nothing new to judge
+                continue;
+            }
+            if((rule->have_last == false) || (sample_us < rule->last_us))
+            {
+                rule->have_last = true;
+                rule->last_us = sample_us;
+                rule->last_value = value;
+                continue;
+            }
+            x = (value - rule->last_value) / ((sample_us - rule->last_us) / 1e6f);
+            rule->last_us = sample_us;
+            rule->last_value = value;
+        }
+        upward = (rule->op == ALARM_OP_ABOVE) || (rule->op == ALARM_OP_RISE);
+        if(rule->active == false)
+        {
+            if((upward == true) ? (x > rule->trip) : (x < rule->trip))
+            {
+                if(rule->pending == false)
+                {
+                    rule->pending = true;
+                    rule->pending_since_us = now_us;
+                }
+                if(now_us - rule->pending_since_us >= rule->delay_us)
+                {
+                    rule->active = true;
+                    rule->pending = false;
+                    alarm_event(i, true, x, now_us);
+                }
+            }
+            else
+            {
+                rule->pending = false;
+            }
+        }
+        else if((upward == true) ? (x < rule->clear) : (x > rule->clear))
+        {
+            rule->active = false;
+            alarm_event(i, false, x, now_us);
+        }
+    }
+    alarm_stats.evaluations++;
+    alarm_stats.eval_us_last = (uint32_t)(esp_timer_get_time() - run_start);
+    if(alarm_stats.eval_us_last > alarm_stats.eval_us_max)
+    {
+        alarm_stats.eval_us_max = alarm_stats.eval_us_last;
+    }
+}
+
+uint32_t fpm_alarm_seq_next(void)
+{
+    return alarm_seq_next;
+}
+
+uint32_t fpm_alarm_seq_oldest(void)
+{
+    return (alarm_seq_next > ALARM_EVENT_COUNT) ? (alarm_seq_next - ALARM_EVENT_COUNT) : 1;
+}
+
+// "&console#alarm=" message of an event still in the ring; false once it was overwritten.
+bool fpm_alarm_event_msg(uint32_t seq, char *buf, uint16_t size)
+{
+    static fpm_alarm_event_t *event;
+    static fpm_alarm_rule_t *rule;
+    event = &alarm_events[seq % ALARM_EVENT_COUNT];
+    if((seq >= alarm_seq_next) || (event->seq != seq))
+    {
+        return false;
+    }
+    rule = &alarm_rules[event->rule];
+    snprintf(buf, size, "&console#alarm={\"seq\":%lu,\"id\":%u,\"name\":\"%s\",\"reg\":%u,\"sev\":%u,\"on\":%u,\"v\":%.3f,\"lim\":%.3f,\"t\":%llu,\"us\":%lld}",
+             event->seq, event->rule, rule->name, rule->reg, rule->severity, (event->active == true) ? 1 : 0, event->value, rule->trip, (unsigned long long)event->utc_ms, (long long)event->mono_us);
+    return true;
+}
+
+char *fpm_alarm_stats_json(void)
+{
+    static uint8_t i;
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    cJSON *active_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(stats_json_obj, "rules", cJSON_CreateNumber(alarm_rule_count));
+    cJSON_AddItemToObject(stats_json_obj, "rejected", cJSON_CreateNumber(alarm_stats.rejected));
+    cJSON_AddItemToObject(stats_json_obj, "events", cJSON_CreateNumber(alarm_stats.events));
+    cJSON_AddItemToObject(stats_json_obj, "evals", cJSON_CreateNumber(alarm_stats.evaluations));
+    cJSON_AddItemToObject(stats_json_obj, "evaluslast", cJSON_CreateNumber(alarm_stats.eval_us_last));
+    cJSON_AddItemToObject(stats_json_obj, "evalusmax", cJSON_CreateNumber(alarm_stats.eval_us_max));
+    for(i = 0; i < alarm_rule_count; i++)
+    {
+        if(alarm_rules[i].active == true)
+        {
+            cJSON_AddItemToArray(active_array, cJSON_CreateString(alarm_rules[i].name));
+        }
+    }
+    cJSON_AddItemToObject(stats_json_obj, "active", active_array);
+    char *json_print = cJSON_PrintUnformatted(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
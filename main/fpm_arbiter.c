@@ -0,0 +1,198 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+#define ARBITER_MAX_TRANSACTIONS 8
+#define ARBITER_STARVATION_PERIOD 5000
+
+typedef struct
+{
+    bool in_use;
+    _enum_fpm_arbiter_class txn_class;
+    uint8_t priority;
+    uint32_t submit_timestamp;
+    uint32_t wait_timestamp;
+    uint32_t deadline_timestamp;
+    uint32_t due_timestamp;
+    uint32_t step_deadline;
+    fpm_arbiter_step_fn step;
+    fpm_arbiter_done_fn done;
+    void *ctx;
+}fpm_arbiter_txn_t;
+
+static const char *TAG = "ARBITER";
+
+static fpm_arbiter_txn_t arbiter_txn[ARBITER_MAX_TRANSACTIONS];
+static fpm_arbiter_txn_t *arbiter_active = NULL;
+fpm_arbiter_stats_t arbiter_stats[ARBITER_CLASS_COUNT];
+
+const char *arbiter_class_name[ARBITER_CLASS_COUNT] = {"poll", "write", "burst"};
+
+// deadline_ms is when the whole transaction is due and what "missed" is counted against.
+// A transaction that yields between steps can pass step_deadline_ms: each time it yields
+// its scheduling deadline is moved to that far ahead, so a long sweep that has run past
+// its own deadline does not outrank every write and burst submitted after it.
+int8_t fpm_arbiter_submit(_enum_fpm_arbiter_class txn_class, uint8_t priority, uint32_t deadline_ms, uint32_t step_deadline_ms, fpm_arbiter_step_fn step, fpm_arbiter_done_fn done, void *ctx)
+{
+    static uint8_t i;
+    for(i = 0; i < ARBITER_MAX_TRANSACTIONS; i++)
+    {
+        if(arbiter_txn[i].in_use == false)
+        {
+            arbiter_txn[i].txn_class = txn_class;
+            arbiter_txn[i].priority = priority;
+            arbiter_txn[i].submit_timestamp = xTaskGetTickCount();
+            arbiter_txn[i].wait_timestamp = arbiter_txn[i].submit_timestamp;
+            arbiter_txn[i].deadline_timestamp = arbiter_txn[i].submit_timestamp + deadline_ms;
+            arbiter_txn[i].due_timestamp = arbiter_txn[i].deadline_timestamp;
+            arbiter_txn[i].step_deadline = step_deadline_ms;
+            arbiter_txn[i].step = step;
+            arbiter_txn[i].done = done;
+            arbiter_txn[i].ctx = ctx;
+            arbiter_txn[i].in_use = true;
+            arbiter_stats[txn_class].submitted++;
+            return (int8_t)i;
+        }
+    }
+    arbiter_stats[txn_class].rejected++;
+    ESP_LOGI(TAG, "Transaction table full, %s rejected", arbiter_class_name[txn_class]);
+    return -1;
+}
+
+bool fpm_arbiter_pending(_enum_fpm_arbiter_class txn_class)
+{
+    static uint8_t i;
+    for(i = 0; i < ARBITER_MAX_TRANSACTIONS; i++)
+    {
+        if((arbiter_txn[i].in_use == true) && (arbiter_txn[i].txn_class == txn_class))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Earliest deadline first, ties broken by priority. A transaction left waiting
+// longer than ARBITER_STARVATION_PERIOD since it last ran goes ahead of everything
+// else, oldest first, so a stream of tight-deadline requests cannot lock it out.
+static fpm_arbiter_txn_t *arbiter_pick(void)
+{
+    static fpm_arbiter_txn_t *pick;
+    static fpm_arbiter_txn_t *starved;
+    static uint32_t now;
+    static uint8_t i;
+    pick = NULL;
+    starved = NULL;
+    now = xTaskGetTickCount();
+    for(i = 0; i < ARBITER_MAX_TRANSACTIONS; i++)
+    {
+        if(arbiter_txn[i].in_use == false)
+        {
+            continue;
+        }
+        if(now - arbiter_txn[i].wait_timestamp > ARBITER_STARVATION_PERIOD)
+        {
+            if((starved == NULL) || ((int32_t)(arbiter_txn[i].wait_timestamp - starved->wait_timestamp) < 0))
+            {
+                starved = &arbiter_txn[i];
+            }
+        }
+        if((pick == NULL)
+        || ((int32_t)(arbiter_txn[i].deadline_timestamp - pick->deadline_timestamp) < 0)
+        || ((arbiter_txn[i].deadline_timestamp == pick->deadline_timestamp) && (arbiter_txn[i].priority > pick->priority)))
+        {
+            pick = &arbiter_txn[i];
+        }
+    }
+    if(starved != NULL)
+    {
+        if(starved != pick)
+        {
+            arbiter_stats[starved->txn_class].starved++;
+        }
+        return starved;
+    }
+    return pick;
+}
+
+void fpm_arbiter_process(void)
+{
+    static _enum_fpm_arbiter_step step_result;
+    static fpm_arbiter_stats_t *stats;
+    static uint32_t now;
+    static uint32_t latency;
+    if(arbiter_active == NULL)
+    {
+        arbiter_active = arbiter_pick();
+        if(arbiter_active == NULL)
+        {
+            return;
+        }
+    }
+    step_result = arbiter_active->step(arbiter_active->ctx);
+    switch(step_result)
+    {
+        case ARBITER_STEP_DONE:
+            now = xTaskGetTickCount();
+            stats = &arbiter_stats[arbiter_active->txn_class];
+            stats->completed++;
+            latency = now - arbiter_active->submit_timestamp;
+            if(latency > stats->max_latency)
+            {
+                stats->max_latency = latency;
+            }
+            if((int32_t)(now - arbiter_active->due_timestamp) > 0)
+            {
+                stats->missed++;
+            }
+            arbiter_active->in_use = false;
+            if(arbiter_active->done != NULL)
+            {
+                arbiter_active->done(arbiter_active->ctx);
+            }
+            arbiter_active = NULL;
+        break;
+        case ARBITER_STEP_YIELD:
+            arbiter_active->wait_timestamp = xTaskGetTickCount();
+            if(arbiter_active->step_deadline != 0)
+            {
+                arbiter_active->deadline_timestamp = arbiter_active->wait_timestamp + arbiter_active->step_deadline;
+            }
+            arbiter_active = NULL;
+        break;
+        default:
+        break;
+    }
+}
+
+char *fpm_arbiter_stats_json(void)
+{
+    static uint8_t i;
+    cJSON *valuejSON;
+    cJSON *class_json_obj;
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    for(i = 0; i < ARBITER_CLASS_COUNT; i++)
+    {
+        class_json_obj = cJSON_CreateObject();
+        cJSON_AddItemToObject(stats_json_obj, arbiter_class_name[i], class_json_obj);
+        valuejSON = cJSON_CreateNumber(arbiter_stats[i].submitted);
+        cJSON_AddItemToObject(class_json_obj, "submitted", valuejSON);
+        valuejSON = cJSON_CreateNumber(arbiter_stats[i].completed);
+        cJSON_AddItemToObject(class_json_obj, "completed", valuejSON);
+        valuejSON = cJSON_CreateNumber(arbiter_stats[i].missed);
+        cJSON_AddItemToObject(class_json_obj, "missed", valuejSON);
+        valuejSON = cJSON_CreateNumber(arbiter_stats[i].starved);
+        cJSON_AddItemToObject(class_json_obj, "starved", valuejSON);
+        valuejSON = cJSON_CreateNumber(arbiter_stats[i].rejected);
+        cJSON_AddItemToObject(class_json_obj, "rejected", valuejSON);
+        valuejSON = cJSON_CreateNumber(arbiter_stats[i].max_latency);
+        cJSON_AddItemToObject(class_json_obj, "maxlatency", valuejSON);
+    }
+    char *json_print = cJSON_Print(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
@@ -0,0 +1,331 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <math.h>
+#include <sys/time.h>
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+// 0x5000-0x5011: voltage, L1-L3 voltage, frequency, current, L1-L3 current, all floats
+#define BURST_BLOCK_START 0x5000
+#define BURST_BLOCK_REGS 18
+#define BURST_ARBITER_PRIORITY 2
+#define BURST_ARBITER_DEADLINE 20
+#define BURST_CURRENT_STEP_MIN 5.0f
+
+typedef enum
+{
+    BURST_CH_V1,
+    BURST_CH_V2,
+    BURST_CH_V3,
+    BURST_CH_I1,
+    BURST_CH_I2,
+    BURST_CH_I3,
+    BURST_CH_F,
+    BURST_CH_COUNT
+}_enum_fpm_burst_channel;
+
+typedef struct
+{
+    int32_t t_ms;
+    float value[BURST_CH_COUNT];
+}fpm_burst_sample_t;
+
+static const char *TAG = "BURST";
+
+// register offset in the block and descriptor register of each channel
+static const uint8_t burst_block_offset[BURST_CH_COUNT] = {2, 4, 6, 12, 14, 16, 8};
+static const uint16_t burst_channel_reg[BURST_CH_COUNT] = {0x5002, 0x5004, 0x5006, 0x500C, 0x500E, 0x5010, 0x5008};
+static const char *burst_channel_name[BURST_CH_COUNT] = {"v1", "v2", "v3", "i1", "i2", "i3", "f"};
+
+static int16_t burst_channel_cid[BURST_CH_COUNT];
+static bool burst_resolved = false;
+static fpm_burst_sample_t burst_pre[BURST_MAX_PRE];
+static int64_t burst_pre_us[BURST_MAX_PRE];
+static uint8_t burst_pre_next;
+static uint8_t burst_pre_count;
+static fpm_burst_sample_t burst_event[BURST_MAX_PRE + BURST_MAX_POST];
+static uint16_t burst_event_count;
+static uint16_t burst_post_count;
+static float burst_last_current[3];
+static bool burst_have_last = false;
+static bool burst_armed = true;
+static bool burst_active = false;
+static int64_t burst_trigger_us;
+static uint64_t burst_trigger_utc_ms;
+static char burst_cause[24];
+static uint16_t burst_regs[BURST_BLOCK_REGS];
+static bool burst_read_ok;
+char metermsg_burst[BURST_MSG_SIZE];
+uint16_t metermsg_burst_len;
+fpm_burst_stats_t burst_stats;
+
+static float burst_block_float(uint8_t offset)
+{
+    static uint32_t raw;
+    static float value;
+    raw = ((uint32_t)burst_regs[offset] << 16) | burst_regs[offset + 1];
+    memcpy(&value, &raw, sizeof(value));
+    return value;
+}
+
+// Pre-trigger band: narrower than the alarm limits, so the burst is already running
+// when a sag or a spike develops. Returns true with the cause set on a crossing.
+static bool burst_check(const fpm_burst_sample_t *sample)
+{
+    static float band;
+    static float step;
+    static uint8_t i;
+    static bool outside;
+    outside = false;
+    band = (CONFIG_FPM_BURST_NOMINAL_V * CONFIG_FPM_BURST_VOLTAGE_BAND) / 100.0f;
+    for(i = 0; i < 3; i++)
+    {
+        if(fabsf(sample->value[BURST_CH_V1 + i] - CONFIG_FPM_BURST_NOMINAL_V) > band)
+        {
+            if(outside == false)
+            {
+                sprintf(burst_cause, "%s %s", burst_channel_name[BURST_CH_V1 + i], (sample->value[BURST_CH_V1 + i] < CONFIG_FPM_BURST_NOMINAL_V) ? "low" : "high");
+            }
+            outside = true;
+        }
+    }
+    for(i = 0; i < 3; i++)
+    {
+        if(burst_have_last == true)
+        {
+            step = (burst_last_current[i] * CONFIG_FPM_BURST_CURRENT_STEP) / 100.0f;
+            step = (step < BURST_CURRENT_STEP_MIN) ? BURST_CURRENT_STEP_MIN : step;
+            if((fabsf(sample->value[BURST_CH_I1 + i] - burst_last_current[i]) > step) && (outside == false))
+            {
+                sprintf(burst_cause, "%s step", burst_channel_name[BURST_CH_I1 + i]);
+                outside = true;
+            }
+        }
+        burst_last_current[i] = sample->value[BURST_CH_I1 + i];
+    }
+    burst_have_last = true;
+    // edge triggered: one capture per excursion, re-armed once everything is back
+    if(outside == false)
+    {
+        burst_armed = true;
+        return false;
+    }
+    if(burst_armed == false)
+    {
+        return false;
+    }
+    burst_armed = false;
+    return true;
+}
+
+static bool burst_append(uint16_t *len, const char *fmt, ...)
+{
+    static va_list args;
+    static int written;
+    // room is left for the "*cntid" suffix clientSendWs adds
+    if(*len >= BURST_MSG_SIZE - 16)
+    {
+        return false;
+    }
+    va_start(args, fmt);
+    written = vsnprintf(&metermsg_burst[*len], BURST_MSG_SIZE - 16 - *len, fmt, args);
+    va_end(args);
+    if((written < 0) || (*len + written >= BURST_MSG_SIZE - 16))
+    {
+        *len = BURST_MSG_SIZE;
+        return false;
+    }
+    *len += written;
+    return true;
+}
+
+// Columnar record, one array per channel, so the whole event goes out as one message.
+static void burst_publish(void)
+{
+    static uint16_t len;
+    static uint16_t i;
+    static uint8_t ch;
+    len = 0;
+    burst_append(&len, "&console#burst={\"t0\":%llu,\"us0\":%lld,\"cause\":\"%s\",\"pre\":%u,\"n\":%u,\"dt\":[",
+                 (unsigned long long)burst_trigger_utc_ms, (long long)burst_trigger_us, burst_cause, burst_event_count - burst_post_count, burst_event_count);
+    for(i = 0; i < burst_event_count; i++)
+    {
+        burst_append(&len, "%s%ld", (i == 0) ? "" : ",", burst_event[i].t_ms);
+    }
+    for(ch = 0; ch < BURST_CH_COUNT; ch++)
+    {
+        burst_append(&len, "],\"%s\":[", burst_channel_name[ch]);
+        for(i = 0; i < burst_event_count; i++)
+        {
+            burst_append(&len, "%s%.2f", (i == 0) ? "" : ",", burst_event[i].value[ch]);
+        }
+    }
+    if(burst_append(&len, "]}") == false)
+    {
+        ESP_LOGI(TAG, "Burst record too large, dropped");
+        burst_stats.dropped++;
+        return;
+    }
+    metermsg_burst_len = len;
+    burst_stats.events++;
+    burst_stats.last_samples = burst_event_count;
+    ESP_LOGI(TAG, "Burst %s: %u samples", burst_cause, burst_event_count);
+    SetBurstSend();
+}
+
+static void burst_finish(void)
+{
+    static int64_t span_us;
+    burst_active = false;
+    span_us = esp_timer_get_time() - burst_trigger_us;
+    burst_stats.last_rate = (span_us > 0) ? (uint32_t)(((int64_t)burst_post_count * 1000000) / span_us) : 0;
+    burst_publish();
+}
+
+static _enum_fpm_arbiter_step BurstStep(void *ctx)
+{
+    switch(fpm_modbus_read_block(BURST_BLOCK_START, BURST_BLOCK_REGS, burst_regs))
+    {
+        case MODBUSBLOCK_OK:
+            burst_stats.reads++;
+            burst_read_ok = true;
+            return ARBITER_STEP_DONE;
+        case MODBUSBLOCK_FAIL:
+            burst_stats.failed++;
+            burst_read_ok = false;
+            return ARBITER_STEP_DONE;
+        default:
+            return ARBITER_STEP_BUSY;
+    }
+}
+
+// One block read done: store it and queue the next one until the window is over.
+static void BurstDone(void *ctx)
+{
+    static fpm_burst_sample_t *sample;
+    static int64_t now_us;
+    static uint8_t ch;
+    now_us = esp_timer_get_time();
+    if(burst_read_ok == true)
+    {
+        sample = &burst_event[burst_event_count];
+        sample->t_ms = (int32_t)((now_us - burst_trigger_us) / 1000);
+        for(ch = 0; ch < BURST_CH_COUNT; ch++)
+        {
+            sample->value[ch] = burst_block_float(burst_block_offset[ch]);
+        }
+        burst_event_count++;
+        burst_post_count++;
+        burst_stats.samples++;
+    }
+    if((now_us - burst_trigger_us >= (int64_t)CONFIG_FPM_BURST_WINDOW_MS * 1000) || (burst_post_count >= BURST_MAX_POST))
+    {
+        burst_finish();
+        return;
+    }
+    if(fpm_arbiter_submit(ARBITER_CLASS_BURST, BURST_ARBITER_PRIORITY, BURST_ARBITER_DEADLINE, 0, BurstStep, BurstDone, NULL) < 0)
+    {
+        burst_finish();
+    }
+}
+
+static void burst_start(void)
+{
+    static struct timeval tv;
+    static uint8_t i;
+    static uint8_t slot;
+    burst_trigger_us = esp_timer_get_time();
+    burst_trigger_utc_ms = 0;
+    if(sntp_time_valid == true)
+    {
+        gettimeofday(&tv, NULL);
+        burst_trigger_utc_ms = ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+    }
+    // the pre-trigger ring, oldest first, leads the event
+    burst_event_count = 0;
+    burst_post_count = 0;
+    for(i = 0; i < burst_pre_count; i++)
+    {
+        slot = (burst_pre_next + BURST_MAX_PRE - burst_pre_count + i) % BURST_MAX_PRE;
+        burst_event[burst_event_count] = burst_pre[slot];
+        burst_event[burst_event_count].t_ms = (int32_t)((burst_pre_us[slot] - burst_trigger_us) / 1000);
+        burst_event_count++;
+    }
+    if(fpm_arbiter_submit(ARBITER_CLASS_BURST, BURST_ARBITER_PRIORITY, BURST_ARBITER_DEADLINE, 0, BurstStep, BurstDone, NULL) < 0)
+    {
+        return;
+    }
+    burst_active = true;
+    burst_stats.triggers++;
+}
+
+// Called after every normal sweep: keeps the pre-trigger ring at the sweep rate and
+// starts a burst when a phase leaves the band.
+void fpm_burst_sample(void)
+{
+    static fpm_burst_sample_t sample;
+    static uint8_t quality;
+    static uint8_t ch;
+    if((CONFIG_FPM_BURST_WINDOW_MS == 0) || (burst_active == true))
+    {
+        return;
+    }
+    if(burst_resolved == false)
+    {
+        for(ch = 0; ch < BURST_CH_COUNT; ch++)
+        {
+            burst_channel_cid[ch] = fpm_modbus_sample_index(burst_channel_reg[ch]);
+        }
+        burst_resolved = true;
+    }
+    for(ch = 0; ch < BURST_CH_COUNT; ch++)
+    {
+        if((burst_channel_cid[ch] < 0)
+        || (fpm_modbus_sample_at((uint16_t)burst_channel_cid[ch], &sample.value[ch], &quality) == false)
+        || (quality != SAMPLE_QUALITY_GOOD))
+        {
+            return;
+        }
+    }
+    // t_ms is filled in relative to the trigger when an event starts
+    burst_pre[burst_pre_next] = sample;
+    burst_pre_us[burst_pre_next] = esp_timer_get_time();
+    burst_pre_next = (burst_pre_next + 1) % BURST_MAX_PRE;
+    if(burst_pre_count < CONFIG_FPM_BURST_PRE_SAMPLES)
+    {
+        burst_pre_count++;
+    }
+    if(burst_check(&sample) == true)
+    {
+        burst_start();
+    }
+}
+
+bool fpm_burst_active(void)
+{
+    return burst_active;
+}
+
+char *fpm_burst_stats_json(void)
+{
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    cJSON_AddItemToObject(stats_json_obj, "active", cJSON_CreateBool(burst_active));
+    cJSON_AddItemToObject(stats_json_obj, "triggers", cJSON_CreateNumber(burst_stats.triggers));
+    cJSON_AddItemToObject(stats_json_obj, "events", cJSON_CreateNumber(burst_stats.events));
+    cJSON_AddItemToObject(stats_json_obj, "reads", cJSON_CreateNumber(burst_stats.reads));
+    cJSON_AddItemToObject(stats_json_obj, "failed", cJSON_CreateNumber(burst_stats.failed));
+    cJSON_AddItemToObject(stats_json_obj, "dropped", cJSON_CreateNumber(burst_stats.dropped));
+    cJSON_AddItemToObject(stats_json_obj, "samples", cJSON_CreateNumber(burst_stats.samples));
+    cJSON_AddItemToObject(stats_json_obj, "lastsamples", cJSON_CreateNumber(burst_stats.last_samples));
+    cJSON_AddItemToObject(stats_json_obj, "lastrate", cJSON_CreateNumber(burst_stats.last_rate));
+    char *json_print = cJSON_PrintUnformatted(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
@@ -0,0 +1,266 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include <math.h>
+#include "cJSON.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+#define DERIVED_PI 3.14159265f
+#define DERIVED_MIN_MEAN 0.05f
+#define DERIVED_DEMAND_WINDOW_SEC ((uint32_t)CONFIG_FPM_DEMAND_MINUTES * 60)
+#define DERIVED_DEMAND_SLOT_SEC (DERIVED_DEMAND_WINDOW_SEC / DERIVED_DEMAND_SLOTS)
+// a gap longer than this is not integrated, the meter was not being read
+#define DERIVED_DEMAND_MAX_STEP_US (30 * 1000000LL)
+
+typedef enum
+{
+    DERIVED_IN_L1_VOLTAGE,
+    DERIVED_IN_L2_VOLTAGE,
+    DERIVED_IN_L3_VOLTAGE,
+    DERIVED_IN_L1_CURRENT,
+    DERIVED_IN_L2_CURRENT,
+    DERIVED_IN_L3_CURRENT,
+    DERIVED_IN_L1_ACTIVE,
+    DERIVED_IN_L2_ACTIVE,
+    DERIVED_IN_L3_ACTIVE,
+    DERIVED_IN_L1_REACTIVE,
+    DERIVED_IN_L2_REACTIVE,
+    DERIVED_IN_L3_REACTIVE,
+    DERIVED_IN_TOTAL_ACTIVE,
+    DERIVED_IN_METER_AMPS,
+    DERIVED_IN_COUNT
+}_enum_fpm_derived_input;
+
+static const uint16_t derived_input_reg[DERIVED_IN_COUNT] =
+{
+    0x5002, 0x5004, 0x5006,
+    0x500C, 0x500E, 0x5010,
+    0x5014, 0x5016, 0x5018,
+    0x501C, 0x501E, 0x5020,
+    0x5012,
+    0x400B
+};
+
+// Phase angle of each line voltage, positive sequence L1-L2-L3.
+static const float derived_phase_angle[3] = {0, -2 * DERIVED_PI / 3, 2 * DERIVED_PI / 3};
+
+static float derived_in[DERIVED_IN_COUNT];
+static bool derived_in_valid[DERIVED_IN_COUNT];
+static float derived_slot_energy[DERIVED_DEMAND_SLOTS];
+static float derived_slot_seconds[DERIVED_DEMAND_SLOTS];
+static float derived_window_energy;
+static float derived_window_seconds;
+static int64_t derived_slot_no;
+static int64_t derived_first_slot_no;
+static int64_t derived_last_us;
+static bool derived_started;
+fpm_derived_t derived;
+
+static bool derived_phases_valid(uint8_t first)
+{
+    return (derived_in_valid[first] == true) && (derived_in_valid[first + 1] == true) && (derived_in_valid[first + 2] == true);
+}
+
+// NEMA definition: largest deviation from the mean over the mean, in %.
+static float derived_unbalance(const float *phase)
+{
+    static float avg;
+    static float dev;
+    static uint8_t i;
+    avg = (phase[0] + phase[1] + phase[2]) / 3;
+    if(avg < DERIVED_MIN_MEAN)
+    {
+        return 0;
+    }
+    dev = 0;
+    for(i = 0; i < 3; i++)
+    {
+        dev = (fabsf(phase[i] - avg) > dev) ? fabsf(phase[i] - avg) : dev;
+    }
+    return (dev * 100) / avg;
+}
+
+// Phasor sum of the line currents. Each current lags its voltage by atan2(Q, P); with
+// no usable P/Q the phase is taken at unity power factor.
+static float derived_neutral_current(void)
+{
+    static float re;
+    static float im;
+    static float angle;
+    static uint8_t i;
+    re = 0;
+    im = 0;
+    for(i = 0; i < 3; i++)
+    {
+        angle = derived_phase_angle[i];
+        if((derived_in_valid[DERIVED_IN_L1_ACTIVE + i] == true) && (derived_in_valid[DERIVED_IN_L1_REACTIVE + i] == true))
+        {
+            angle -= atan2f(derived_in[DERIVED_IN_L1_REACTIVE + i], derived_in[DERIVED_IN_L1_ACTIVE + i]);
+        }
+        re += derived_in[DERIVED_IN_L1_CURRENT + i] * cosf(angle);
+        im += derived_in[DERIVED_IN_L1_CURRENT + i] * sinf(angle);
+    }
+    return sqrtf((re * re) + (im * im));
+}
+
+// Sliding demand window as a ring of fixed slots holding kW*s and covered seconds,
+// with running totals: each sweep adds to the current slot and retires at most the
+// slots it skipped over, so the cost does not depend on the window length.
+static void derived_demand(int64_t now_us, float power_kw)
+{
+    static int64_t slot_no;
+    static int64_t step_us;
+    static uint16_t slot;
+    slot_no = now_us / ((int64_t)DERIVED_DEMAND_SLOT_SEC * 1000000);
+    if(derived_started == false)
+    {
+        derived_started = true;
+        derived_slot_no = slot_no;
+        derived_first_slot_no = slot_no;
+        derived_last_us = now_us;
+        return;
+    }
+    while(derived_slot_no < slot_no)
+    {
+        derived_slot_no++;
+        if(slot_no - derived_slot_no >= DERIVED_DEMAND_SLOTS)
+        {
+            // the whole window went by without a sample
+            memset(derived_slot_energy, 0, sizeof(derived_slot_energy));
+            memset(derived_slot_seconds, 0, sizeof(derived_slot_seconds));
+            derived_window_energy = 0;
+            derived_window_seconds = 0;
+            derived_first_slot_no = slot_no;
+            derived_slot_no = slot_no;
+            break;
+        }
+        slot = derived_slot_no % DERIVED_DEMAND_SLOTS;
+        derived_window_energy -= derived_slot_energy[slot];
+        derived_window_seconds -= derived_slot_seconds[slot];
+        derived_slot_energy[slot] = 0;
+        derived_slot_seconds[slot] = 0;
+    }
+    step_us = now_us - derived_last_us;
+    derived_last_us = now_us;
+    if((step_us <= 0) || (step_us > DERIVED_DEMAND_MAX_STEP_US) || (isnan(power_kw) == true))
+    {
+        return;
+    }
+    slot = slot_no % DERIVED_DEMAND_SLOTS;
+    derived_slot_energy[slot] += power_kw * (step_us / 1e6f);
+    derived_slot_seconds[slot] += step_us / 1e6f;
+    derived_window_energy += power_kw * (step_us / 1e6f);
+    derived_window_seconds += step_us / 1e6f;
+    if((derived_window_energy < 0) || (derived_window_seconds < 0))
+    {
+        // float drift of the running totals, resync from the slots
+        derived_window_energy = 0;
+        derived_window_seconds = 0;
+        for(slot = 0; slot < DERIVED_DEMAND_SLOTS; slot++)
+        {
+            derived_window_energy += derived_slot_energy[slot];
+            derived_window_seconds += derived_slot_seconds[slot];
+        }
+    }
+}
+
+// Called once per completed sweep, before the rdmeter message is built.
+void fpm_derived_sample(int64_t sweep_mono_us, uint64_t sweep_utc_ms)
+{
+    static fpm_sample_meta_t meta;
+    static uint8_t i;
+    for(i = 0; i < DERIVED_IN_COUNT; i++)
+    {
+        derived_in_valid[i] = false;
+        if(fpm_modbus_get_sample(derived_input_reg[i], &derived_in[i], &meta) == false)
+        {
+            continue;
+        }
+        // the rating comes from the startup info read, it is never refreshed
+        derived_in_valid[i] = (i == DERIVED_IN_METER_AMPS) ? (derived_in[i] > 0) : ((meta.quality == SAMPLE_QUALITY_GOOD) && (isnan(derived_in[i]) == false));
+    }
+    derived.flags = 0;
+    if(derived_phases_valid(DERIVED_IN_L1_VOLTAGE) == true)
+    {
+        derived.voltage_unbalance = derived_unbalance(&derived_in[DERIVED_IN_L1_VOLTAGE]);
+        derived.flags |= DERIVED_FLAG_VOLTAGE;
+    }
+    if(derived_phases_valid(DERIVED_IN_L1_CURRENT) == true)
+    {
+        derived.current_unbalance = derived_unbalance(&derived_in[DERIVED_IN_L1_CURRENT]);
+        derived.neutral_current = derived_neutral_current();
+        derived.flags |= DERIVED_FLAG_CURRENT;
+        if(derived_in_valid[DERIVED_IN_METER_AMPS] == true)
+        {
+            for(i = 0; i < 3; i++)
+            {
+                derived.loading[i] = (derived_in[DERIVED_IN_L1_CURRENT + i] * 100) / derived_in[DERIVED_IN_METER_AMPS];
+            }
+            derived.flags |= DERIVED_FLAG_LOADING;
+        }
+    }
+    derived_demand(sweep_mono_us, (derived_in_valid[DERIVED_IN_TOTAL_ACTIVE] == true) ? derived_in[DERIVED_IN_TOTAL_ACTIVE] : NAN);
+    if(derived_window_seconds > 0)
+    {
+        derived.demand = derived_window_energy / derived_window_seconds;
+        derived.flags |= DERIVED_FLAG_DEMAND;
+        // max demand only counts once the window has been covered end to end
+        if((derived_slot_no - derived_first_slot_no >= DERIVED_DEMAND_SLOTS) && (((derived.flags_held & DERIVED_FLAG_DEMAND_MAX) == 0) || (derived.demand > derived.demand_max)))
+        {
+            derived.demand_max = derived.demand;
+            derived.demand_max_mono_us = sweep_mono_us;
+            derived.demand_max_utc_ms = (sntp_time_valid == true) ? sweep_utc_ms : 0;
+            derived.flags_held |= DERIVED_FLAG_DEMAND_MAX;
+        }
+    }
+}
+
+static double derived_round(float value)
+{
+    return round((double)value * 1000) / 1000;
+}
+
+// "derived" object of the rdmeter message; a value is left out when its inputs were
+// not good this sweep.
+void fpm_derived_json_add(cJSON *sensor_json_obj)
+{
+    static uint8_t i;
+    cJSON *derived_json_obj = cJSON_CreateObject();
+    if(derived.flags & DERIVED_FLAG_VOLTAGE)
+    {
+        cJSON_AddItemToObject(derived_json_obj, "vunb", cJSON_CreateNumber(derived_round(derived.voltage_unbalance)));
+    }
+    if(derived.flags & DERIVED_FLAG_CURRENT)
+    {
+        cJSON_AddItemToObject(derived_json_obj, "iunb", cJSON_CreateNumber(derived_round(derived.current_unbalance)));
+        cJSON_AddItemToObject(derived_json_obj, "in", cJSON_CreateNumber(derived_round(derived.neutral_current)));
+    }
+    if(derived.flags & DERIVED_FLAG_LOADING)
+    {
+        cJSON *loading_array = cJSON_CreateArray();
+        for(i = 0; i < 3; i++)
+        {
+            cJSON_AddItemToArray(loading_array, cJSON_CreateNumber(derived_round(derived.loading[i])));
+        }
+        cJSON_AddItemToObject(derived_json_obj, "load", loading_array);
+    }
+    if(derived.flags & DERIVED_FLAG_DEMAND)
+    {
+        cJSON_AddItemToObject(derived_json_obj, "dmd", cJSON_CreateNumber(derived_round(derived.demand)));
+        cJSON_AddItemToObject(derived_json_obj, "dmdwin", cJSON_CreateNumber(DERIVED_DEMAND_WINDOW_SEC));
+    }
+    if(derived.flags_held & DERIVED_FLAG_DEMAND_MAX)
+    {
+        cJSON_AddItemToObject(derived_json_obj, "mdmd", cJSON_CreateNumber(derived_round(derived.demand_max)));
+        if(derived.demand_max_utc_ms != 0)
+        {
+            cJSON_AddItemToObject(derived_json_obj, "mdmdt", cJSON_CreateNumber((double)derived.demand_max_utc_ms));
+        }
+        cJSON_AddItemToObject(derived_json_obj, "mdmdus", cJSON_CreateNumber((double)derived.demand_max_mono_us));
+    }
+    cJSON_AddItemToObject(sensor_json_obj, "derived", derived_json_obj);
+}
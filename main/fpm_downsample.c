@@ -0,0 +1,315 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include <math.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+typedef struct
+{
+    float sum_t;
+    float sum_v;
+    uint16_t count;
+    uint16_t next;
+}fpm_downsample_bucket_t;
+
+static fpm_trend_iter_t downsample_trend_it;
+static fpm_history_iter_t downsample_history_it;
+static fpm_downsample_bucket_t downsample_buckets[DOWNSAMPLE_MAX_POINTS];
+fpm_downsample_stats_t downsample_stats;
+
+// Restarts the scan of the selected source; the trend ring has no index so it is
+// filtered on the fly, the history log seeks.
+static bool downsample_rewind(const fpm_downsample_query_t *query)
+{
+    if(query->source == DOWNSAMPLE_SOURCE_TREND)
+    {
+        fpm_trend_open(&downsample_trend_it);
+        return true;
+    }
+    return fpm_history_seek(&downsample_history_it, query->from_time, query->to_time, (query->source == DOWNSAMPLE_SOURCE_1MIN) ? HISTORY_RECORD_1MIN : HISTORY_RECORD_15MIN);
+}
+
+// Next usable value of the channel in the range; gaps ("no value") are skipped.
+static bool downsample_next(const fpm_downsample_query_t *query, uint64_t *time_ms, int16_t *value)
+{
+    static fpm_trend_record_t trend_record;
+    static fpm_history_record_t history_record;
+    if(query->source == DOWNSAMPLE_SOURCE_TREND)
+    {
+        while(fpm_trend_next(&downsample_trend_it, &trend_record) == true)
+        {
+            downsample_stats.scanned++;
+            if((trend_record.time_sec < query->from_time) || (trend_record.time_sec > query->to_time) || (trend_record.value[query->channel] == INT16_MIN) || (trend_record.time_sec == 0))
+            {
+                continue;
+            }
+            *time_ms = ((uint64_t)trend_record.time_sec * 1000) + trend_record.time_ms;
+            *value = trend_record.value[query->channel];
+            return true;
+        }
+        return false;
+    }
+    while(fpm_history_next(&downsample_history_it, &history_record) == true)
+    {
+        downsample_stats.scanned++;
+        if(history_record.value[query->channel] == INT16_MIN)
+        {
+            continue;
+        }
+        *time_ms = (uint64_t)history_record.time_sec * 1000;
+        *value = history_record.value[query->channel];
+        return true;
+    }
+    return false;
+}
+
+static uint16_t downsample_bucket(uint64_t time_ms, uint64_t start_ms, uint64_t end_ms, uint16_t points)
+{
+    static uint64_t bucket;
+    if(time_ms >= end_ms)
+    {
+        return points - 1;
+    }
+    bucket = ((time_ms - start_ms) * points) / (end_ms - start_ms);
+    return (bucket >= points) ? (points - 1) : (uint16_t)bucket;
+}
+
+static uint64_t downsample_bucket_start(uint16_t bucket, uint64_t start_ms, uint64_t end_ms, uint16_t points)
+{
+    return start_ms + (((end_ms - start_ms) * bucket) / points);
+}
+
+// Range end: the requested one, or now when the request left it open.
+static uint64_t downsample_end_ms(const fpm_downsample_query_t *query)
+{
+    static struct timeval tv;
+    if(query->to_time != UINT32_MAX)
+    {
+        return ((uint64_t)query->to_time * 1000) + 999;
+    }
+    if((query->source != DOWNSAMPLE_SOURCE_TREND) || (sntp_time_valid == true))
+    {
+        gettimeofday(&tv, NULL);
+        return ((uint64_t)tv.tv_sec * 1000) + (tv.tv_usec / 1000);
+    }
+    return (uint64_t)esp_timer_get_time() / 1000;
+}
+
+// Fixed time buckets from the first value to the range end, one pass, one output
+// point per non-empty bucket with min/avg/max and count.
+static uint16_t downsample_minmax(const fpm_downsample_query_t *query, fpm_downsample_emit_t emit, void *ctx)
+{
+    static fpm_downsample_point_t point;
+    static uint64_t start_ms;
+    static uint64_t end_ms;
+    static uint64_t time_ms;
+    static int16_t value;
+    static int32_t sum;
+    static uint16_t bucket;
+    static uint16_t current;
+    static uint16_t emitted;
+    emitted = 0;
+    if(downsample_next(query, &time_ms, &value) == false)
+    {
+        return 0;
+    }
+    start_ms = time_ms;
+    end_ms = downsample_end_ms(query);
+    if(end_ms <= start_ms)
+    {
+        end_ms = start_ms + 1;
+    }
+    current = downsample_bucket(time_ms, start_ms, end_ms, query->points);
+    memset(&point, 0, sizeof(point));
+    point.min = value;
+    point.max = value;
+    point.time_ms = downsample_bucket_start(current, start_ms, end_ms, query->points);
+    sum = 0;
+    do
+    {
+        bucket = downsample_bucket(time_ms, start_ms, end_ms, query->points);
+        if(bucket != current)
+        {
+            point.avg = (float)sum / point.count;
+            if(emit(ctx, &point) == false)
+            {
+                return emitted;
+            }
+            emitted++;
+            current = bucket;
+            memset(&point, 0, sizeof(point));
+            point.min = value;
+            point.max = value;
+            point.time_ms = downsample_bucket_start(current, start_ms, end_ms, query->points);
+            sum = 0;
+        }
+        point.min = (value < point.min) ? value : point.min;
+        point.max = (value > point.max) ? value : point.max;
+        point.count++;
+        sum += value;
+    }while(downsample_next(query, &time_ms, &value) == true);
+    point.avg = (float)sum / point.count;
+    if(emit(ctx, &point) == true)
+    {
+        emitted++;
+    }
+    return emitted;
+}
+
+// Largest-Triangle-Three-Buckets over fixed time buckets. The first pass keeps only
+// the per-bucket mean, so memory is bounded by the point count; the second pass picks
+// in each bucket the value spanning the largest triangle with the point picked in the
+// previous bucket and the mean of the next non-empty one. Both passes are O(n).
+static uint16_t downsample_lttb(const fpm_downsample_query_t *query, fpm_downsample_emit_t emit, void *ctx)
+{
+    static fpm_downsample_point_t point;
+    static fpm_downsample_point_t best;
+    static fpm_downsample_bucket_t *next;
+    static uint16_t next_idx;
+    static float next_t;
+    static uint64_t start_ms;
+    static uint64_t end_ms;
+    static uint64_t time_ms;
+    static int16_t value;
+    static float a_t;
+    static float a_v;
+    static float area;
+    static float best_area;
+    static uint16_t bucket;
+    static uint16_t current;
+    static uint16_t last;
+    static uint16_t emitted;
+    static uint16_t i;
+    static bool have_best;
+    emitted = 0;
+    if(downsample_next(query, &time_ms, &value) == false)
+    {
+        return 0;
+    }
+    start_ms = time_ms;
+    end_ms = downsample_end_ms(query);
+    if(end_ms <= start_ms)
+    {
+        end_ms = start_ms + 1;
+    }
+    memset(downsample_buckets, 0, sizeof(fpm_downsample_bucket_t) * query->points);
+    last = 0;
+    do
+    {
+        bucket = downsample_bucket(time_ms, start_ms, end_ms, query->points);
+        downsample_buckets[bucket].sum_t += (float)(time_ms - downsample_bucket_start(bucket, start_ms, end_ms, query->points));
+        downsample_buckets[bucket].sum_v += value;
+        downsample_buckets[bucket].count++;
+        last = bucket;
+    }while(downsample_next(query, &time_ms, &value) == true);
+    // next non-empty bucket for each bucket, DOWNSAMPLE_MAX_POINTS for none
+    downsample_buckets[query->points - 1].next = DOWNSAMPLE_MAX_POINTS;
+    for(i = query->points - 1; i > 0; i--)
+    {
+        downsample_buckets[i - 1].next = (downsample_buckets[i].count != 0) ? i : downsample_buckets[i].next;
+    }
+    if(downsample_rewind(query) == false)
+    {
+        return 0;
+    }
+    current = DOWNSAMPLE_MAX_POINTS;
+    have_best = false;
+    a_t = 0;
+    a_v = 0;
+    best_area = -1;
+    memset(&point, 0, sizeof(point));
+    while(downsample_next(query, &time_ms, &value) == true)
+    {
+        if(time_ms < start_ms)
+        {
+            // the trend ring moved on between the passes
+            continue;
+        }
+        bucket = downsample_bucket(time_ms, start_ms, end_ms, query->points);
+        if(bucket != current)
+        {
+            if(have_best == true)
+            {
+                if(emit(ctx, &best) == false)
+                {
+                    return emitted;
+                }
+                emitted++;
+                a_t = (float)(best.time_ms - start_ms);
+                a_v = best.value;
+            }
+            current = bucket;
+            have_best = false;
+            best_area = -1;
+        }
+        point.time_ms = time_ms;
+        point.value = value;
+        point.min = value;
+        point.max = value;
+        point.avg = value;
+        point.count = 1;
+        if(emitted == 0)
+        {
+            // the first value is always kept
+            if(have_best == false)
+            {
+                best = point;
+                have_best = true;
+            }
+            continue;
+        }
+        if(bucket >= last)
+        {
+            // and so is the last one
+            best = point;
+            have_best = true;
+            continue;
+        }
+        next_idx = downsample_buckets[bucket].next;
+        next = &downsample_buckets[next_idx];
+        next_t = (float)(downsample_bucket_start(next_idx, start_ms, end_ms, query->points) - start_ms) + (next->sum_t / next->count);
+        area = fabsf(((a_t - next_t) * (value - a_v)) - ((a_t - (float)(time_ms - start_ms)) * ((next->sum_v / next->count) - a_v)));
+        if(area > best_area)
+        {
+            best_area = area;
+            best = point;
+            have_best = true;
+        }
+    }
+    if((have_best == true) && (emit(ctx, &best) == true))
+    {
+        emitted++;
+    }
+    return emitted;
+}
+
+// Streams the downsampled series of one channel through emit; emit returning false
+// stops the query. Returns the number of points emitted.
+uint16_t fpm_downsample_run(const fpm_downsample_query_t *query, fpm_downsample_emit_t emit, void *ctx)
+{
+    static int64_t run_start;
+    static uint16_t emitted;
+    if((query->channel >= TREND_CHANNEL_COUNT) || (query->points < 2) || (query->points > DOWNSAMPLE_MAX_POINTS))
+    {
+        return 0;
+    }
+    if(downsample_rewind(query) == false)
+    {
+        return 0;
+    }
+    run_start = esp_timer_get_time();
+    emitted = (query->mode == DOWNSAMPLE_MODE_LTTB) ? downsample_lttb(query, emit, ctx) : downsample_minmax(query, emit, ctx);
+    downsample_stats.queries++;
+    downsample_stats.emitted += emitted;
+    downsample_stats.run_us_last = (uint32_t)(esp_timer_get_time() - run_start);
+    if(downsample_stats.run_us_last > downsample_stats.run_us_max)
+    {
+        downsample_stats.run_us_max = downsample_stats.run_us_last;
+    }
+    return emitted;
+}
@@ -0,0 +1,388 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include "stddef.h"
+#include <stdio.h>
+#include <math.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "total_app.h"
+
+#define ENERGY_STATE_FILE "/data/energy.bin"
+#define ENERGY_STATE_MAGIC 0x45475945
+// no good reading for longer than this across a boundary flags the closed period
+#define ENERGY_LATE_SEC 120
+// records copied out per energy_mutex hold while a query runs
+#define ENERGY_QUERY_BATCH 16
+
+// Counter snapshot of a period that has not closed yet; persisted at every rollover so
+// a reboot does not lose where the running hour, day and month started.
+typedef struct
+{
+    uint32_t key;
+    uint32_t start_time;
+    float start[ENERGY_COUNTER_COUNT];
+    uint8_t flags;
+}fpm_energy_open_t;
+
+typedef struct
+{
+    uint32_t magic;
+    fpm_energy_open_t open[ENERGY_PERIOD_COUNT];
+    uint16_t crc;
+}fpm_energy_state_t;
+
+static const char *TAG = "ENERGY";
+
+// Cumulative meter counters, all kWh except the last (kvarh). The per-tariff split is
+// the meter's own T1-T4 registers.
+static const uint16_t energy_counter_reg[ENERGY_COUNTER_COUNT] = {0x6000, 0x6002, 0x6004, 0x604B, 0x604D, 0x600C, 0x6018, 0x6024};
+static const char *energy_counter_name[ENERGY_COUNTER_COUNT] = {"total", "t1", "t2", "t3", "t4", "fwd", "rev", "kvarh"};
+static const char *energy_period_name[ENERGY_PERIOD_COUNT] = {"hour", "day", "month"};
+static const char *energy_period_file[ENERGY_PERIOD_COUNT] = {"/data/energy_h.bin", "/data/energy_d.bin", "/data/energy_m.bin"};
+static const uint16_t energy_period_slots[ENERGY_PERIOD_COUNT] = {CONFIG_FPM_ENERGY_HOURS, CONFIG_FPM_ENERGY_DAYS, CONFIG_FPM_ENERGY_MONTHS};
+
+static SemaphoreHandle_t energy_mutex = NULL;
+static fpm_energy_state_t energy_state;
+static float energy_counter[ENERGY_COUNTER_COUNT];
+static uint32_t energy_last_utc;
+fpm_energy_stats_t energy_stats;
+
+static uint16_t energy_record_crc(const fpm_energy_record_t *record)
+{
+    return esp_rom_crc16_le(0, (const uint8_t*)record, offsetof(fpm_energy_record_t, crc));
+}
+
+static uint16_t energy_state_crc(const fpm_energy_state_t *state)
+{
+    return esp_rom_crc16_le(0, (const uint8_t*)state, offsetof(fpm_energy_state_t, crc));
+}
+
+// Days since 1970-01-01 of a civil date (proleptic Gregorian).
+static int32_t energy_days_from_civil(int32_t year, uint8_t month, uint8_t day)
+{
+    int32_t era;
+    uint32_t yoe;
+    uint32_t doy;
+    year -= (month <= 2) ? 1 : 0;
+    era = ((year >= 0) ? year : (year - 399)) / 400;
+    yoe = (uint32_t)(year - (era * 400));
+    doy = ((153 * (month + ((month > 2) ? -3 : 9))) + 2) / 5 + day - 1;
+    return (era * 146097) + (int32_t)((yoe * 365) + (yoe / 4) - (yoe / 100) + doy) - 719468;
+}
+
+// Period numbers of a UTC time in local time: hours and days since the epoch, months
+// since year 0. Records are keyed and slotted by these. Called from the main loop and
+// the httpd task, so it keeps nothing between calls.
+uint32_t fpm_energy_key(uint8_t period, uint32_t utc)
+{
+    struct tm timeinfo;
+    time_t t;
+    int32_t day;
+    t = (time_t)utc;
+    localtime_r(&t, &timeinfo);
+    day = energy_days_from_civil(timeinfo.tm_year + 1900, timeinfo.tm_mon + 1, timeinfo.tm_mday);
+    switch(period)
+    {
+        case ENERGY_PERIOD_HOUR: return (uint32_t)((day * 24) + timeinfo.tm_hour);
+        case ENERGY_PERIOD_DAY: return (uint32_t)day;
+        default: return (uint32_t)(((timeinfo.tm_year + 1900) * 12) + timeinfo.tm_mon);
+    }
+}
+
+const char *fpm_energy_counter_name(uint8_t counter)
+{
+    return (counter < ENERGY_COUNTER_COUNT) ? energy_counter_name[counter] : "";
+}
+
+const char *fpm_energy_period_name(uint8_t period)
+{
+    return (period < ENERGY_PERIOD_COUNT) ? energy_period_name[period] : "";
+}
+
+// Record files are fixed size rings of slots, slot = key % slots, created zeroed so
+// every write and read is a single seek.
+static void energy_file_prepare(uint8_t period)
+{
+    static struct stat st;
+    static uint8_t zero[sizeof(fpm_energy_record_t)];
+    static FILE *f;
+    static uint16_t i;
+    if((stat(energy_period_file[period], &st) == 0) && (st.st_size == (off_t)energy_period_slots[period] * sizeof(fpm_energy_record_t)))
+    {
+        return;
+    }
+    f = fopen(energy_period_file[period], "wb");
+    if(f == NULL)
+    {
+        ESP_LOGI(TAG, "Failed to create %s", energy_period_file[period]);
+        return;
+    }
+    memset(zero, 0, sizeof(zero));
+    for(i = 0; i < energy_period_slots[period]; i++)
+    {
+        fwrite(zero, 1, sizeof(zero), f);
+    }
+    fclose(f);
+}
+
+static void energy_state_save(void)
+{
+    static FILE *f;
+    energy_state.magic = ENERGY_STATE_MAGIC;
+    energy_state.crc = energy_state_crc(&energy_state);
+    f = fopen(ENERGY_STATE_FILE, "wb");
+    if(f == NULL)
+    {
+        ESP_LOGI(TAG, "Failed to save energy state");
+        return;
+    }
+    fwrite(&energy_state, 1, sizeof(energy_state), f);
+    fclose(f);
+    energy_stats.state_writes++;
+}
+
+static void energy_record_write(uint8_t period, fpm_energy_record_t *record)
+{
+    static FILE *f;
+    record->crc = energy_record_crc(record);
+    f = fopen(energy_period_file[period], "r+b");
+    if(f == NULL)
+    {
+        ESP_LOGI(TAG, "Failed to open %s", energy_period_file[period]);
+        return;
+    }
+    fseek(f, (long)(record->key % energy_period_slots[period]) * sizeof(fpm_energy_record_t), SEEK_SET);
+    fwrite(record, 1, sizeof(fpm_energy_record_t), f);
+    fclose(f);
+    energy_stats.records_written++;
+}
+
+void fpm_energy_init(void)
+{
+    static FILE *f;
+    static uint8_t period;
+    energy_mutex = xSemaphoreCreateMutex();
+    for(period = 0; period < ENERGY_PERIOD_COUNT; period++)
+    {
+        energy_file_prepare(period);
+    }
+    memset(&energy_state, 0, sizeof(energy_state));
+    f = fopen(ENERGY_STATE_FILE, "rb");
+    if(f != NULL)
+    {
+        if((fread(&energy_state, 1, sizeof(energy_state), f) != sizeof(energy_state))
+        || (energy_state.magic != ENERGY_STATE_MAGIC)
+        || (energy_state.crc != energy_state_crc(&energy_state)))
+        {
+            ESP_LOGI(TAG, "Energy state invalid, starting over");
+            memset(&energy_state, 0, sizeof(energy_state));
+        }
+        fclose(f);
+    }
+}
+
+// Reads every counter into a local set first; energy_counter is only replaced, under
+// energy_mutex, when the whole set is good so readers never see a half-updated sweep.
+static bool energy_read_counters(void)
+{
+    static float reading[ENERGY_COUNTER_COUNT];
+    static fpm_sample_meta_t meta;
+    static uint8_t i;
+    for(i = 0; i < ENERGY_COUNTER_COUNT; i++)
+    {
+        if((fpm_modbus_get_sample(energy_counter_reg[i], &reading[i], &meta) == false)
+        || (meta.quality != SAMPLE_QUALITY_GOOD)
+        || (isnan(reading[i]) == true))
+        {
+            return false;
+        }
+    }
+    xSemaphoreTake(energy_mutex, portMAX_DELAY);
+    memcpy(energy_counter, reading, sizeof(energy_counter));
+    xSemaphoreGive(energy_mutex);
+    return true;
+}
+
+static void energy_open(fpm_energy_open_t *open, uint32_t key, uint32_t now, uint8_t flags)
+{
+    open->key = key;
+    open->start_time = now;
+    open->flags = flags;
+    memcpy(open->start, energy_counter, sizeof(open->start));
+}
+
+// Called after every sweep. Needs wall time; until SNTP has synced nothing is opened,
+// and a period first opened mid-way is marked partial.
+void fpm_energy_sample(void)
+{
+    static fpm_energy_record_t record;
+    static fpm_energy_open_t *open;
+    static uint32_t now;
+    static uint32_t key;
+    static uint8_t period;
+    static uint8_t i;
+    static bool dirty;
+    if((sntp_time_valid == false) || (energy_read_counters() == false))
+    {
+        return;
+    }
+    now = (uint32_t)time(NULL);
+    dirty = false;
+    xSemaphoreTake(energy_mutex, portMAX_DELAY);
+    for(period = 0; period < ENERGY_PERIOD_COUNT; period++)
+    {
+        open = &energy_state.open[period];
+        key = fpm_energy_key(period, now);
+        if(open->key == 0)
+        {
+            energy_open(open, key, now, ENERGY_FLAG_PARTIAL);
+            dirty = true;
+            continue;
+        }
+        if(key == open->key)
+        {
+            continue;
+        }
+        memset(&record, 0, sizeof(record));
+        record.key = open->key;
+        record.start_time = open->start_time;
+        record.end_time = now;
+        record.type = period;
+        record.flags = open->flags;
+        if((key != open->key + 1) || (now - energy_last_utc > ENERGY_LATE_SEC))
+        {
+            // readings stopped across the boundary, the delta runs into the next period
+            record.flags |= ENERGY_FLAG_LATE;
+        }
+        for(i = 0; i < ENERGY_COUNTER_COUNT; i++)
+        {
+            record.delta[i] = (float)((double)energy_counter[i] - open->start[i]);
+            if(record.delta[i] < 0)
+            {
+                record.flags |= ENERGY_FLAG_RESET;
+            }
+        }
+        energy_record_write(period, &record);
+        energy_open(open, key, now, 0);
+        dirty = true;
+    }
+    if(dirty == true)
+    {
+        energy_state_save();
+    }
+    energy_last_utc = now;
+    xSemaphoreGive(energy_mutex);
+}
+
+// Running totals of the period in progress, as a record with end_time = last reading.
+bool fpm_energy_current(uint8_t period, fpm_energy_record_t *record)
+{
+    static uint8_t i;
+    if((period >= ENERGY_PERIOD_COUNT) || (energy_state.open[period].key == 0) || (energy_last_utc == 0))
+    {
+        return false;
+    }
+    xSemaphoreTake(energy_mutex, portMAX_DELAY);
+    memset(record, 0, sizeof(fpm_energy_record_t));
+    record->key = energy_state.open[period].key;
+    record->start_time = energy_state.open[period].start_time;
+    record->end_time = energy_last_utc;
+    record->type = period;
+    record->flags = energy_state.open[period].flags | ENERGY_FLAG_OPEN;
+    for(i = 0; i < ENERGY_COUNTER_COUNT; i++)
+    {
+        record->delta[i] = (float)((double)energy_counter[i] - energy_state.open[period].start[i]);
+    }
+    xSemaphoreGive(energy_mutex);
+    return true;
+}
+
+// Closed records of the periods from_time..to_time falls in, oldest first. Each period
+// is one direct slot read, so the cost is the number of periods asked for. Records are
+// copied out ENERGY_QUERY_BATCH at a time under energy_mutex and emitted after it is
+// released, so a slow client never holds up fpm_energy_sample on the main loop.
+uint16_t fpm_energy_query(uint8_t period, uint32_t from_time, uint32_t to_time, fpm_energy_emit_t emit, void *ctx)
+{
+    static fpm_energy_record_t batch[ENERGY_QUERY_BATCH];
+    static FILE *f;
+    static uint32_t key;
+    static uint32_t from_key;
+    static uint32_t to_key;
+    static uint16_t emitted;
+    static uint8_t count;
+    static uint8_t i;
+    static bool done;
+    if((period >= ENERGY_PERIOD_COUNT) || (sntp_time_valid == false))
+    {
+        return 0;
+    }
+    to_key = fpm_energy_key(period, (to_time == UINT32_MAX) ? (uint32_t)time(NULL) : to_time);
+    from_key = (from_time == 0) ? 0 : fpm_energy_key(period, from_time);
+    if((to_key < from_key) || (to_key - from_key >= energy_period_slots[period]))
+    {
+        from_key = (from_key > to_key) ? to_key : (to_key - energy_period_slots[period] + 1);
+    }
+    emitted = 0;
+    done = false;
+    key = from_key;
+    while((done == false) && (key <= to_key))
+    {
+        count = 0;
+        xSemaphoreTake(energy_mutex, portMAX_DELAY);
+        f = fopen(energy_period_file[period], "rb");
+        if(f == NULL)
+        {
+            xSemaphoreGive(energy_mutex);
+            break;
+        }
+        for(; (key <= to_key) && (count < ENERGY_QUERY_BATCH); key++)
+        {
+            fseek(f, (long)(key % energy_period_slots[period]) * sizeof(fpm_energy_record_t), SEEK_SET);
+            if(fread(&batch[count], 1, sizeof(fpm_energy_record_t), f) != sizeof(fpm_energy_record_t))
+            {
+                done = true;
+                break;
+            }
+            if((batch[count].key != key) || (batch[count].crc != energy_record_crc(&batch[count])))
+            {
+                continue;
+            }
+            count++;
+        }
+        fclose(f);
+        xSemaphoreGive(energy_mutex);
+        for(i = 0; i < count; i++)
+        {
+            if(emit(ctx, &batch[i]) == false)
+            {
+                done = true;
+                break;
+            }
+            emitted++;
+        }
+    }
+    energy_stats.queries++;
+    return emitted;
+}
+
+char *fpm_energy_stats_json(void)
+{
+    static uint8_t period;
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    cJSON_AddItemToObject(stats_json_obj, "records", cJSON_CreateNumber(energy_stats.records_written));
+    cJSON_AddItemToObject(stats_json_obj, "statewrites", cJSON_CreateNumber(energy_stats.state_writes));
+    cJSON_AddItemToObject(stats_json_obj, "queries", cJSON_CreateNumber(energy_stats.queries));
+    for(period = 0; period < ENERGY_PERIOD_COUNT; period++)
+    {
+        cJSON_AddItemToObject(stats_json_obj, energy_period_name[period], cJSON_CreateNumber(energy_state.open[period].key));
+    }
+    char *json_print = cJSON_PrintUnformatted(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
@@ -0,0 +1,510 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include "stddef.h"
+#include <sys/param.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "total_app.h"
+
+#define HISTORY_PARTITION_LABEL "history"
+#define HISTORY_SECTOR_SIZE 4096
+#define HISTORY_MAX_SECTORS 64
+#define HISTORY_MAGIC 0x484D5046
+#define HISTORY_FORMAT_TSCODEC 2
+#define HISTORY_BLOCK_MAGIC 0xB10C
+#define HISTORY_BLOCK_MIN 64
+#define HISTORY_BLOCK_MAX 1400
+#define HISTORY_FIELD_COUNT (TREND_CHANNEL_COUNT + 2)
+#define HISTORY_PENDING_MAX 32
+
+typedef struct
+{
+    uint32_t magic;
+    uint32_t seq;
+    uint32_t first_time;
+    uint16_t format;
+    uint16_t crc;
+}fpm_history_sector_header_t;
+
+// One flush worth of records, compressed with the tscodec; the CRC covers the header
+// fields before it and the payload.
+typedef struct
+{
+    uint32_t first_time;
+    uint16_t magic;
+    uint16_t bytes;
+    uint16_t count;
+    uint16_t crc;
+}fpm_history_block_header_t;
+
+static const char *TAG = "HISTORY";
+
+static const esp_partition_t *history_partition = NULL;
+static SemaphoreHandle_t history_mutex = NULL;
+static const uint8_t *history_map = NULL;
+static esp_partition_mmap_handle_t history_map_handle;
+static uint16_t history_sector_count;
+static uint32_t history_sector_seq[HISTORY_MAX_SECTORS];
+static uint32_t history_sector_first_time[HISTORY_MAX_SECTORS];
+static bool history_sector_valid[HISTORY_MAX_SECTORS];
+static uint8_t history_order[HISTORY_MAX_SECTORS];
+static uint8_t history_order_cnt;
+static uint16_t history_active_sector;
+static uint16_t history_active_offset;
+static fpm_history_record_t history_pending[HISTORY_PENDING_MAX];
+static uint8_t history_pending_cnt;
+static uint8_t history_block[sizeof(fpm_history_block_header_t) + HISTORY_BLOCK_MAX];
+fpm_history_stats_t history_stats;
+
+static uint16_t history_record_crc(const fpm_history_record_t *record)
+{
+    return esp_rom_crc16_le(0, (const uint8_t*)record, offsetof(fpm_history_record_t, crc));
+}
+
+static uint16_t history_header_crc(const fpm_history_sector_header_t *header)
+{
+    return esp_rom_crc16_le(0, (const uint8_t*)header, offsetof(fpm_history_sector_header_t, crc));
+}
+
+static uint16_t history_block_crc(const fpm_history_block_header_t *header, const uint8_t *payload)
+{
+    return esp_rom_crc16_le(esp_rom_crc16_le(0, (const uint8_t*)header, offsetof(fpm_history_block_header_t, crc)), payload, header->bytes);
+}
+
+static uint32_t history_sector_address(uint16_t sector)
+{
+    return (uint32_t)sector * HISTORY_SECTOR_SIZE;
+}
+
+// Reads go through the memory mapped partition; the flash driver invalidates the cache
+// for mapped regions on every write and erase.
+static void history_read(uint32_t address, void *dst, size_t len)
+{
+    memcpy(dst, &history_map[address], len);
+}
+
+// Reads the block header at offset; false at the end of the used part of the sector.
+static bool history_block_at(uint16_t sector, uint16_t offset, fpm_history_block_header_t *header)
+{
+    if(offset + sizeof(fpm_history_block_header_t) > HISTORY_SECTOR_SIZE)
+    {
+        return false;
+    }
+    history_read(history_sector_address(sector) + offset, header, sizeof(fpm_history_block_header_t));
+    return (header->magic == HISTORY_BLOCK_MAGIC) && (header->bytes <= HISTORY_SECTOR_SIZE - offset - sizeof(fpm_history_block_header_t));
+}
+
+// Valid sectors ordered oldest first. Rotation is strictly sequential, so the order is
+// the ring starting after the active sector; never written sectors are left out.
+static void history_build_order(void)
+{
+    static uint16_t i;
+    static uint16_t sector;
+    history_order_cnt = 0;
+    for(i = 1; i <= history_sector_count; i++)
+    {
+        sector = (history_active_sector + i) % history_sector_count;
+        if(history_sector_valid[sector] == true)
+        {
+            history_order[history_order_cnt++] = (uint8_t)sector;
+        }
+    }
+}
+
+// Write offset of the active sector: the end of the block chain. A torn block header
+// leaves bytes that cannot be written over, so the sector is closed instead.
+static uint16_t history_used_bytes(uint16_t sector)
+{
+    static fpm_history_block_header_t header;
+    static uint16_t offset;
+    static uint8_t i;
+    offset = sizeof(fpm_history_sector_header_t);
+    while(history_block_at(sector, offset, &header) == true)
+    {
+        offset += sizeof(fpm_history_block_header_t) + header.bytes;
+    }
+    if(offset + sizeof(fpm_history_block_header_t) > HISTORY_SECTOR_SIZE)
+    {
+        return HISTORY_SECTOR_SIZE;
+    }
+    for(i = 0; i < sizeof(fpm_history_block_header_t); i++)
+    {
+        if(((const uint8_t*)&header)[i] != 0xFF)
+        {
+            return HISTORY_SECTOR_SIZE;
+        }
+    }
+    return offset;
+}
+
+void fpm_history_init(void)
+{
+    static fpm_history_sector_header_t header;
+    static uint32_t max_seq;
+    static uint16_t i;
+    history_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, HISTORY_PARTITION_LABEL);
+    if(history_partition == NULL)
+    {
+        ESP_LOGI(TAG, "No history partition, logging disabled");
+        return;
+    }
+    // Queries decode straight out of the mapping, so there is no unmapped fallback.
+    if(esp_partition_mmap(history_partition, 0, history_partition->size, ESP_PARTITION_MMAP_DATA, (const void**)&history_map, &history_map_handle) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "History mmap failed, logging disabled");
+        history_partition = NULL;
+        return;
+    }
+    history_mutex = xSemaphoreCreateMutex();
+    history_sector_count = history_partition->size / HISTORY_SECTOR_SIZE;
+    if(history_sector_count > HISTORY_MAX_SECTORS)
+    {
+        history_sector_count = HISTORY_MAX_SECTORS;
+    }
+    max_seq = 0;
+    history_active_sector = 0;
+    for(i = 0; i < history_sector_count; i++)
+    {
+        // Sectors of the uncompressed format fail the format check and are recycled.
+        history_read(history_sector_address(i), &header, sizeof(header));
+        history_sector_valid[i] = (header.magic == HISTORY_MAGIC)
+                               && (header.format == HISTORY_FORMAT_TSCODEC)
+                               && (header.crc == history_header_crc(&header));
+        if(history_sector_valid[i] == true)
+        {
+            history_sector_seq[i] = header.seq;
+            history_sector_first_time[i] = header.first_time;
+            if(header.seq >= max_seq)
+            {
+                max_seq = header.seq;
+                history_active_sector = i;
+            }
+        }
+    }
+    if(max_seq == 0)
+    {
+        // Empty or foreign content: start clean on sector 0.
+        esp_partition_erase_range(history_partition, 0, HISTORY_SECTOR_SIZE);
+        history_stats.erases++;
+        history_active_offset = sizeof(fpm_history_sector_header_t);
+        history_sector_valid[0] = false;
+        history_sector_seq[0] = 0;
+    }
+    else
+    {
+        history_active_offset = history_used_bytes(history_active_sector);
+    }
+    history_build_order();
+    ESP_LOGI(TAG, "History %d sectors, active %d offset %d", history_sector_count, history_active_sector, history_active_offset);
+}
+
+static void history_open_sector(uint32_t first_time)
+{
+    static fpm_history_sector_header_t header;
+    static uint32_t seq;
+    static int64_t erase_start;
+    seq = history_sector_valid[history_active_sector] ? history_sector_seq[history_active_sector] : 0;
+    if(history_active_offset + sizeof(fpm_history_block_header_t) + HISTORY_BLOCK_MIN > HISTORY_SECTOR_SIZE)
+    {
+        history_active_sector = (history_active_sector + 1) % history_sector_count;
+        erase_start = esp_timer_get_time();
+        esp_partition_erase_range(history_partition, history_sector_address(history_active_sector), HISTORY_SECTOR_SIZE);
+        history_stats.erases++;
+        history_stats.erase_us_max = MAX(history_stats.erase_us_max, (uint32_t)(esp_timer_get_time() - erase_start));
+        history_sector_valid[history_active_sector] = false;
+        history_active_offset = sizeof(fpm_history_sector_header_t);
+    }
+    if(history_sector_valid[history_active_sector] == false)
+    {
+        header.magic = HISTORY_MAGIC;
+        header.seq = seq + 1;
+        header.first_time = first_time;
+        header.format = HISTORY_FORMAT_TSCODEC;
+        header.crc = history_header_crc(&header);
+        esp_partition_write(history_partition, history_sector_address(history_active_sector), &header, sizeof(header));
+        history_sector_seq[history_active_sector] = header.seq;
+        history_sector_first_time[history_active_sector] = first_time;
+        history_sector_valid[history_active_sector] = true;
+        history_build_order();
+    }
+}
+
+// Type and sample count ride along as the first two codec fields.
+static bool history_encode(fpm_tscodec_enc_t *enc, const fpm_history_record_t *record)
+{
+    static int16_t fields[HISTORY_FIELD_COUNT];
+    fields[0] = record->type;
+    fields[1] = (int16_t)record->samples;
+    memcpy(&fields[2], record->value, sizeof(record->value));
+    return fpm_tscodec_enc_put(enc, record->time_sec, record->quality_mask, fields);
+}
+
+static void history_decode(fpm_tscodec_dec_t *dec, fpm_history_record_t *record)
+{
+    static int16_t fields[HISTORY_FIELD_COUNT];
+    static uint64_t time;
+    fpm_tscodec_dec_next(dec, &time, &record->quality_mask, fields);
+    record->time_sec = (uint32_t)time;
+    record->type = (uint8_t)fields[0];
+    record->reserved = 0;
+    record->samples = (uint16_t)fields[1];
+    memcpy(record->value, &fields[2], sizeof(record->value));
+    record->crc = history_record_crc(record);
+}
+
+// Compresses the pending batch into one block per sector it touches, each written with
+// a single partition write.
+static void history_flush(void)
+{
+    static fpm_tscodec_enc_t enc;
+    static fpm_history_block_header_t *header;
+    static uint8_t written;
+    static uint8_t first;
+    static int64_t flush_start;
+    static int64_t encode_start;
+    if((history_partition == NULL) || (history_pending_cnt == 0))
+    {
+        return;
+    }
+    flush_start = esp_timer_get_time();
+    header = (fpm_history_block_header_t*)history_block;
+    written = 0;
+    while(written < history_pending_cnt)
+    {
+        history_open_sector(history_pending[written].time_sec);
+        first = written;
+        encode_start = esp_timer_get_time();
+        fpm_tscodec_enc_init(&enc, &history_block[sizeof(fpm_history_block_header_t)], MIN(HISTORY_BLOCK_MAX, HISTORY_SECTOR_SIZE - history_active_offset - sizeof(fpm_history_block_header_t)), HISTORY_FIELD_COUNT);
+        while((written < history_pending_cnt) && (history_encode(&enc, &history_pending[written]) == true))
+        {
+            written++;
+        }
+        history_stats.codec.encode_us += (uint64_t)(esp_timer_get_time() - encode_start);
+        if(written == first)
+        {
+            history_active_offset = HISTORY_SECTOR_SIZE;
+            continue;
+        }
+        header->magic = HISTORY_BLOCK_MAGIC;
+        header->bytes = fpm_tscodec_enc_bytes(&enc);
+        header->count = enc.count;
+        header->first_time = history_pending[first].time_sec;
+        header->crc = history_block_crc(header, &history_block[sizeof(fpm_history_block_header_t)]);
+        esp_partition_write(history_partition, history_sector_address(history_active_sector) + history_active_offset, history_block, sizeof(fpm_history_block_header_t) + header->bytes);
+        history_active_offset += sizeof(fpm_history_block_header_t) + header->bytes;
+        history_stats.flash_writes++;
+        history_stats.codec.records += enc.count;
+        history_stats.codec.raw_bytes += (uint32_t)enc.count * sizeof(fpm_history_record_t);
+        history_stats.codec.encoded_bytes += sizeof(fpm_history_block_header_t) + header->bytes;
+    }
+    history_stats.flushes++;
+    history_stats.flushed_records += history_pending_cnt;
+    history_stats.flush_us_last = (uint32_t)(esp_timer_get_time() - flush_start);
+    history_stats.flush_us_total += history_stats.flush_us_last;
+    history_stats.flush_us_max = MAX(history_stats.flush_us_max, history_stats.flush_us_last);
+    history_pending_cnt = 0;
+}
+
+static void history_append(const fpm_history_record_t *record)
+{
+    if(history_partition == NULL)
+    {
+        return;
+    }
+    xSemaphoreTake(history_mutex, portMAX_DELAY);
+    if(history_pending_cnt >= HISTORY_PENDING_MAX)
+    {
+        history_flush();
+    }
+    history_pending[history_pending_cnt++] = *record;
+    history_stats.appended++;
+    if((history_pending_cnt >= CONFIG_FPM_HISTORY_BATCH) || (record->type == HISTORY_RECORD_15MIN))
+    {
+        history_flush();
+    }
+    xSemaphoreGive(history_mutex);
+}
+
+// Called by the aggregation stage for every closed interval that ran on UTC. Records are
+// stamped with the interval end so 1-minute and 15-minute records interleave in time order.
+void fpm_history_interval(uint8_t type, uint32_t end_time, uint16_t samples, uint16_t quality_mask, const int16_t *value)
+{
+    static fpm_history_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.time_sec = end_time;
+    record.type = type;
+    record.samples = samples;
+    record.quality_mask = quality_mask;
+    memcpy(record.value, value, sizeof(record.value));
+    record.crc = history_record_crc(&record);
+    history_append(&record);
+}
+
+// Moves to the oldest sector newer than the one just read. Sectors are followed by
+// sequence number rather than position, so a sector recycled under a slow reader is
+// simply skipped.
+static void history_next_sector(fpm_history_iter_t *it)
+{
+    static uint8_t i;
+    for(i = 0; i < history_order_cnt; i++)
+    {
+        if(history_sector_seq[history_order[i]] > it->sector_seq)
+        {
+            it->sector = history_order[i];
+            it->sector_seq = history_sector_seq[it->sector];
+            it->offset = sizeof(fpm_history_sector_header_t);
+            it->dec.remaining = 0;
+            return;
+        }
+    }
+    it->in_pending = true;
+}
+
+// Positions the iterator on the block holding the first record at or after from_time.
+// Sector first_time gives a binary search over sectors, block first_time a walk over
+// block headers in that sector; only the records of one block are decoded to skip.
+bool fpm_history_seek(fpm_history_iter_t *it, uint32_t from_time, uint32_t to_time, uint8_t type)
+{
+    static fpm_history_block_header_t header;
+    static int64_t seek_start;
+    static int16_t lo;
+    static int16_t hi;
+    static int16_t mid;
+    static int16_t found;
+    static uint16_t offset;
+    memset(it, 0, sizeof(fpm_history_iter_t));
+    it->from_time = from_time;
+    it->to_time = to_time;
+    it->type = type;
+    if(history_partition == NULL)
+    {
+        return false;
+    }
+    seek_start = esp_timer_get_time();
+    xSemaphoreTake(history_mutex, portMAX_DELAY);
+    lo = 0;
+    hi = history_order_cnt - 1;
+    found = 0;
+    while(lo <= hi)
+    {
+        mid = (lo + hi) / 2;
+        if(history_sector_first_time[history_order[mid]] < from_time)
+        {
+            found = mid;
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    if(history_order_cnt != 0)
+    {
+        it->sector = history_order[found];
+        it->sector_seq = history_sector_seq[it->sector];
+        it->offset = sizeof(fpm_history_sector_header_t);
+        offset = it->offset;
+        while((history_block_at(it->sector, offset, &header) == true) && (header.first_time < from_time))
+        {
+            it->offset = offset;
+            offset += sizeof(fpm_history_block_header_t) + header.bytes;
+        }
+    }
+    else
+    {
+        it->in_pending = true;
+    }
+    xSemaphoreGive(history_mutex);
+    history_stats.queries++;
+    history_stats.seek_us_last = (uint32_t)(esp_timer_get_time() - seek_start);
+    history_stats.seek_us_max = MAX(history_stats.seek_us_max, history_stats.seek_us_last);
+    return true;
+}
+
+// Returns records in time order up to to_time, then whatever is still in the RAM batch.
+// Blocks are decoded one record per call straight from the mapped partition.
+bool fpm_history_next(fpm_history_iter_t *it, fpm_history_record_t *record)
+{
+    static fpm_history_block_header_t header;
+    static uint32_t block_address;
+    static int64_t decode_start;
+    static bool found;
+    found = false;
+    xSemaphoreTake(history_mutex, portMAX_DELAY);
+    while((found == false) && (it->in_pending == false))
+    {
+        if((history_sector_valid[it->sector] == false) || (history_sector_seq[it->sector] != it->sector_seq))
+        {
+            history_next_sector(it);
+            continue;
+        }
+        if(it->dec.remaining == 0)
+        {
+            if(history_block_at(it->sector, it->offset, &header) == false)
+            {
+                history_next_sector(it);
+                continue;
+            }
+            block_address = history_sector_address(it->sector) + it->offset + sizeof(fpm_history_block_header_t);
+            it->offset += sizeof(fpm_history_block_header_t) + header.bytes;
+            if(header.crc != history_block_crc(&header, &history_map[block_address]))
+            {
+                history_stats.crc_errors++;
+                continue;
+            }
+            fpm_tscodec_dec_init(&it->dec, &history_map[block_address], header.count, HISTORY_FIELD_COUNT);
+        }
+        decode_start = esp_timer_get_time();
+        history_decode(&it->dec, record);
+        history_stats.codec.decoded_bytes += sizeof(fpm_history_record_t);
+        history_stats.codec.decode_us += (uint64_t)(esp_timer_get_time() - decode_start);
+        history_stats.records_read++;
+        if(record->time_sec > it->to_time)
+        {
+            it->pending_idx = HISTORY_PENDING_MAX;
+            it->in_pending = true;
+            break;
+        }
+        found = (record->type == it->type) && (record->time_sec >= it->from_time);
+    }
+    while((found == false) && (it->in_pending == true) && (it->pending_idx < history_pending_cnt))
+    {
+        *record = history_pending[it->pending_idx++];
+        found = (record->type == it->type) && (record->time_sec >= it->from_time) && (record->time_sec <= it->to_time);
+    }
+    xSemaphoreGive(history_mutex);
+    return found;
+}
+
+char *fpm_history_stats_json(void)
+{
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    cJSON_AddItemToObject(stats_json_obj, "sectors", cJSON_CreateNumber(history_sector_count));
+    cJSON_AddItemToObject(stats_json_obj, "active", cJSON_CreateNumber(history_active_sector));
+    cJSON_AddItemToObject(stats_json_obj, "offset", cJSON_CreateNumber(history_active_offset));
+    cJSON_AddItemToObject(stats_json_obj, "pending", cJSON_CreateNumber(history_pending_cnt));
+    cJSON_AddItemToObject(stats_json_obj, "appended", cJSON_CreateNumber(history_stats.appended));
+    cJSON_AddItemToObject(stats_json_obj, "flushes", cJSON_CreateNumber(history_stats.flushes));
+    cJSON_AddItemToObject(stats_json_obj, "flashwrites", cJSON_CreateNumber(history_stats.flash_writes));
+    cJSON_AddItemToObject(stats_json_obj, "flushuslast", cJSON_CreateNumber(history_stats.flush_us_last));
+    cJSON_AddItemToObject(stats_json_obj, "flushusmax", cJSON_CreateNumber(history_stats.flush_us_max));
+    cJSON_AddItemToObject(stats_json_obj, "flushusperrecord", cJSON_CreateNumber((history_stats.flushed_records != 0) ? (double)history_stats.flush_us_total / history_stats.flushed_records : 0));
+    cJSON_AddItemToObject(stats_json_obj, "erases", cJSON_CreateNumber(history_stats.erases));
+    cJSON_AddItemToObject(stats_json_obj, "eraseusmax", cJSON_CreateNumber(history_stats.erase_us_max));
+    cJSON_AddItemToObject(stats_json_obj, "queries", cJSON_CreateNumber(history_stats.queries));
+    cJSON_AddItemToObject(stats_json_obj, "seekuslast", cJSON_CreateNumber(history_stats.seek_us_last));
+    cJSON_AddItemToObject(stats_json_obj, "seekusmax", cJSON_CreateNumber(history_stats.seek_us_max));
+    cJSON_AddItemToObject(stats_json_obj, "recordsread", cJSON_CreateNumber(history_stats.records_read));
+    cJSON_AddItemToObject(stats_json_obj, "crcerrors", cJSON_CreateNumber(history_stats.crc_errors));
+    fpm_tscodec_stats_add(stats_json_obj, &history_stats.codec);
+    char *json_print = cJSON_Print(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
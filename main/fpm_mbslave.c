@@ -0,0 +1,199 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/uart.h"
+#include "driver/gpio.h"
+#include "total_app.h"
+
+#define MBSLAVE_UART_NUM UART_NUM_2
+#define MBSLAVE_FRAME_SIZE 256
+#define MBSLAVE_MAX_READ_QUANTITY 125
+#define MBSLAVE_IDLE_WAIT 100
+
+#define MBSLAVE_FUNC_READ_HOLDING_REGISTERS 0x03
+#define MBSLAVE_FUNC_READ_INPUT_REGISTERS 0x04
+
+#define MBSLAVE_EXCEPTION_ILLEGAL_FUNCTION 0x01
+#define MBSLAVE_EXCEPTION_ILLEGAL_DATA_ADDRESS 0x02
+#define MBSLAVE_EXCEPTION_ILLEGAL_DATA_VALUE 0x03
+#define MBSLAVE_EXCEPTION_GATEWAY_TARGET_NO_RESPONSE 0x0B
+
+static const char *TAG = "MBSLAVE";
+
+TaskHandle_t TaskHandle_uart2_mbslave_task = NULL;
+uint32_t mbslave_request_timestamp;
+uint32_t mbslave_request_count;
+uint32_t mbslave_exception_count;
+
+#ifdef CONFIG_FPM_MBSLAVE_ENABLE
+
+static uint16_t mbslave_crc16(const uint8_t *data, uint16_t len)
+{
+    uint16_t crc = 0xFFFF;
+    for(uint16_t i = 0; i < len; i++)
+    {
+        crc ^= data[i];
+        for(uint8_t j = 0; j < 8; j++)
+        {
+            if(crc & 0x0001)
+            {
+                crc = (crc >> 1) ^ 0xA001;
+            }
+            else
+            {
+                crc >>= 1;
+            }
+        }
+    }
+    return crc;
+}
+
+static void mbslave_send(uint8_t *frame, uint16_t len)
+{
+    static uint16_t crc;
+    crc = mbslave_crc16(frame, len);
+    frame[len++] = (uint8_t)(crc & 0x00FF);
+    frame[len++] = (uint8_t)((crc >> 8) & 0x00FF);
+    uart_write_bytes(MBSLAVE_UART_NUM, frame, len);
+}
+
+static void mbslave_send_exception(uint8_t func, uint8_t exception_code)
+{
+    static uint8_t frame[5];
+    frame[0] = CONFIG_FPM_MBSLAVE_ADDRESS;
+    frame[1] = func | 0x80;
+    frame[2] = exception_code;
+    mbslave_exception_count++;
+    mbslave_send(frame, 3);
+}
+
+static void mbslave_read_registers(uint8_t func, uint16_t start_address, uint16_t quantity)
+{
+    static uint8_t frame[MBSLAVE_FRAME_SIZE];
+    static uint16_t value;
+    static uint8_t result;
+    static bool any_mapped;
+    if((quantity == 0) || (quantity > MBSLAVE_MAX_READ_QUANTITY))
+    {
+        mbslave_send_exception(func, MBSLAVE_EXCEPTION_ILLEGAL_DATA_VALUE);
+        return;
+    }
+    if((uint32_t)start_address + quantity > 0x10000)
+    {
+        mbslave_send_exception(func, MBSLAVE_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+        return;
+    }
+    frame[0] = CONFIG_FPM_MBSLAVE_ADDRESS;
+    frame[1] = func;
+    frame[2] = (uint8_t)(quantity * 2);
+    any_mapped = false;
+    for(uint16_t i = 0; i < quantity; i++)
+    {
+        value = 0;
+        result = fpm_modbus_cached_register(start_address + i, &value);
+        if(result == MBSLAVE_EXCEPTION_GATEWAY_TARGET_NO_RESPONSE)
+        {
+            mbslave_send_exception(func, MBSLAVE_EXCEPTION_GATEWAY_TARGET_NO_RESPONSE);
+            return;
+        }
+        else if(result == 0)
+        {
+            any_mapped = true;
+        }
+        frame[3 + (i * 2)] = (uint8_t)((value >> 8) & 0x00FF);
+        frame[4 + (i * 2)] = (uint8_t)(value & 0x00FF);
+    }
+    if(any_mapped == false)
+    {
+        mbslave_send_exception(func, MBSLAVE_EXCEPTION_ILLEGAL_DATA_ADDRESS);
+        return;
+    }
+    mbslave_send(frame, 3 + (quantity * 2));
+}
+
+static void mbslave_process_frame(uint8_t *frame, uint16_t len)
+{
+    static uint16_t crc;
+    if(len < 4)
+    {
+        return;
+    }
+    crc = (uint16_t)frame[len - 2] | ((uint16_t)frame[len - 1] << 8);
+    if(crc != mbslave_crc16(frame, len - 2))
+    {
+        ESP_LOGI(TAG, "CRC mismatch, frame dropped");
+        return;
+    }
+    if(frame[0] != CONFIG_FPM_MBSLAVE_ADDRESS)
+    {
+        return;
+    }
+    mbslave_request_count++;
+    mbslave_request_timestamp = xTaskGetTickCount();
+    switch(frame[1])
+    {
+        case MBSLAVE_FUNC_READ_HOLDING_REGISTERS:
+        case MBSLAVE_FUNC_READ_INPUT_REGISTERS:
+            if(len != 8)
+            {
+                mbslave_send_exception(frame[1], MBSLAVE_EXCEPTION_ILLEGAL_DATA_VALUE);
+            }
+            else
+            {
+                mbslave_read_registers(frame[1], ((uint16_t)frame[2] << 8) | frame[3], ((uint16_t)frame[4] << 8) | frame[5]);
+            }
+        break;
+        default:
+            mbslave_send_exception(frame[1], MBSLAVE_EXCEPTION_ILLEGAL_FUNCTION);
+        break;
+    }
+}
+
+static void uart2_mbslave_task(void *arg)
+{
+    static uint8_t frame[MBSLAVE_FRAME_SIZE];
+    static uint16_t frame_len;
+    static int rxBytes;
+    // 3.5 character times of 11 bits, at least one tick
+    const TickType_t frame_gap = pdMS_TO_TICKS(((38500 / CONFIG_FPM_MBSLAVE_BAUD) + 1));
+    frame_len = 0;
+    while(1)
+    {
+        rxBytes = uart_read_bytes(MBSLAVE_UART_NUM, &frame[frame_len], MBSLAVE_FRAME_SIZE - frame_len, (frame_len == 0) ? pdMS_TO_TICKS(MBSLAVE_IDLE_WAIT) : (frame_gap > 0 ? frame_gap : 1));
+        if(rxBytes > 0)
+        {
+            frame_len += rxBytes;
+            if(frame_len >= MBSLAVE_FRAME_SIZE)
+            {
+                frame_len = 0;
+            }
+        }
+        else if(frame_len > 0)
+        {
+            mbslave_process_frame(frame, frame_len);
+            frame_len = 0;
+        }
+    }
+}
+
+void start_mbslave_uart_task(void)
+{
+    static uart_config_t uart_config;
+    uart_config.baud_rate = CONFIG_FPM_MBSLAVE_BAUD;
+    uart_config.data_bits = UART_DATA_8_BITS;
+    uart_config.parity = UART_PARITY_EVEN;
+    uart_config.stop_bits = UART_STOP_BITS_1;
+    uart_config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    uart_config.source_clk = UART_SCLK_DEFAULT;
+
+    uart_driver_install(MBSLAVE_UART_NUM, MBSLAVE_FRAME_SIZE * 2, MBSLAVE_FRAME_SIZE * 2, 0, NULL, 0);
+    uart_param_config(MBSLAVE_UART_NUM, &uart_config);
+    uart_set_pin(MBSLAVE_UART_NUM, CONFIG_FPM_MBSLAVE_TXD_GPIO, CONFIG_FPM_MBSLAVE_RXD_GPIO, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE);
+    xTaskCreatePinnedToCore(uart2_mbslave_task, "uart2_mbslave_task", 1024 * 3, NULL, tskIDLE_PRIORITY + 6, &TaskHandle_uart2_mbslave_task, 0);
+    ESP_LOGI(TAG, "Modbus slave address %d started", CONFIG_FPM_MBSLAVE_ADDRESS);
+}
+
+#endif
@@ -12,13 +12,17 @@
 #include "string.h"
 #include "driver/gpio.h"
 #include "stdio.h"
+#include <sys/time.h>
+#include <math.h>
+#include "esp_timer.h"
 #include "total_app.h"
 
 #define MODBUS_UART_NUM UART_NUM_1
 #define HOLD_OFFSET_RW(field) ((uint16_t)(offsetof(holding_reg_rw_params_t, field)))
-#define MODBUS_SERIAL_RX_BUFFER_SIZE 20
+#define MODBUS_SERIAL_RX_BUFFER_SIZE 40
 #define MODBUS_GET_TIMEOUT 150
 #define UARTINIT_DELAY 10
+#define SAMPLE_STALE_PERIODS 3
 
 //4ms
 #define T3_5 0
@@ -489,6 +493,14 @@ uint8_t modbus_try_cnt[CID_RW_COUNT];
 bool modbus_operation_result[CID_RW_COUNT];
 bool modbus_operation_enable[CID_RW_COUNT];
 exception modbus_error_code[CID_RW_COUNT];
+uint16_t modbus_register_cache[CID_RW_COUNT][2];
+bool modbus_register_cache_valid[CID_RW_COUNT];
+portMUX_TYPE modbus_register_cache_mux = portMUX_INITIALIZER_UNLOCKED;
+fpm_sample_meta_t modbus_sample_meta[CID_RW_COUNT];
+int64_t modbus_sweep_mono_us;
+uint64_t modbus_sweep_utc_ms;
+static int64_t modbus_rx_mono_us;
+static struct timeval modbus_rx_utc;
 
 const modbus_operation_parameter_descriptor_t modbus_operation_parameters[] =
 {
@@ -959,6 +971,8 @@ static void incomming_modbus_serial_READ(uint8_t chr)
 		dt_cnt++;
 		if(dt_cnt == 2)
 		{
+			modbus_rx_mono_us = esp_timer_get_time();
+			gettimeofday(&modbus_rx_utc, NULL);
 			modbus_rx.error_code[0] = 0;
 			modbus_rx.error_code[1] = 0;
 			modbus_serial_state = MODBUS_RXCOMPLETE;
@@ -1190,6 +1204,33 @@ _enum_fpm_modbus_write fpm_modbus_write(_enum_fpm_modbus_write _enum_mb_write)
 }
 
 
+static void modbus_sample_mark(uint16_t sample_cid, _enum_fpm_sample_quality quality, uint8_t exception_code)
+{
+    portENTER_CRITICAL(&modbus_register_cache_mux);
+    modbus_sample_meta[sample_cid].mono_us = modbus_rx_mono_us;
+    modbus_sample_meta[sample_cid].utc_sec = (uint32_t)modbus_rx_utc.tv_sec;
+    modbus_sample_meta[sample_cid].utc_ms = (uint16_t)(modbus_rx_utc.tv_usec / 1000);
+    modbus_sample_meta[sample_cid].quality = quality;
+    modbus_sample_meta[sample_cid].exception_code = exception_code;
+    portEXIT_CRITICAL(&modbus_register_cache_mux);
+}
+
+// A good sample turns stale once it has missed several sweeps, e.g. when the poll is
+// skipped or the register was dropped from the enable set.
+static _enum_fpm_sample_quality modbus_sample_quality(uint16_t sample_cid)
+{
+    if(modbus_sample_meta[sample_cid].mono_us == 0)
+    {
+        return SAMPLE_QUALITY_STALE;
+    }
+    if((modbus_sample_meta[sample_cid].quality == SAMPLE_QUALITY_GOOD)
+    && (esp_timer_get_time() - modbus_sample_meta[sample_cid].mono_us > (int64_t)fpm_acquisition_period() * 1000 * SAMPLE_STALE_PERIODS))
+    {
+        return SAMPLE_QUALITY_STALE;
+    }
+    return (_enum_fpm_sample_quality)modbus_sample_meta[sample_cid].quality;
+}
+
 _enum_fpm_modbus_read fpm_modbus_read_jSON(char *msg_init, char * json_string, uint16_t *json_str_len)
 {
     static const modbus_operation_parameter_descriptor_t* operation_descriptor;
@@ -1218,6 +1259,9 @@ _enum_fpm_modbus_read fpm_modbus_read_jSON(char *msg_init, char * json_string, u
                 modbus_operation_result[i] = false;
                 modbus_error_code[i] = 0;
             }
+            gettimeofday(&modbus_rx_utc, NULL);
+            modbus_sweep_mono_us = esp_timer_get_time();
+            modbus_sweep_utc_ms = ((uint64_t)modbus_rx_utc.tv_sec * 1000) + (modbus_rx_utc.tv_usec / 1000);
         }
         while(cid < cid_operation_count)
         {
@@ -1264,6 +1308,20 @@ _enum_fpm_modbus_read fpm_modbus_read_jSON(char *msg_init, char * json_string, u
                 operation_descriptor->modbus_operation_result[cid] = false;
                 enum_internal_modbus_operation = MODBUS_ITERATE_CID;
                 operation_descriptor->error_code[cid] = modbus_rx.error_code[0];
+                modbus_rx_mono_us = esp_timer_get_time();
+                gettimeofday(&modbus_rx_utc, NULL);
+                if(modbus_serial_state == MODBUS_GETADDY)
+                {
+                    modbus_sample_mark(cid, SAMPLE_QUALITY_TIMEOUT, 0);
+                }
+                else if(modbus_rx.func & 0x80)
+                {
+                    modbus_sample_mark(cid, SAMPLE_QUALITY_EXCEPTION, modbus_rx.error_code[0]);
+                }
+                else
+                {
+                    modbus_sample_mark(cid, SAMPLE_QUALITY_CRC, 0);
+                }
                 if(operation_descriptor->error_code[cid] == GATEWAY_TARGET_NO_RESPONSE)
                 {
                     if(modbus_try_cnt[cid] < 5)
@@ -1274,10 +1332,27 @@ _enum_fpm_modbus_read fpm_modbus_read_jSON(char *msg_init, char * json_string, u
                 _return = MODBUSREAD_JSON_NOT_READY;
             }
         }
+        else if(modbus_rx.error_code[1] == CRC_MISM)
+        {
+            end_modbus_uart_task();
+            operation_descriptor->modbus_operation_result[cid] = false;
+            operation_descriptor->error_code[cid] = CRC_MISM;
+            modbus_sample_mark(cid, SAMPLE_QUALITY_CRC, 0);
+            enum_internal_modbus_operation = MODBUS_ITERATE_CID;
+            _return = MODBUSREAD_JSON_NOT_READY;
+        }
         else
         {
             end_modbus_uart_task();
             operation_descriptor->modbus_operation_result[cid] = true;
+            modbus_sample_mark(cid, SAMPLE_QUALITY_GOOD, 0);
+            portENTER_CRITICAL(&modbus_register_cache_mux);
+            for(i = 0; (i < operation_descriptor->mb_size) && (i < 2); i++)
+            {
+                modbus_register_cache[cid][i] = ((uint16_t)modbus_rx.data[i * 2] << 8) | modbus_rx.data[(i * 2) + 1];
+            }
+            modbus_register_cache_valid[cid] = true;
+            portEXIT_CRITICAL(&modbus_register_cache_mux);
             raw_data_reassembly[0] = 0;
             raw_data_reassembly[0] = 0;
             raw_data_reassembly[0] = 0;
@@ -1356,6 +1431,16 @@ _enum_fpm_modbus_read fpm_modbus_read_jSON(char *msg_init, char * json_string, u
             sensor_json_obj = cJSON_CreateObject();
             wago_array = cJSON_CreateArray();
             cJSON_AddItemToObject(sensor_json_obj, "WAGO8793040", wago_array);
+            if(sntp_time_valid == true)
+            {
+                cJSON_AddItemToObject(sensor_json_obj, "t0", cJSON_CreateNumber((double)modbus_sweep_utc_ms));
+            }
+            cJSON_AddItemToObject(sensor_json_obj, "us0", cJSON_CreateNumber((double)modbus_sweep_mono_us));
+            if(modbus_operation_enable[CID_R_5012_Total_active_power_2_kW_Float] == true)
+            {
+                fpm_derived_sample(modbus_sweep_mono_us, modbus_sweep_utc_ms);
+                fpm_derived_json_add(sensor_json_obj);
+            }
             for(uint16_t cid = 0; cid < cid_operation_count; cid++)
             {    
                 operation_descriptor = &modbus_operation_parameters[cid]; 
@@ -1457,9 +1542,13 @@ _enum_fpm_modbus_read fpm_modbus_read_jSON(char *msg_init, char * json_string, u
                         unit_j = cJSON_CreateString(operation_descriptor->param_units);
                     }
                     cJSON_AddItemToObject(parameter_name_value_unit_obj, "unit", unit_j);
+                    cJSON_AddItemToObject(parameter_name_value_unit_obj, "q", cJSON_CreateNumber(modbus_sample_quality(cid)));
+                    // ms from the start of the sweep; null until the CID has answered once
+                    cJSON_AddItemToObject(parameter_name_value_unit_obj, "t", (modbus_sample_meta[cid].mono_us == 0) ? cJSON_CreateNull()
+                                          : cJSON_CreateNumber((double)((modbus_sample_meta[cid].mono_us - modbus_sweep_mono_us) / 1000)));
                 }
             }
-            json_string_ = cJSON_Print(sensor_json_obj);
+            json_string_ = cJSON_PrintUnformatted(sensor_json_obj);
 
             sprintf(json_string, "%s%s", msg_init, json_string_);
             *json_str_len = strlen(json_string);
@@ -1477,6 +1566,215 @@ void modbus_restart_cid(void)
     cid = 0;
 }
 
+uint8_t fpm_modbus_cached_register(uint16_t reg_address, uint16_t *value)
+{
+    static const modbus_operation_parameter_descriptor_t* cache_descriptor;
+    for(uint16_t cache_cid = 0; cache_cid < cid_operation_count; cache_cid++)
+    {
+        cache_descriptor = &modbus_operation_parameters[cache_cid];
+        if((reg_address >= cache_descriptor->mb_reg_start) && (reg_address < cache_descriptor->mb_reg_start + cache_descriptor->mb_size))
+        {
+            if((modbus_register_cache_valid[cache_cid] == false) || (modbus_sample_quality(cache_cid) != SAMPLE_QUALITY_GOOD))
+            {
+                return GATEWAY_TARGET_NO_RESPONSE;
+            }
+            portENTER_CRITICAL(&modbus_register_cache_mux);
+            *value = modbus_register_cache[cache_cid][reg_address - cache_descriptor->mb_reg_start];
+            portEXIT_CRITICAL(&modbus_register_cache_mux);
+            return 0;
+        }
+    }
+    return ILLEGAL_DATA_ADDRESS;
+}
+
+bool fpm_modbus_get_sample(uint16_t reg_address, float *value, fpm_sample_meta_t *meta)
+{
+    static const modbus_operation_parameter_descriptor_t* sample_descriptor;
+    static void *temp_data_ptr;
+    for(uint16_t sample_cid = 0; sample_cid < cid_operation_count; sample_cid++)
+    {
+        sample_descriptor = &modbus_operation_parameters[sample_cid];
+        if(sample_descriptor->mb_reg_start == reg_address)
+        {
+            temp_data_ptr = master_get_param_data(sample_descriptor);
+            if(value != NULL)
+            {
+                switch(sample_descriptor->param_type)
+                {
+                    case PARAM_TYPE_FLOAT: *value = *(float*)temp_data_ptr; break;
+                    case PARAM_TYPE_U16: *value = (float)*(int16_t*)temp_data_ptr; break;
+                    case PARAM_TYPE_U32: *value = (float)*(int32_t*)temp_data_ptr; break;
+                    case PARAM_TYPE_HEX32:
+                    case PARAM_TYPE_BIN32: *value = (float)*(uint32_t*)temp_data_ptr; break;
+                    default: *value = (float)*(uint16_t*)temp_data_ptr; break;
+                }
+            }
+            if(meta != NULL)
+            {
+                portENTER_CRITICAL(&modbus_register_cache_mux);
+                *meta = modbus_sample_meta[sample_cid];
+                portEXIT_CRITICAL(&modbus_register_cache_mux);
+                meta->quality = modbus_sample_quality(sample_cid);
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+// Packed snapshot of every CID for the aggregation stage, in descriptor order. Disabled,
+// text and bit-field parameters come back as NaN so the caller can mask them out.
+uint16_t fpm_modbus_sample_vector(float *values, uint8_t *quality, uint16_t *reg_address, uint16_t max)
+{
+    static const modbus_operation_parameter_descriptor_t* sample_descriptor;
+    static void *temp_data_ptr;
+    static uint16_t sample_cid;
+    for(sample_cid = 0; (sample_cid < cid_operation_count) && (sample_cid < max); sample_cid++)
+    {
+        sample_descriptor = &modbus_operation_parameters[sample_cid];
+        reg_address[sample_cid] = sample_descriptor->mb_reg_start;
+        quality[sample_cid] = modbus_sample_quality(sample_cid);
+        temp_data_ptr = master_get_param_data(sample_descriptor);
+        if((modbus_operation_enable[sample_cid] == false) || (temp_data_ptr == NULL))
+        {
+            values[sample_cid] = NAN;
+            continue;
+        }
+        switch(sample_descriptor->param_type)
+        {
+            case PARAM_TYPE_FLOAT: values[sample_cid] = *(float*)temp_data_ptr; break;
+            case PARAM_TYPE_U16: values[sample_cid] = (float)*(int16_t*)temp_data_ptr; break;
+            case PARAM_TYPE_U32: values[sample_cid] = (float)*(int32_t*)temp_data_ptr; break;
+            default: values[sample_cid] = NAN; break;
+        }
+    }
+    return sample_cid;
+}
+
+// One multi-register read outside the CID sweep, for burst capture. Runs as its own
+// arbiter transaction, so it only ever starts between two CIDs of a sweep; it borrows
+// the READ_WAIT state for the RX task and hands ITERATE_CID back when it is done.
+_enum_fpm_modbus_block fpm_modbus_read_block(uint16_t start_address, uint16_t quantity, uint16_t *regs)
+{
+    static uint8_t block_state = 0;
+    static uint32_t block_timestamp;
+    static uint16_t i;
+    if(block_state == 0)
+    {
+        if((enum_internal_modbus_operation != MODBUS_ITERATE_CID) || (quantity * 2 > MODBUS_SERIAL_RX_BUFFER_SIZE))
+        {
+            return MODBUSBLOCK_FAIL;
+        }
+        start_modbus_uart_task();
+        block_timestamp = xTaskGetTickCount();
+        block_state = 1;
+        return MODBUSBLOCK_BUSY;
+    }
+    if(block_state == 1)
+    {
+        if(xTaskGetTickCount() - block_timestamp <= UARTINIT_DELAY)
+        {
+            return MODBUSBLOCK_BUSY;
+        }
+        init_modbus_rw();
+        enum_internal_modbus_operation = MODBUS_READ_WAIT;
+        modbus_read_holding_registers(MB_DEVICE_ADDR1, start_address, quantity);
+        modbus_get_timestamp = xTaskGetTickCount();
+        block_state = 2;
+        return MODBUSBLOCK_BUSY;
+    }
+    if(modbus_serial_state != MODBUS_RXCOMPLETE)
+    {
+        if(xTaskGetTickCount() - modbus_get_timestamp <= modbus_timeout)
+        {
+            return MODBUSBLOCK_BUSY;
+        }
+        end_modbus_uart_task();
+        enum_internal_modbus_operation = MODBUS_ITERATE_CID;
+        block_state = 0;
+        return MODBUSBLOCK_FAIL;
+    }
+    end_modbus_uart_task();
+    enum_internal_modbus_operation = MODBUS_ITERATE_CID;
+    block_state = 0;
+    if((modbus_rx.error_code[1] == CRC_MISM) || (modbus_rx.len != quantity * 2))
+    {
+        return MODBUSBLOCK_FAIL;
+    }
+    for(i = 0; i < quantity; i++)
+    {
+        regs[i] = ((uint16_t)modbus_rx.data[i * 2] << 8) | modbus_rx.data[(i * 2) + 1];
+    }
+    return MODBUSBLOCK_OK;
+}
+
+// Descriptor index of a register, resolved once by callers that then read by index.
+int16_t fpm_modbus_sample_index(uint16_t reg_address)
+{
+    static uint16_t sample_cid;
+    for(sample_cid = 0; sample_cid < cid_operation_count; sample_cid++)
+    {
+        if(modbus_operation_parameters[sample_cid].mb_reg_start == reg_address)
+        {
+            return (int16_t)sample_cid;
+        }
+    }
+    return -1;
+}
+
+// Numeric value and quality of one CID by descriptor index; false when the CID is not
+// in the running set or is not a number.
+bool fpm_modbus_sample_at(uint16_t sample_cid, float *value, uint8_t *quality)
+{
+    static const modbus_operation_parameter_descriptor_t* sample_descriptor;
+    static void *temp_data_ptr;
+    if((sample_cid >= cid_operation_count) || (modbus_operation_enable[sample_cid] == false))
+    {
+        return false;
+    }
+    sample_descriptor = &modbus_operation_parameters[sample_cid];
+    temp_data_ptr = master_get_param_data(sample_descriptor);
+    if(temp_data_ptr == NULL)
+    {
+        return false;
+    }
+    switch(sample_descriptor->param_type)
+    {
+        case PARAM_TYPE_FLOAT: *value = *(float*)temp_data_ptr; break;
+        case PARAM_TYPE_U16: *value = (float)*(int16_t*)temp_data_ptr; break;
+        case PARAM_TYPE_U32: *value = (float)*(int32_t*)temp_data_ptr; break;
+        default: return false;
+    }
+    *quality = modbus_sample_quality(sample_cid);
+    return true;
+}
+
+// Receive time (esp_timer) of the CID's last reply, 0 while it has never been read.
+int64_t fpm_modbus_sample_time(uint16_t sample_cid)
+{
+    static int64_t mono_us;
+    if(sample_cid >= cid_operation_count)
+    {
+        return 0;
+    }
+    portENTER_CRITICAL(&modbus_register_cache_mux);
+    mono_us = modbus_sample_meta[sample_cid].mono_us;
+    portEXIT_CRITICAL(&modbus_register_cache_mux);
+    return mono_us;
+}
+
+// True when the CID is one of the rows of the rdmeter document, which lists the enabled
+// readable CIDs in descriptor order; reg_address gets its first register either way.
+bool fpm_modbus_cid_listed(uint16_t sample_cid, uint16_t *reg_address)
+{
+    if(sample_cid >= cid_operation_count)
+    {
+        return false;
+    }
+    *reg_address = modbus_operation_parameters[sample_cid].mb_reg_start;
+    return (modbus_operation_parameters[sample_cid].access == PAR_PERMS_READ) && (modbus_operation_enable[sample_cid] == true);
+}
+
 void init_fpm_modbus(uint8_t set)
 {
     static uint16_t i;
@@ -0,0 +1,177 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include "cJSON.h"
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+#define MSGPOOL_COUNT (MSGPOOL_SMALL_COUNT + MSGPOOL_MEDIUM_COUNT + MSGPOOL_LARGE_COUNT)
+
+static const char *TAG = "MSGPOOL";
+
+static const uint16_t msgpool_class_size[MSGPOOL_CLASS_COUNT] = {MSGPOOL_SMALL_SIZE, MSGPOOL_MEDIUM_SIZE, MSGPOOL_LARGE_SIZE};
+static const uint8_t msgpool_class_first[MSGPOOL_CLASS_COUNT] = {0, MSGPOOL_SMALL_COUNT, MSGPOOL_SMALL_COUNT + MSGPOOL_MEDIUM_COUNT};
+static const uint8_t msgpool_class_count[MSGPOOL_CLASS_COUNT] = {MSGPOOL_SMALL_COUNT, MSGPOOL_MEDIUM_COUNT, MSGPOOL_LARGE_COUNT};
+
+static char msgpool_small[MSGPOOL_SMALL_COUNT][MSGPOOL_SMALL_SIZE];
+static char msgpool_medium[MSGPOOL_MEDIUM_COUNT][MSGPOOL_MEDIUM_SIZE];
+static char msgpool_large[MSGPOOL_LARGE_COUNT][MSGPOOL_LARGE_SIZE];
+static fpm_msg_t msgpool_msgs[MSGPOOL_COUNT];
+static uint8_t msgpool_class_used[MSGPOOL_CLASS_COUNT];
+static bool msgpool_ready = false;
+static portMUX_TYPE msgpool_mux = portMUX_INITIALIZER_UNLOCKED;
+fpm_msgpool_stats_t msgpool_stats;
+
+static void msgpool_init(void)
+{
+    static uint8_t i;
+    for(i = 0; i < MSGPOOL_COUNT; i++)
+    {
+        if(i < MSGPOOL_SMALL_COUNT)
+        {
+            msgpool_msgs[i].data = msgpool_small[i];
+        }
+        else if(i < MSGPOOL_SMALL_COUNT + MSGPOOL_MEDIUM_COUNT)
+        {
+            msgpool_msgs[i].data = msgpool_medium[i - MSGPOOL_SMALL_COUNT];
+        }
+        else
+        {
+            msgpool_msgs[i].data = msgpool_large[i - MSGPOOL_SMALL_COUNT - MSGPOOL_MEDIUM_COUNT];
+        }
+        msgpool_msgs[i].refs = 0;
+    }
+    msgpool_ready = true;
+}
+
+// Copy of str in the smallest free buffer that also has room for the "*cntid" suffix
+// clientSendWs appends; a full class spills into the next larger one. The message
+// starts with one reference, held by the caller. NULL when nothing fits. Called from
+// the httpd task as well as the main loop, so nothing here is static.
+fpm_msg_t *fpm_msgpool_alloc(const char *str)
+{
+    fpm_msg_t *msg;
+    size_t len;
+    uint8_t cls;
+    uint8_t i;
+    len = strlen(str);
+    msg = NULL;
+    portENTER_CRITICAL(&msgpool_mux);
+    if(msgpool_ready == false)
+    {
+        msgpool_init();
+    }
+    for(cls = 0; (cls < MSGPOOL_CLASS_COUNT) && (msg == NULL); cls++)
+    {
+        if(len + WS_MSG_CNTID_RESERVE > msgpool_class_size[cls])
+        {
+            continue;
+        }
+        for(i = msgpool_class_first[cls]; i < msgpool_class_first[cls] + msgpool_class_count[cls]; i++)
+        {
+            if(msgpool_msgs[i].refs == 0)
+            {
+                msg = &msgpool_msgs[i];
+                msg->refs = 1;
+                msg->cls = cls;
+                msg->len = (uint16_t)len;
+                msgpool_class_used[cls]++;
+                if(msgpool_class_used[cls] > msgpool_stats.class_peak[cls])
+                {
+                    msgpool_stats.class_peak[cls] = msgpool_class_used[cls];
+                }
+                break;
+            }
+        }
+    }
+    if(msg == NULL)
+    {
+        if(len + WS_MSG_CNTID_RESERVE > MSGPOOL_LARGE_SIZE)
+        {
+            msgpool_stats.oversize++;
+        }
+        else
+        {
+            msgpool_stats.exhausted++;
+        }
+    }
+    else
+    {
+        msgpool_stats.allocs++;
+    }
+    portEXIT_CRITICAL(&msgpool_mux);
+    if(msg == NULL)
+    {
+        ESP_LOGI(TAG, "No buffer for %u bytes", (unsigned)len);
+        return NULL;
+    }
+    memcpy(msg->data, str, len + 1);
+    return msg;
+}
+
+// Queues are filled from both tasks, so their drop count is kept under the pool lock.
+void fpm_msgpool_que_full(void)
+{
+    portENTER_CRITICAL(&msgpool_mux);
+    msgpool_stats.que_full++;
+    portEXIT_CRITICAL(&msgpool_mux);
+}
+
+void fpm_msgpool_ref(fpm_msg_t *msg)
+{
+    portENTER_CRITICAL(&msgpool_mux);
+    msg->refs++;
+    portEXIT_CRITICAL(&msgpool_mux);
+}
+
+void fpm_msgpool_release(fpm_msg_t *msg)
+{
+    if(msg == NULL)
+    {
+        return;
+    }
+    portENTER_CRITICAL(&msgpool_mux);
+    if(msg->refs > 0)
+    {
+        msg->refs--;
+        if(msg->refs == 0)
+        {
+            msgpool_class_used[msg->cls]--;
+        }
+    }
+    portEXIT_CRITICAL(&msgpool_mux);
+}
+
+// Text of a queued message, terminated again where the previous send appended its
+// count ID.
+char *fpm_msgpool_text(fpm_msg_t *msg)
+{
+    msg->data[msg->len] = 0;
+    return msg->data;
+}
+
+char *fpm_msgpool_stats_json(void)
+{
+    static uint8_t cls;
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    cJSON *class_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(stats_json_obj, "allocs", cJSON_CreateNumber(msgpool_stats.allocs));
+    cJSON_AddItemToObject(stats_json_obj, "exhausted", cJSON_CreateNumber(msgpool_stats.exhausted));
+    cJSON_AddItemToObject(stats_json_obj, "oversize", cJSON_CreateNumber(msgpool_stats.oversize));
+    cJSON_AddItemToObject(stats_json_obj, "quefull", cJSON_CreateNumber(msgpool_stats.que_full));
+    for(cls = 0; cls < MSGPOOL_CLASS_COUNT; cls++)
+    {
+        cJSON *class_json_obj = cJSON_CreateObject();
+        cJSON_AddItemToObject(class_json_obj, "size", cJSON_CreateNumber(msgpool_class_size[cls]));
+        cJSON_AddItemToObject(class_json_obj, "count", cJSON_CreateNumber(msgpool_class_count[cls]));
+        cJSON_AddItemToObject(class_json_obj, "used", cJSON_CreateNumber(msgpool_class_used[cls]));
+        cJSON_AddItemToObject(class_json_obj, "peak", cJSON_CreateNumber(msgpool_stats.class_peak[cls]));
+        cJSON_AddItemToArray(class_array, class_json_obj);
+    }
+    cJSON_AddItemToObject(stats_json_obj, "classes", class_array);
+    char *json_print = cJSON_PrintUnformatted(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
@@ -0,0 +1,291 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include <math.h>
+#include <sys/time.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "total_app.h"
+
+#define TREND_RING_RECORDS ((CONFIG_FPM_TREND_MINUTES * 60 * 1000) / CONFIG_FPM_ACQ_FULL_PERIOD)
+#define TREND_BLOCK_COUNT ((TREND_RING_RECORDS * sizeof(fpm_trend_record_t)) / TREND_BLOCK_SIZE)
+
+typedef struct
+{
+    uint16_t reg_address;
+    uint16_t scale;
+    const char *name;
+}fpm_trend_channel_t;
+
+// Values are stored as int16 of (value * scale), the scale is chosen per channel so the
+// expected range of a feeder pillar fits: 0.1 V, 0.1 A, 0.01 kW, 0.001 PF, 0.01 Hz.
+static const fpm_trend_channel_t trend_channels[TREND_CHANNEL_COUNT] =
+{
+    {0x5002, 10, "V1"},
+    {0x5004, 10, "V2"},
+    {0x5006, 10, "V3"},
+    {0x500C, 10, "I1"},
+    {0x500E, 10, "I2"},
+    {0x5010, 10, "I3"},
+    {0x5014, 100, "P1"},
+    {0x5016, 100, "P2"},
+    {0x5018, 100, "P3"},
+    {0x5012, 100, "P"},
+    {0x502A, 1000, "PF"},
+    {0x5008, 100, "F"},
+};
+
+typedef struct
+{
+    uint32_t first_seq;
+    uint16_t count;
+    uint8_t data[TREND_BLOCK_SIZE];
+}fpm_trend_block_t;
+
+// Compressed blocks within the RAM budget of TREND_RING_RECORDS raw records, which
+// keeps several times that many. Only the newest block is being encoded.
+static fpm_trend_block_t trend_blocks[TREND_BLOCK_COUNT];
+static uint32_t trend_block_next = 0;
+static fpm_tscodec_enc_t trend_enc;
+static uint32_t trend_seq_next = 0;
+static portMUX_TYPE trend_mux = portMUX_INITIALIZER_UNLOCKED;
+static fpm_tscodec_stats_t trend_codec_stats;
+
+int16_t fpm_trend_scale(float value, uint16_t scale)
+{
+    static float scaled;
+    scaled = value * scale;
+    if(isnan(scaled))
+    {
+        return INT16_MIN;
+    }
+    if(scaled > INT16_MAX)
+    {
+        return INT16_MAX;
+    }
+    if(scaled < (INT16_MIN + 1))
+    {
+        return INT16_MIN + 1;
+    }
+    return (int16_t)lroundf(scaled);
+}
+
+static uint64_t trend_record_time(const fpm_trend_record_t *record)
+{
+    return ((uint64_t)record->time_sec * 1000) + record->time_ms;
+}
+
+// Encoding runs outside the lock: readers only decode the records a block's published
+// count covers, and bits past them are never rewritten until the block is recycled.
+static void trend_append_encoded(const fpm_trend_record_t *record)
+{
+    static fpm_trend_block_t *block;
+    static int64_t encode_start;
+    static uint16_t bytes_before;
+    encode_start = esp_timer_get_time();
+    bytes_before = fpm_tscodec_enc_bytes(&trend_enc);
+    if((trend_block_next == 0) || (fpm_tscodec_enc_put(&trend_enc, trend_record_time(record), record->quality_mask, record->value) == false))
+    {
+        portENTER_CRITICAL(&trend_mux);
+        block = &trend_blocks[trend_block_next % TREND_BLOCK_COUNT];
+        block->first_seq = trend_seq_next;
+        block->count = 0;
+        trend_block_next++;
+        portEXIT_CRITICAL(&trend_mux);
+        fpm_tscodec_enc_init(&trend_enc, block->data, TREND_BLOCK_SIZE, TREND_CHANNEL_COUNT);
+        fpm_tscodec_enc_put(&trend_enc, trend_record_time(record), record->quality_mask, record->value);
+        bytes_before = 0;
+    }
+    portENTER_CRITICAL(&trend_mux);
+    trend_blocks[(trend_block_next - 1) % TREND_BLOCK_COUNT].count = trend_enc.count;
+    trend_seq_next++;
+    portEXIT_CRITICAL(&trend_mux);
+    trend_codec_stats.records++;
+    trend_codec_stats.raw_bytes += sizeof(fpm_trend_record_t);
+    trend_codec_stats.encoded_bytes += fpm_tscodec_enc_bytes(&trend_enc) - bytes_before;
+    trend_codec_stats.encode_us += (uint64_t)(esp_timer_get_time() - encode_start);
+}
+
+// Called once per completed sweep. Channels whose quality is not good keep the last
+// value and are flagged in quality_mask; INT16_MIN is reserved for "no value".
+const fpm_trend_record_t *fpm_trend_append(void)
+{
+    static fpm_trend_record_t record;
+    static fpm_sample_meta_t meta;
+    static struct timeval tv;
+    static float value;
+    static uint8_t i;
+    record.quality_mask = 0;
+    for(i = 0; i < TREND_CHANNEL_COUNT; i++)
+    {
+        if(fpm_modbus_get_sample(trend_channels[i].reg_address, &value, &meta) == false)
+        {
+            record.value[i] = INT16_MIN;
+            record.quality_mask |= (1 << i);
+            continue;
+        }
+        record.value[i] = fpm_trend_scale(value, trend_channels[i].scale);
+        if(meta.quality != SAMPLE_QUALITY_GOOD)
+        {
+            record.quality_mask |= (1 << i);
+        }
+    }
+    if(sntp_time_valid == true)
+    {
+        gettimeofday(&tv, NULL);
+        record.time_sec = (uint32_t)tv.tv_sec;
+        record.time_ms = (uint16_t)(tv.tv_usec / 1000);
+        record.quality_mask |= TREND_FLAG_UTC;
+    }
+    else
+    {
+        record.time_sec = (uint32_t)(esp_timer_get_time() / 1000000);
+        record.time_ms = (uint16_t)((esp_timer_get_time() / 1000) % 1000);
+    }
+    trend_append_encoded(&record);
+    return &record;
+}
+
+static uint32_t trend_oldest_block(void)
+{
+    return (trend_block_next > TREND_BLOCK_COUNT) ? (trend_block_next - TREND_BLOCK_COUNT) : 0;
+}
+
+// Snapshots the ring and returns the number of records fpm_trend_next will return.
+uint32_t fpm_trend_open(fpm_trend_iter_t *it)
+{
+    memset(it, 0, sizeof(fpm_trend_iter_t));
+    portENTER_CRITICAL(&trend_mux);
+    it->block_no = trend_oldest_block();
+    it->seq = (trend_block_next != 0) ? trend_blocks[it->block_no % TREND_BLOCK_COUNT].first_seq : 0;
+    it->seq_end = trend_seq_next;
+    portEXIT_CRITICAL(&trend_mux);
+    return it->seq_end - it->seq;
+}
+
+// Copies the block holding it->seq out of the ring. Fails when the writer has recycled
+// it, before or during the copy; the block number is bumped before the block is cleared,
+// so checking it again after the copy is enough.
+static bool trend_load_block(fpm_trend_iter_t *it)
+{
+    static fpm_trend_block_t *block;
+    static uint16_t count;
+    portENTER_CRITICAL(&trend_mux);
+    if(it->block_no < trend_oldest_block())
+    {
+        it->block_no = trend_oldest_block();
+    }
+    block = &trend_blocks[it->block_no % TREND_BLOCK_COUNT];
+    if((it->block_no >= trend_block_next) || (block->first_seq != it->seq))
+    {
+        portEXIT_CRITICAL(&trend_mux);
+        return false;
+    }
+    count = block->count;
+    portEXIT_CRITICAL(&trend_mux);
+    memcpy(it->data, block->data, TREND_BLOCK_SIZE);
+    portENTER_CRITICAL(&trend_mux);
+    if(it->block_no < trend_oldest_block())
+    {
+        portEXIT_CRITICAL(&trend_mux);
+        return false;
+    }
+    portEXIT_CRITICAL(&trend_mux);
+    fpm_tscodec_dec_init(&it->dec, it->data, count, TREND_CHANNEL_COUNT);
+    it->block_no++;
+    return true;
+}
+
+// Records come out oldest first, decoded one at a time. Records lost to the writer while
+// reading come back zeroed so the count given by fpm_trend_open stays true.
+bool fpm_trend_next(fpm_trend_iter_t *it, fpm_trend_record_t *record)
+{
+    static int64_t decode_start;
+    static uint64_t time;
+    if(it->seq >= it->seq_end)
+    {
+        return false;
+    }
+    if((it->dec.remaining == 0) && (trend_load_block(it) == false))
+    {
+        memset(record, 0, sizeof(fpm_trend_record_t));
+        it->seq++;
+        return true;
+    }
+    it->seq++;
+    decode_start = esp_timer_get_time();
+    fpm_tscodec_dec_next(&it->dec, &time, &record->quality_mask, record->value);
+    record->time_sec = (uint32_t)(time / 1000);
+    record->time_ms = (uint16_t)(time % 1000);
+    trend_codec_stats.decoded_bytes += sizeof(fpm_trend_record_t);
+    trend_codec_stats.decode_us += (uint64_t)(esp_timer_get_time() - decode_start);
+    return true;
+}
+
+char *fpm_trend_stats_json(void)
+{
+    static uint32_t first_seq;
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    portENTER_CRITICAL(&trend_mux);
+    first_seq = (trend_block_next != 0) ? trend_blocks[trend_oldest_block() % TREND_BLOCK_COUNT].first_seq : 0;
+    portEXIT_CRITICAL(&trend_mux);
+    cJSON_AddItemToObject(stats_json_obj, "blocks", cJSON_CreateNumber(TREND_BLOCK_COUNT));
+    cJSON_AddItemToObject(stats_json_obj, "blocksize", cJSON_CreateNumber(TREND_BLOCK_SIZE));
+    cJSON_AddItemToObject(stats_json_obj, "held", cJSON_CreateNumber(trend_seq_next - first_seq));
+    cJSON_AddItemToObject(stats_json_obj, "rawcapacity", cJSON_CreateNumber(TREND_RING_RECORDS));
+    fpm_tscodec_stats_add(stats_json_obj, &trend_codec_stats);
+    char *json_print = cJSON_Print(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
+
+// Blob header, little endian: "FPMT", version, channel count, record size, record count,
+// then reg_address/scale per channel. Records follow as fpm_trend_record_t, oldest first.
+uint16_t fpm_trend_header(uint8_t *dst, uint16_t record_count)
+{
+    static uint16_t len;
+    len = 0;
+    memcpy(&dst[len], "FPMT", 4);
+    len += 4;
+    dst[len++] = TREND_BLOB_VERSION;
+    dst[len++] = TREND_CHANNEL_COUNT;
+    dst[len++] = (uint8_t)(sizeof(fpm_trend_record_t) & 0xFF);
+    dst[len++] = (uint8_t)(sizeof(fpm_trend_record_t) >> 8);
+    dst[len++] = (uint8_t)(record_count & 0xFF);
+    dst[len++] = (uint8_t)(record_count >> 8);
+    len += fpm_trend_channel_desc(&dst[len]);
+    return len;
+}
+
+// reg_address and scale per channel, little endian; shared by the trend and history blobs.
+uint16_t fpm_trend_channel_desc(uint8_t *dst)
+{
+    static uint16_t len;
+    static uint8_t i;
+    len = 0;
+    for(i = 0; i < TREND_CHANNEL_COUNT; i++)
+    {
+        dst[len++] = (uint8_t)(trend_channels[i].reg_address & 0xFF);
+        dst[len++] = (uint8_t)(trend_channels[i].reg_address >> 8);
+        dst[len++] = (uint8_t)(trend_channels[i].scale & 0xFF);
+        dst[len++] = (uint8_t)(trend_channels[i].scale >> 8);
+    }
+    return len;
+}
+
+const char *fpm_trend_channel_name(uint8_t channel)
+{
+    return trend_channels[channel].name;
+}
+
+uint16_t fpm_trend_channel_scale(uint8_t channel)
+{
+    return trend_channels[channel].scale;
+}
+
+uint16_t fpm_trend_channel_register(uint8_t channel)
+{
+    return trend_channels[channel].reg_address;
+}
@@ -0,0 +1,336 @@
+#include "stdbool.h"
+#include "string.h"
+#include "inttypes.h"
+#include "total_app.h"
+
+// Block codec for time series of scaled integers.
+//   time:   delta-of-delta, '0' | '10'+7 | '110'+9 | '1110'+12 | '1111'+40 bits, all
+//           two's complement; a larger step (the jump to UTC at SNTP sync) opens a block
+//   mask:   '0' unchanged | '1'+16 bits
+//   fields: zigzag delta, '0' | '10'+6 | '110'+10 | '111'+16 bits raw value
+// The first record of a block stores time (48 bits), mask and fields raw, so every
+// block decodes on its own. Time units are up to the caller (ms for the RAM ring,
+// seconds for the flash log).
+
+#define TSCODEC_FIRST_BITS(nfields) (48 + 16 + ((uint32_t)(nfields) * 16))
+#define TSCODEC_WORST_BITS(nfields) (44 + 17 + ((uint32_t)(nfields) * 19))
+#define TSCODEC_DOD_ESCAPE_MAX (((int64_t)1 << 39) - 1)
+#define TSCODEC_SELFTEST_BYTES 256
+
+static bool tscodec_selftest_ok;
+
+static void tscodec_put_bits(fpm_tscodec_enc_t *enc, uint64_t value, uint8_t bits)
+{
+    while(bits > 0)
+    {
+        bits--;
+        if((value >> bits) & 1)
+        {
+            enc->buf[enc->bitpos >> 3] |= (uint8_t)(0x80 >> (enc->bitpos & 7));
+        }
+        enc->bitpos++;
+    }
+}
+
+static uint64_t tscodec_get_bits(fpm_tscodec_dec_t *dec, uint8_t bits)
+{
+    static uint64_t value;
+    value = 0;
+    while(bits > 0)
+    {
+        bits--;
+        value = (value << 1) | ((dec->buf[dec->bitpos >> 3] >> (7 - (dec->bitpos & 7))) & 1);
+        dec->bitpos++;
+    }
+    return value;
+}
+
+static int64_t tscodec_sign_extend(uint64_t value, uint8_t bits)
+{
+    if(value & ((uint64_t)1 << (bits - 1)))
+    {
+        return (int64_t)(value | (~(uint64_t)0 << bits));
+    }
+    return (int64_t)value;
+}
+
+void fpm_tscodec_enc_init(fpm_tscodec_enc_t *enc, uint8_t *buf, uint16_t size, uint8_t nfields)
+{
+    memset(enc, 0, sizeof(fpm_tscodec_enc_t));
+    memset(buf, 0, size);
+    enc->buf = buf;
+    enc->size = size;
+    enc->nfields = (nfields > TSCODEC_MAX_FIELDS) ? TSCODEC_MAX_FIELDS : nfields;
+}
+
+// Returns false without writing anything when the record might not fit, or when its
+// time step is beyond the escape; the caller then starts a new block with it.
+bool fpm_tscodec_enc_put(fpm_tscodec_enc_t *enc, uint64_t time, uint16_t mask, const int16_t *fields)
+{
+    static int64_t delta;
+    static int64_t dod;
+    static int32_t field_delta;
+    static uint32_t zigzag;
+    static uint8_t i;
+    if(enc->bitpos + ((enc->count == 0) ? TSCODEC_FIRST_BITS(enc->nfields) : TSCODEC_WORST_BITS(enc->nfields)) > (uint32_t)enc->size * 8)
+    {
+        return false;
+    }
+    if(enc->count != 0)
+    {
+        delta = (int64_t)(time - enc->prev_time);
+        dod = delta - enc->prev_delta;
+        if((dod < -TSCODEC_DOD_ESCAPE_MAX - 1) || (dod > TSCODEC_DOD_ESCAPE_MAX))
+        {
+            return false;
+        }
+    }
+    if(enc->count == 0)
+    {
+        tscodec_put_bits(enc, time, 48);
+        tscodec_put_bits(enc, mask, 16);
+        for(i = 0; i < enc->nfields; i++)
+        {
+            tscodec_put_bits(enc, (uint16_t)fields[i], 16);
+        }
+        enc->prev_delta = 0;
+    }
+    else
+    {
+        if(dod == 0)
+        {
+            tscodec_put_bits(enc, 0, 1);
+        }
+        else if((dod >= -64) && (dod <= 63))
+        {
+            tscodec_put_bits(enc, 0x2, 2);
+            tscodec_put_bits(enc, (uint64_t)dod, 7);
+        }
+        else if((dod >= -256) && (dod <= 255))
+        {
+            tscodec_put_bits(enc, 0x6, 3);
+            tscodec_put_bits(enc, (uint64_t)dod, 9);
+        }
+        else if((dod >= -2048) && (dod <= 2047))
+        {
+            tscodec_put_bits(enc, 0xE, 4);
+            tscodec_put_bits(enc, (uint64_t)dod, 12);
+        }
+        else
+        {
+            tscodec_put_bits(enc, 0xF, 4);
+            tscodec_put_bits(enc, (uint64_t)dod, 40);
+        }
+        enc->prev_delta = delta;
+        if(mask == enc->prev_mask)
+        {
+            tscodec_put_bits(enc, 0, 1);
+        }
+        else
+        {
+            tscodec_put_bits(enc, 1, 1);
+            tscodec_put_bits(enc, mask, 16);
+        }
+        for(i = 0; i < enc->nfields; i++)
+        {
+            field_delta = (int32_t)fields[i] - enc->prev[i];
+            zigzag = ((uint32_t)field_delta << 1) ^ (uint32_t)(field_delta >> 31);
+            if(zigzag == 0)
+            {
+                tscodec_put_bits(enc, 0, 1);
+            }
+            else if(zigzag < 64)
+            {
+                tscodec_put_bits(enc, 0x2, 2);
+                tscodec_put_bits(enc, zigzag, 6);
+            }
+            else if(zigzag < 1024)
+            {
+                tscodec_put_bits(enc, 0x6, 3);
+                tscodec_put_bits(enc, zigzag, 10);
+            }
+            else
+            {
+                tscodec_put_bits(enc, 0x7, 3);
+                tscodec_put_bits(enc, (uint16_t)fields[i], 16);
+            }
+        }
+    }
+    enc->prev_time = time;
+    enc->prev_mask = mask;
+    for(i = 0; i < enc->nfields; i++)
+    {
+        enc->prev[i] = fields[i];
+    }
+    enc->count++;
+    return true;
+}
+
+uint16_t fpm_tscodec_enc_bytes(const fpm_tscodec_enc_t *enc)
+{
+    return (uint16_t)((enc->bitpos + 7) >> 3);
+}
+
+void fpm_tscodec_dec_init(fpm_tscodec_dec_t *dec, const uint8_t *buf, uint16_t count, uint8_t nfields)
+{
+    memset(dec, 0, sizeof(fpm_tscodec_dec_t));
+    dec->buf = buf;
+    dec->remaining = count;
+    dec->nfields = (nfields > TSCODEC_MAX_FIELDS) ? TSCODEC_MAX_FIELDS : nfields;
+    dec->first = true;
+}
+
+// Decodes one record per call, the state carries across calls so a block can be
+// streamed out without expanding it first.
+bool fpm_tscodec_dec_next(fpm_tscodec_dec_t *dec, uint64_t *time, uint16_t *mask, int16_t *fields)
+{
+    static uint32_t zigzag;
+    static int32_t field_delta;
+    static uint8_t i;
+    if(dec->remaining == 0)
+    {
+        return false;
+    }
+    if(dec->first == true)
+    {
+        dec->first = false;
+        dec->prev_time = tscodec_get_bits(dec, 48);
+        dec->prev_mask = (uint16_t)tscodec_get_bits(dec, 16);
+        for(i = 0; i < dec->nfields; i++)
+        {
+            dec->prev[i] = (int16_t)tscodec_get_bits(dec, 16);
+        }
+        dec->prev_delta = 0;
+    }
+    else
+    {
+        if(tscodec_get_bits(dec, 1) == 0)
+        {
+        }
+        else if(tscodec_get_bits(dec, 1) == 0)
+        {
+            dec->prev_delta += tscodec_sign_extend(tscodec_get_bits(dec, 7), 7);
+        }
+        else if(tscodec_get_bits(dec, 1) == 0)
+        {
+            dec->prev_delta += tscodec_sign_extend(tscodec_get_bits(dec, 9), 9);
+        }
+        else if(tscodec_get_bits(dec, 1) == 0)
+        {
+            dec->prev_delta += tscodec_sign_extend(tscodec_get_bits(dec, 12), 12);
+        }
+        else
+        {
+            dec->prev_delta += tscodec_sign_extend(tscodec_get_bits(dec, 40), 40);
+        }
+        dec->prev_time += dec->prev_delta;
+        if(tscodec_get_bits(dec, 1) == 1)
+        {
+            dec->prev_mask = (uint16_t)tscodec_get_bits(dec, 16);
+        }
+        for(i = 0; i < dec->nfields; i++)
+        {
+            if(tscodec_get_bits(dec, 1) == 0)
+            {
+                continue;
+            }
+            if(tscodec_get_bits(dec, 1) == 0)
+            {
+                zigzag = (uint32_t)tscodec_get_bits(dec, 6);
+            }
+            else if(tscodec_get_bits(dec, 1) == 0)
+            {
+                zigzag = (uint32_t)tscodec_get_bits(dec, 10);
+            }
+            else
+            {
+                dec->prev[i] = (int16_t)tscodec_get_bits(dec, 16);
+                continue;
+            }
+            field_delta = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+            dec->prev[i] = (int16_t)(dec->prev[i] + field_delta);
+        }
+    }
+    dec->remaining--;
+    *time = dec->prev_time;
+    *mask = dec->prev_mask;
+    for(i = 0; i < dec->nfields; i++)
+    {
+        fields[i] = dec->prev[i];
+    }
+    return true;
+}
+
+// Round trip of every time prefix at both ends of its range, the escape, and a step too
+// large for it; run once at boot, the result is reported with the codec stats.
+bool fpm_tscodec_selftest(void)
+{
+    static const int64_t dods[] = {1, -1, 63, -64, 64, -65, 255, -256, 256, -257, 2047, -2048, 2048, -2049,
+                                   TSCODEC_DOD_ESCAPE_MAX, -TSCODEC_DOD_ESCAPE_MAX - 1, 0};
+    static uint8_t buf[2][TSCODEC_SELFTEST_BYTES];
+    static uint64_t times[sizeof(dods) / sizeof(dods[0]) + 2];
+    static fpm_tscodec_enc_t enc;
+    static fpm_tscodec_dec_t dec;
+    static uint64_t time;
+    static int64_t delta;
+    static uint16_t mask;
+    static int16_t field;
+    static uint8_t count;
+    static uint8_t i;
+    tscodec_selftest_ok = false;
+    time = (uint64_t)1 << 41;
+    delta = 0;
+    fpm_tscodec_enc_init(&enc, buf[0], TSCODEC_SELFTEST_BYTES, 1);
+    for(i = 0; i < sizeof(times) / sizeof(times[0]) - 1; i++)
+    {
+        if(i > 0)
+        {
+            delta += dods[i - 1];
+            time += delta;
+        }
+        times[i] = time;
+        field = (int16_t)(i * 997);
+        if(fpm_tscodec_enc_put(&enc, time, i, &field) == false)
+        {
+            return false;
+        }
+    }
+    count = enc.count;
+    // a monotonic to UTC sized jump must be refused and open the next block
+    times[i] = time + 1790000000000ULL;
+    field = (int16_t)(i * 997);
+    if(fpm_tscodec_enc_put(&enc, times[i], i, &field) == true)
+    {
+        return false;
+    }
+    fpm_tscodec_enc_init(&enc, buf[1], TSCODEC_SELFTEST_BYTES, 1);
+    fpm_tscodec_enc_put(&enc, times[i], i, &field);
+    fpm_tscodec_dec_init(&dec, buf[0], count, 1);
+    for(i = 0; i < count; i++)
+    {
+        if((fpm_tscodec_dec_next(&dec, &time, &mask, &field) == false) || (time != times[i]) || (mask != i) || (field != (int16_t)(i * 997)))
+        {
+            return false;
+        }
+    }
+    fpm_tscodec_dec_init(&dec, buf[1], 1, 1);
+    if((fpm_tscodec_dec_next(&dec, &time, &mask, &field) == false) || (time != times[i]) || (mask != i) || (field != (int16_t)(i * 997)))
+    {
+        return false;
+    }
+    tscodec_selftest_ok = true;
+    return true;
+}
+
+// Ratio is raw record bytes over encoded bytes; throughput is raw bytes per microsecond,
+// which is the same figure as MB/s.
+void fpm_tscodec_stats_add(cJSON *stats_json_obj, const fpm_tscodec_stats_t *stats)
+{
+    cJSON_AddItemToObject(stats_json_obj, "codecrecords", cJSON_CreateNumber(stats->records));
+    cJSON_AddItemToObject(stats_json_obj, "codecraw", cJSON_CreateNumber(stats->raw_bytes));
+    cJSON_AddItemToObject(stats_json_obj, "codecencoded", cJSON_CreateNumber(stats->encoded_bytes));
+    cJSON_AddItemToObject(stats_json_obj, "codecratio", cJSON_CreateNumber((stats->encoded_bytes != 0) ? (double)stats->raw_bytes / stats->encoded_bytes : 0));
+    cJSON_AddItemToObject(stats_json_obj, "encodembs", cJSON_CreateNumber((stats->encode_us != 0) ? (double)stats->raw_bytes / stats->encode_us : 0));
+    cJSON_AddItemToObject(stats_json_obj, "codecselftest", cJSON_CreateNumber((tscodec_selftest_ok == true) ? 1 : 0));
+    cJSON_AddItemToObject(stats_json_obj, "decodembs", cJSON_CreateNumber((stats->decode_us != 0) ? (double)stats->decoded_bytes / stats->decode_us : 0));
+}
@@ -25,10 +25,12 @@
 #include "esp_http_server.h"
 #include "esp_netif.h"
 #include "esp_eth_phy_802_3.h"
+#include "lwip/sockets.h"
 #include "time.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/semphr.h"
 #include "http_parser.h"
+#include "esp_random.h"
 #include "total_app.h"
 
 #define FILE_PATH_MAX (ESP_VFS_PATH_MAX + CONFIG_SPIFFS_OBJ_NAME_LEN)
@@ -38,8 +40,26 @@
 #define CLEAN_SOCKETS_INTERVAL 5000
 #define FAST_SEND_UI_TEXT_MESSAGE_DELAY 80
 #define SLOW_SEND_UI_TEXT_MESSAGE_DELAY 200
-#define AUTHENTICATED_FALSE 0
-#define AUTHENTICATED_TRUE 1
+#define WS_CONTROL_RESERVE 1
+#define WS_CONTROL_BURST 8
+#define VIEWER_SEND_START 0x01
+#define VIEWER_SEND_VALIDATE 0x02
+#define VIEWER_SEND_BURST 0x04
+#define VIEWER_SEND_AGGREGATE 0x08
+#define VIEWER_SEND_ELECTRICAL 0x20
+#define VIEWER_SEND_INFOCONFIG 0x40
+#define SUB_ALL 0
+#define SUB_NONE 1
+#define SUB_SET 2
+#define ELECTRICAL_SUBSET_SIZE 4096
+#define WS_RATE_MAX 600000
+#define WS_PARK_TIMEOUT 30000
+#define WS_BATCH_SIZE 1460
+#define WS_BATCH_SEPARATOR 0x1e
+#define REPLAY_ELECTRICAL 0x01
+#define REPLAY_INFOCONFIG 0x02
+#define REPLAY_BURST 0x04
+#define REPLAY_AGGREGATE 0x10
 #define WRITE_SETTING 0
 #define READ_SETTING 1
 #define WRITE_FILE 0
@@ -48,6 +68,14 @@
 #define OTHER_CLIENT 1
 #define ALL_CLIENT 2
 #define ONESECOND_TIME_PERSISTENT_PERIOD 1000
+#define TREND_CHUNK_RECORDS 32
+#define HISTORY_CHUNK_SIZE 1024
+#define MODBUS_WRITE_DEADLINE 500
+#define ARBITER_PRIORITY_POLL 1
+// a sweep in progress is rescheduled this far ahead at every CID boundary; longer than
+// MODBUS_WRITE_DEADLINE so a waiting write or burst goes before the next CID
+#define ARBITER_POLL_STEP_DEADLINE 1000
+#define ARBITER_PRIORITY_WRITE 3
 #define IS_FILE_EXT(filename, ext) \
     (strcasecmp(&filename[strlen(filename) - sizeof(ext) + 1], ext) == 0)
 
@@ -56,7 +84,9 @@ typedef enum
     SUPERVISOR_ACCESS,
     ADMINISTRATOR_ACCESS,
     MAX_ADMIN,
-    BAD_CREDENTIAL
+    BAD_CREDENTIAL,
+    VIEWER_ACCESS,
+    MAX_VIEWER
 }enum_validate_result_t;
 
 typedef esp_err_t (*httpd_req_handler_t)(httpd_req_t *req);
@@ -78,6 +108,15 @@ typedef struct
     int len;
 }ota_data_t;
 
+typedef struct
+{
+    httpd_req_t *req;
+    char chunk[HISTORY_CHUNK_SIZE];
+    uint16_t len;
+    uint8_t mode;
+    bool first;
+}fpm_historyq_ctx_t;
+
 static const char *TAG = "WEB";
 
 struct file_server_data {
@@ -90,8 +129,13 @@ const char *uri_logo = "/logo.png";
 const char *uri_favicon = "/favicon.ico";
 const char *uri_login = "/login";
 const char *uri_custommsg = "/custommsg";
+const char *uri_trend = "/trend";
+const char *uri_history = "/history";
+const char *uri_historyq = "/historyq";
+const char *uri_energy = "/energy";
 const char *uri_bootupdate = "/bootupdate/*";
 const char *uri_dataupdate = "/dataupdate/*";
+const char *uri_wsboot = "/wsboot";
 
 char FirmVer[15] = "V1.00";
 char wifiapip[30] = " ";
@@ -150,21 +194,173 @@ unsigned long target_send_ui_text_message_delay;
 char ethernet_status_msg[20] = "Not Connected";
 char back_ethernet_status_msg[20] = "Not Connected";
 fpm_wsockets_t fpm_wsockets[MAX_WS_CLIENTS];
+fpm_ws_stats_t ws_stats;
+fpm_viewer_t *fpm_viewers = NULL;
+fpm_viewer_stats_t viewer_stats;
+uint16_t viewer_limit = CONFIG_FPM_VIEWER_MAX;
+uint32_t viewer_key;
+char viewer_key_str[20] = "0";
+char viewer_limit_str[10];
+char viewer_ws_uri[30];
+httpd_uri_t viewer_ws;
+static portMUX_TYPE viewer_mux = portMUX_INITIALIZER_UNLOCKED;
+static char *viewer_persistent;
+static uint16_t viewer_persistent_len;
+static uint16_t electrical_frag_off[WS_SUB_CIDS];
+static uint16_t electrical_frag_len[WS_SUB_CIDS];
+static uint8_t electrical_frag_cid[WS_SUB_CIDS];
+static uint16_t electrical_frag_count;
+static uint16_t electrical_head_len;
+static uint16_t electrical_tail_off;
+static uint32_t electrical_gen;
+static char metermsg_subset[ELECTRICAL_SUBSET_SIZE];
+static uint16_t metermsg_subset_len;
+static uint32_t subset_gen;
+static uint32_t ws_state_gen;
+static char ws_batch[WS_BATCH_SIZE + 1];
+static uint16_t ws_batch_len;
+static uint8_t ws_batch_count;
+static uint32_t subset_mask[WS_SUB_WORDS];
+
+typedef struct
+{
+    const char *name;
+    uint16_t first;
+    uint16_t last;
+}ws_sub_group_t;
+
+// Subscription groups by register range; a name may cover more than one range.
+static const ws_sub_group_t ws_sub_groups[] =
+{
+    {"meter", 0x4000, 0x4FFF},
+    {"volt", 0x5000, 0x5009},
+    {"volt", 0x5032, 0x5037},
+    {"curr", 0x500A, 0x5011},
+    {"power", 0x5012, 0x5031},
+    {"energy", 0x6000, 0x6FFF},
+};
 fpm_socket_t fpm_sockets[APP_SOCKET_ALLOCATION];
 httpd_handle_t server = NULL;
 struct file_server_data *server_data = NULL;
 volatile bool async_now = ASYNC_IDLE;
 uint64_t entry_number = 0;
-bool save_new_key = false;
+uint32_t save_new_key = 0;
 
 static esp_err_t _ws_handler(httpd_req_t *req);
+static esp_err_t _viewer_ws_handler(httpd_req_t *req);
+
+static void ClientReleaseQue(fpm_msg_t **que, uint8_t size, uint8_t idx_read, uint8_t idx_write)
+{
+    while(idx_read != idx_write)
+    {
+        fpm_msgpool_release(que[idx_read]);
+        que[idx_read] = NULL;
+        idx_read++;
+        if(idx_read >= size)
+        {
+            idx_read = 0;
+        }
+    }
+}
+
+// Adds a reference for the queue; a full queue drops the message, it never wraps over
+// messages that were not sent yet. The httpd task fills the in queues while the main
+// loop fills the out queues, so nothing here is static.
+static bool ClientQueMessage(fpm_msg_t **que, uint8_t size, uint8_t idx_read, uint8_t *idx_write, fpm_msg_t *msg)
+{
+    uint8_t next;
+    next = (*idx_write + 1 >= size) ? 0 : (*idx_write + 1);
+    if((msg == NULL) || (next == idx_read))
+    {
+        if(msg != NULL)
+        {
+            fpm_msgpool_que_full();
+        }
+        return false;
+    }
+    fpm_msgpool_ref(msg);
+    que[*idx_write] = msg;
+    *idx_write = next;
+    return true;
+}
+
+static void ClientReleaseState(fpm_wsockets_t* fpm_wsocket)
+{
+    static uint8_t slot;
+    for(slot = 0; slot < WS_STATE_COUNT; slot++)
+    {
+        fpm_msgpool_release(fpm_wsocket->textmessage_state[slot]);
+        fpm_wsocket->textmessage_state[slot] = NULL;
+    }
+}
+
+// Latest value wins: a state message (settings, write access, device info) replaces
+// the version the client has not been sent yet instead of queueing behind it.
+static void ClientSetStateMessage(fpm_wsockets_t* fpm_wsocket, uint8_t slot, fpm_msg_t *msg)
+{
+    if((fpm_wsocket == NULL) || (fpm_wsocket->fd == 0) || (msg == NULL))
+    {
+        return;
+    }
+    fpm_msgpool_ref(msg);
+    if(fpm_wsocket->textmessage_state[slot] != NULL)
+    {
+        fpm_msgpool_release(fpm_wsocket->textmessage_state[slot]);
+        ws_stats.conflated++;
+    }
+    fpm_wsocket->textmessage_state[slot] = msg;
+}
+
+static uint8_t ClientStatePending(fpm_wsockets_t *xclient)
+{
+    static uint8_t slot;
+    for(slot = 0; slot < WS_STATE_COUNT; slot++)
+    {
+        if(xclient->textmessage_state[slot] != NULL)
+        {
+            break;
+        }
+    }
+    return slot;
+}
+
+// What went out under each count ID still in the send window: the pooled message, or
+// for the shared meter buffers which one to send again. Nothing is kept for the
+// persistent message, the next one replaces it anyway.
+static void ClientReplayKeep(fpm_wsockets_t *xclient, fpm_msg_t *msg, uint8_t refresh)
+{
+    static uint8_t slot;
+    slot = (uint8_t)((xclient->textmessage_out_cntid - 1) % WS_SEND_WINDOW);
+    fpm_msgpool_release(xclient->replay[slot]);
+    if(msg != NULL)
+    {
+        fpm_msgpool_ref(msg);
+    }
+    xclient->replay[slot] = msg;
+    xclient->replay_refresh[slot] = refresh;
+}
+
+static void ClientReleaseReplay(fpm_wsockets_t *xclient)
+{
+    static uint8_t slot;
+    for(slot = 0; slot < WS_SEND_WINDOW; slot++)
+    {
+        fpm_msgpool_release(xclient->replay[slot]);
+        xclient->replay[slot] = NULL;
+        xclient->replay_refresh[slot] = 0;
+    }
+}
 
 void ClientResetQueTextMessageOut(fpm_wsockets_t* fpm_wsocket)
 {
     if((fpm_wsocket != NULL) && (fpm_wsocket -> fd != 0))
     {
+        ClientReleaseQue(fpm_wsocket->textmessage_out, WS_CLIENT_TXTMSG_BFFR_CNT, fpm_wsocket->textmessage_out_idx_read, fpm_wsocket->textmessage_out_idx_write);
         fpm_wsocket->textmessage_out_idx_write = fpm_wsocket->textmessage_out_idx_read;
+        ClientReleaseState(fpm_wsocket);
         fpm_wsocket->send_meter_electrical = false;
+        fpm_wsocket->send_meter_aggregate = 0;
+        fpm_wsocket->send_meter_burst = false;
     }
 }
 
@@ -172,62 +368,380 @@ void ClientResetQueTextMessageIn(fpm_wsockets_t* fpm_wsocket)
 {
     if((fpm_wsocket != NULL) && (fpm_wsocket -> fd != 0))
     {
+        ClientReleaseQue(fpm_wsocket->textmessage_in, WS_CLIENT_TXTMSG_BFFR_CNT, fpm_wsocket->textmessage_in_idx_read, fpm_wsocket->textmessage_in_idx_write);
         fpm_wsocket->textmessage_in_idx_write = fpm_wsocket->textmessage_in_idx_read;
     }
 }
 
+void ClientQueMessageOut(fpm_wsockets_t* fpm_wsocket, fpm_msg_t *msg)
+{
+    if((fpm_wsocket != NULL) && (fpm_wsocket -> fd != 0))
+    {
+        ClientQueMessage(fpm_wsocket->textmessage_out, WS_CLIENT_TXTMSG_BFFR_CNT, fpm_wsocket->textmessage_out_idx_read, &fpm_wsocket->textmessage_out_idx_write, msg);
+    }
+}
+
 void ClientQueTextMessageOut(fpm_wsockets_t* fpm_wsocket, char* str)
 {
+    static fpm_msg_t *msg;
     if((fpm_wsocket != NULL) && (fpm_wsocket -> fd != 0))
     {
-        strcpy(&fpm_wsocket->textmessage_out[fpm_wsocket->textmessage_out_idx_write][0], str);
-        fpm_wsocket->textmessage_out_idx_write++;
-        if(fpm_wsocket->textmessage_out_idx_write >=  WS_CLIENT_TXTMSG_BFFR_CNT)
-        {
-            fpm_wsocket->textmessage_out_idx_write = 0;
-        }
+        msg = fpm_msgpool_alloc(str);
+        ClientQueMessageOut(fpm_wsocket, msg);
+        fpm_msgpool_release(msg);
+    }
+}
+
+// Control lane: write responses and auth replies overtake everything in the bulk lane.
+// It survives a queue reset, so a write result is not lost to a resync.
+void ClientQueControlMessageOut(fpm_wsockets_t* fpm_wsocket, char* str)
+{
+    static fpm_msg_t *msg;
+    if((fpm_wsocket != NULL) && (fpm_wsocket -> fd != 0))
+    {
+        msg = fpm_msgpool_alloc(str);
+        ClientQueMessage(fpm_wsocket->textmessage_out_priority, WS_CLIENT_PRIORITY_CNT, fpm_wsocket->textmessage_out_priority_idx_read, &fpm_wsocket->textmessage_out_priority_idx_write, msg);
+        fpm_msgpool_release(msg);
     }
 }
 
+// Runs in the httpd task, so the pool buffer is kept in a local.
 void ClientQueTextMessageIn(fpm_wsockets_t* fpm_wsocket, char* str)
 {
+    fpm_msg_t *msg;
     if((fpm_wsocket != NULL) && (fpm_wsocket -> fd != 0))
     {
-        strcpy(&fpm_wsocket->textmessage_in[fpm_wsocket->textmessage_in_idx_write][0], str);
-        fpm_wsocket->textmessage_in_idx_write++;
-        if(fpm_wsocket->textmessage_in_idx_write >= WS_CLIENT_TXTMSG_BFFR_CNT)
+        msg = fpm_msgpool_alloc(str);
+        ClientQueMessage(fpm_wsocket->textmessage_in, WS_CLIENT_TXTMSG_BFFR_CNT, fpm_wsocket->textmessage_in_idx_read, &fpm_wsocket->textmessage_in_idx_write, msg);
+        fpm_msgpool_release(msg);
+    }
+}
+
+static uint8_t ClientInFlight(fpm_wsockets_t *xclient)
+{
+    return (uint8_t)(xclient->textmessage_out_cntid - xclient->textmessage_out_acked);
+}
+
+// UI messages end in "*key*cntid*ack", ack being the next server count ID the UI
+// expects: everything below it has arrived. false when the field is missing or lies
+// outside what was sent since the last ack.
+static bool WsParseAck(char* str, unsigned long acked, unsigned long cntid, unsigned long *ack)
+{
+    static char *field;
+    static char *endptr;
+    static uint8_t i;
+    field = str;
+    for(i = 0; (i < 3) && (field != NULL); i++)
+    {
+        field = strchr(field, '*');
+        field = (field != NULL) ? (field + 1) : NULL;
+    }
+    if(field == NULL)
+    {
+        return false;
+    }
+    *ack = strtoul(field, &endptr, 10);
+    return (endptr != field) && (*ack - acked <= cntid - acked);
+}
+
+// The ack is taken as soon as the frame comes in, so the send window reopens without
+// waiting for the message queue. A frame without a usable ack (older UI, resync after
+// "#start") acknowledges everything.
+void ClientAckReceived(fpm_wsockets_t* fpm_wsocket, char* str)
+{
+    static unsigned long ack;
+    if((fpm_wsocket == NULL) || (fpm_wsocket->fd == 0))
+    {
+        return;
+    }
+    if(WsParseAck(str, fpm_wsocket->textmessage_out_acked, fpm_wsocket->textmessage_out_cntid, &ack) == true)
+    {
+        fpm_wsocket->textmessage_out_acked = ack;
+        ws_stats.acks++;
+        return;
+    }
+    fpm_wsocket->textmessage_out_acked = fpm_wsocket->textmessage_out_cntid;
+    ws_stats.legacy_acks++;
+}
+
+// The httpd task adds viewers and updates them under viewer_mux; only the main loop
+// unlinks and frees them, also under the lock, so it may walk the list without it.
+static fpm_viewer_t *ViewerFind(int fd)
+{
+    static fpm_viewer_t *viewer;
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        if((viewer->fd == fd) && (viewer->closing == false))
+        {
+            return viewer;
+        }
+    }
+    return NULL;
+}
+
+// A started viewer keeps acquisition at the full rate. The period is also read from
+// other tasks, so the walk is under the lock.
+bool ViewersWatching(void)
+{
+    fpm_viewer_t *viewer;
+    bool watching = false;
+    portENTER_CRITICAL(&viewer_mux);
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        if((viewer->started == true) && (viewer->closing == false))
+        {
+            watching = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&viewer_mux);
+    return watching;
+}
+
+// Same test as ViewerAdmit without counting a refusal.
+static bool ViewerRoom(void)
+{
+    return (viewer_stats.active < viewer_limit) && (esp_get_free_heap_size() >= CONFIG_FPM_VIEWER_HEAP_RESERVE);
+}
+
+// Room under the runtime limit and heap above the reserve; operator sessions are
+// counted apart and a viewer never displaces one.
+static bool ViewerAdmit(void)
+{
+    if(viewer_stats.active >= viewer_limit)
+    {
+        viewer_stats.refused_limit++;
+        return false;
+    }
+    if(esp_get_free_heap_size() < CONFIG_FPM_VIEWER_HEAP_RESERVE)
+    {
+        viewer_stats.refused_heap++;
+        return false;
+    }
+    return true;
+}
+
+// Rate limited clients take a sweep once their interval is up. Half a sweep of slack
+// keeps a 5 s interval on every fifth 1 s sweep despite jitter.
+static bool WsRateDue(uint32_t interval, uint32_t *timestamp, uint32_t now, uint32_t slack)
+{
+    if((interval == 0) || (now - *timestamp + slack >= interval))
+    {
+        *timestamp = now;
+        return true;
+    }
+    return false;
+}
+
+// Requested interval in ms, kept between the configured minimum and WS_RATE_MAX.
+static uint32_t WsRateClamp(const char *str)
+{
+    return MIN(MAX((uint32_t)strtoul(str, NULL, 10), CONFIG_FPM_WS_RATE_MIN), WS_RATE_MAX);
+}
+
+static void ViewersMark(uint8_t pending)
+{
+    static fpm_viewer_t *viewer;
+    static uint32_t now;
+    static uint32_t slack;
+    now = xTaskGetTickCount();
+    slack = fpm_acquisition_period() / 2;
+    portENTER_CRITICAL(&viewer_mux);
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        if((viewer->started == true) && (viewer->closing == false))
+        {
+            if(((pending & VIEWER_SEND_ELECTRICAL) != 0) && (WsRateDue(viewer->rate_interval, &viewer->rate_timestamp, now, slack) == false))
+            {
+                viewer->pending |= pending & ~VIEWER_SEND_ELECTRICAL;
+                ws_stats.rate_skipped++;
+                continue;
+            }
+            viewer->pending |= pending;
+        }
+    }
+    portEXIT_CRITICAL(&viewer_mux);
+}
+
+// The socket is gone or its descriptor was handed to a new connection: the viewer is
+// only marked, the main loop frees it.
+static void ViewersCloseFd(int fd)
+{
+    static fpm_viewer_t *viewer;
+    portENTER_CRITICAL(&viewer_mux);
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        if(viewer->fd == fd)
+        {
+            viewer->closing = true;
+        }
+    }
+    portEXIT_CRITICAL(&viewer_mux);
+}
+
+static void ViewerClose(fpm_viewer_t *viewer)
+{
+    httpd_sess_trigger_close(server, viewer->fd);
+    viewer->closing = true;
+    viewer_stats.dropped++;
+}
+
+// The viewer key is never stored: a new one is drawn at every start, so a key that
+// was handed out only lasts until the next restart or credential change.
+static void ViewerKeyNew(void)
+{
+    viewer_key = 0;
+    while(viewer_key == 0)
+    {
+        viewer_key = esp_random();
+    }
+    sprintf(viewer_key_str, "%lu", viewer_key);
+}
+
+// Runs on the httpd task, which owns the URI table and is the only reader of the key.
+static void ViewerKeyRotateWork(void *arg)
+{
+    httpd_unregister_uri(server, viewer_ws_uri);
+    ViewerKeyNew();
+    sprintf(viewer_ws_uri, "/ws%s", viewer_key_str);
+    httpd_register_uri_handler(server, &viewer_ws);
+    ESP_LOGI(TAG, "Viewer key rotated");
+}
+
+// A supervisor or administrator credential changed: the old viewer key stops granting
+// /trend, /history and /energy and every viewer is dropped to log on again.
+static void ViewerKeyRotate(void)
+{
+    static fpm_viewer_t *viewer;
+    if(httpd_queue_work(server, ViewerKeyRotateWork, NULL) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "Viewer key rotation not queued");
+    }
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        if(viewer->closing == false)
+        {
+            ViewerClose(viewer);
+        }
+    }
+}
+
+// All a viewer sends is the ack every frame carries and the few requests that set its
+// pending bits, so frames are handled here and never reach ProcessWsDataFD.
+static void ViewerFrameReceived(int fd, char* str)
+{
+    static fpm_viewer_t *viewer;
+    static unsigned long ack;
+    portENTER_CRITICAL(&viewer_mux);
+    viewer = ViewerFind(fd);
+    if(viewer != NULL)
+    {
+        viewer->in_time_stamp = xTaskGetTickCount();
+        // a viewer has no session to resume, a resume request starts it afresh
+        if((strncmp(str, "&console#new_ws=", 16) == 0) || (strncmp(str, "&console#resume=", 16) == 0))
+        {
+            viewer->out_cntid = viewer->out_acked = 0;
+            viewer->pending = VIEWER_SEND_START | VIEWER_SEND_VALIDATE | VIEWER_SEND_ELECTRICAL | VIEWER_SEND_INFOCONFIG;
+            viewer->rate_interval = CONFIG_FPM_WS_RATE_MIN;
+            viewer->started = true;
+        }
+        else
         {
-            fpm_wsocket->textmessage_in_idx_write = 0;
+            if(WsParseAck(str, viewer->out_acked, viewer->out_cntid, &ack) == true)
+            {
+                viewer->out_acked = ack;
+                ws_stats.acks++;
+            }
+            else
+            {
+                viewer->out_acked = viewer->out_cntid;
+                ws_stats.legacy_acks++;
+            }
+            if(strncmp(str, "&console#start", 14) == 0)
+            {
+                viewer->pending |= VIEWER_SEND_ELECTRICAL | VIEWER_SEND_INFOCONFIG;
+            }
+            else if(strncmp(str, "&console#rdmeter?", 17) == 0)
+            {
+                viewer->pending |= VIEWER_SEND_ELECTRICAL;
+            }
+            else if(strncmp(str, "&console#rate=", 14) == 0)
+            {
+                viewer->rate_interval = WsRateClamp(&str[14]);
+            }
         }
     }
+    portEXIT_CRITICAL(&viewer_mux);
 }
 
+// The text is copied into the pool once; every client queue references the same buffer.
 void WSClientsQueText(fpm_wsockets_t *xclient, char * text, uint8_t direction)
 {
     static uint8_t i;
+    static fpm_msg_t *msg;
+    msg = fpm_msgpool_alloc(text);
     if((direction == ALL_CLIENT) || (xclient == NULL))
     {
         for(i = 0; i < MAX_WS_CLIENTS; i++)
         {
-            if(fpm_wsockets[i].fd != 0){ClientQueTextMessageOut(&fpm_wsockets[i], text);}
+            if(fpm_wsockets[i].fd != 0){ClientQueMessageOut(&fpm_wsockets[i], msg);}
         }
     }
     else if(direction == THIS_CLIENT)
     {
-        ClientQueTextMessageOut(xclient, text);
+        ClientQueMessageOut(xclient, msg);
     }
     else if(direction == OTHER_CLIENT)
     {
         for(i = 0; i < MAX_WS_CLIENTS; i++)
         {
-            if((&fpm_wsockets[i] != xclient) && (fpm_wsockets[i].fd != 0)){ClientQueTextMessageOut(&fpm_wsockets[i], text);}
+            if((&fpm_wsockets[i] != xclient) && (fpm_wsockets[i].fd != 0)){ClientQueMessageOut(&fpm_wsockets[i], msg);}
+        }
+    }
+    fpm_msgpool_release(msg);
+}
+
+static void ClientSetStateByAccess(fpm_wsockets_t *xclient, uint8_t slot, fpm_msg_t *msg_admin, fpm_msg_t *msg_svisor)
+{
+    if(xclient->access == ADMINISTRATOR_ACCESS){ClientSetStateMessage(xclient, slot, msg_admin);}
+    else if(xclient->access == SUPERVISOR_ACCESS){ClientSetStateMessage(xclient, slot, msg_svisor);}
+}
+
+// State message per access level; each variant is pooled once and shared by the
+// clients it goes to.
+void WSClientsSetState(fpm_wsockets_t *xclient, uint8_t slot, char *text_admin, char *text_svisor, uint8_t direction)
+{
+    static uint8_t i;
+    static fpm_msg_t *msg_admin;
+    static fpm_msg_t *msg_svisor;
+    msg_admin = fpm_msgpool_alloc(text_admin);
+    msg_svisor = (text_svisor == text_admin) ? msg_admin : fpm_msgpool_alloc(text_svisor);
+    if((direction == THIS_CLIENT) && (xclient != NULL))
+    {
+        ClientSetStateByAccess(xclient, slot, msg_admin, msg_svisor);
+    }
+    else
+    {
+        // parked sessions miss it; a resume sends them the state again
+        ws_state_gen++;
+        for(i = 0; i < MAX_WS_CLIENTS; i++)
+        {
+            if((fpm_wsockets[i].fd != 0) && ((direction != OTHER_CLIENT) || (&fpm_wsockets[i] != xclient)))
+            {
+                ClientSetStateByAccess(&fpm_wsockets[i], slot, msg_admin, msg_svisor);
+            }
         }
     }
+    fpm_msgpool_release(msg_admin);
+    if(msg_svisor != msg_admin)
+    {
+        fpm_msgpool_release(msg_svisor);
+    }
 }
 
 bool IsClientTextMessageOutQueEmpty(fpm_wsockets_t *xclient)
 {
-    if((xclient->textmessage_out_idx_read == xclient->textmessage_out_idx_write) && (xclient->send_meter_electrical == false))
+    if((xclient->textmessage_out_idx_read == xclient->textmessage_out_idx_write) && (xclient->send_meter_electrical == false) && (xclient->send_meter_aggregate == 0) && (xclient->send_meter_burst == false) && (ClientStatePending(xclient) == WS_STATE_COUNT))
     {
         return 1;
     }
@@ -409,7 +923,8 @@ bool match_fpm_socketws(int fd)
     return false;
 }
 
-enum_validate_result_t validate_credential(char *json_str)
+// xclient is the socket asking over /wsboot, not counted as a session yet; NULL for /login.
+enum_validate_result_t validate_credential(char *json_str, fpm_wsockets_t *xclient)
 {
     cJSON *json_parse = cJSON_Parse(json_str);
     if(json_parse != NULL)
@@ -431,15 +946,37 @@ enum_validate_result_t validate_credential(char *json_str)
                 {
                     static uint8_t i;
                     static uint8_t admin_cnt;
+                    static uint8_t session_cnt;
                     admin_cnt = 0;
+                    session_cnt = 0;
                     for(i = 0; i < MAX_WS_CLIENTS; i++)
                     {
+                        if(&fpm_wsockets[i] == xclient)
+                        {
+                            continue;
+                        }
                         if((fpm_wsockets[i].fd != 0) && (fpm_wsockets[i].access == ADMINISTRATOR_ACCESS))
                         {
                             admin_cnt++;
                         }
+                        if(fpm_wsockets[i].fd != 0)
+                        {
+                            session_cnt++;
+                        }
+                    }
+                    // with the sessions taken a supervisor watches as a viewer instead of
+                    // pushing the oldest session out
+                    if((admin_cnt >= SIMULTANEOUS_CLIENTS) || (session_cnt >= SIMULTANEOUS_CLIENTS))
+                    {
+                        if(ViewerAdmit() == true)
+                        {
+                            return VIEWER_ACCESS;
+                        }
+                        if(admin_cnt >= SIMULTANEOUS_CLIENTS)
+                        {
+                            return MAX_VIEWER;
+                        }
                     }
-                    
                     if(admin_cnt >= SIMULTANEOUS_CLIENTS)
                     {
                         return MAX_ADMIN;
@@ -523,9 +1060,11 @@ void remove_socket(httpd_req_t *req)
     }
 }
 
-uint32_t make_keyuri_access(uint32_t _access)
+// New key and its URI in memory; the slot files are written by save_keyuri_access.
+static uint8_t assign_keyuri_access(uint32_t _access)
 {
     static uint8_t j;
+    static uint8_t idx;
     time_key = xTaskGetTickCount();
     if(time_key == 0)
     {
@@ -540,32 +1079,62 @@ uint32_t make_keyuri_access(uint32_t _access)
             j = 0;
         }
     }
-    static char build_filename[40];
-    sprintf(build_filename, "/data/key%d.json", uri_idx_int);
-    sprintf(key_str[uri_idx_int], "%lu", time_key);
-    settings_file_json(build_filename, "key", key_str[uri_idx_int], WRITE_SETTING);
-    key_uint32[uri_idx_int] = time_key;
-    
-    itoa(_access, page_access_str[uri_idx_int], 10);
-    sprintf(build_filename, "/data/access%d.json", uri_idx_int);    
-    settings_file_json(build_filename, "access", page_access_str[uri_idx_int], WRITE_SETTING);
-    page_access_number[uri_idx_int] = _access;
+    idx = uri_idx_int;
+    sprintf(key_str[idx], "%lu", time_key);
+    key_uint32[idx] = time_key;
+    itoa(_access, page_access_str[idx], 10);
+    page_access_number[idx] = _access;
     
-    httpd_unregister_uri(server, dynamic_ws_uri[uri_idx_int]);
-    sprintf(dynamic_ws_uri[uri_idx_int], "/ws%s", key_str[uri_idx_int]);  
-    sprintf(build_filename, "/data/uri%d.json", uri_idx_int);
-    settings_file_json(build_filename, "uri", dynamic_ws_uri[uri_idx_int], WRITE_SETTING);
-    httpd_register_uri_handler(server, &ws[uri_idx_int]);
+    httpd_unregister_uri(server, dynamic_ws_uri[idx]);
+    sprintf(dynamic_ws_uri[idx], "/ws%s", key_str[idx]);  
+    httpd_register_uri_handler(server, &ws[idx]);
     uri_idx_int++;
     if(uri_idx_int >= WS_URI_ALLOCATION)
     {
         uri_idx_int = 0;
     }
     sprintf(uri_idx_str, "%d", uri_idx_int);
+    return idx;
+}
+
+static void save_keyuri_access(uint8_t idx)
+{
+    static char build_filename[40];
+    sprintf(build_filename, "/data/key%d.json", idx);
+    settings_file_json(build_filename, "key", key_str[idx], WRITE_SETTING);
+    sprintf(build_filename, "/data/access%d.json", idx);    
+    settings_file_json(build_filename, "access", page_access_str[idx], WRITE_SETTING);
+    sprintf(build_filename, "/data/uri%d.json", idx);
+    settings_file_json(build_filename, "uri", dynamic_ws_uri[idx], WRITE_SETTING);
     settings_file_json("/data/uriidx", "idx", uri_idx_str, WRITE_SETTING);
+}
+
+uint32_t make_keyuri_access(uint32_t _access)
+{
+    save_keyuri_access(assign_keyuri_access(_access));
     return time_key;
 }
 
+// Keys handed out over /wsboot are only needed from flash after a restart, so their
+// files are written from the main loop, one slot per pass, after the welcome is out.
+static void SaveNewKeys(void)
+{
+    static uint8_t i;
+    if(save_new_key == 0)
+    {
+        return;
+    }
+    for(i = 0; i < WS_URI_ALLOCATION; i++)
+    {
+        if((save_new_key & (1UL << i)) != 0)
+        {
+            save_new_key &= ~(1UL << i);
+            save_keyuri_access(i);
+            return;
+        }
+    }
+}
+
 static esp_err_t login_handler(httpd_req_t *req)
 {
     static char filepath[FILE_PATH_MAX];
@@ -574,6 +1143,7 @@ static esp_err_t login_handler(httpd_req_t *req)
     static int ret, remaining;
     static char number[40];
     static char grant_msg[100];
+    static char grant_access[20];
     static char key_resp_json[250];
     static enum_validate_result_t validate_result;
     filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path, req->uri, sizeof(filepath)); 
@@ -598,25 +1168,39 @@ static esp_err_t login_handler(httpd_req_t *req)
             }
             remaining -= ret;
         }   
-        validate_result = validate_credential(buf);
+        validate_result = validate_credential(buf, NULL);
         if(validate_result != BAD_CREDENTIAL)
         {
+            strcpy(grant_access, "");
             if(validate_result == ADMINISTRATOR_ACCESS)
             {
                 sprintf(number, "%lu", make_keyuri_access(validate_result));
                 strcpy(grant_msg, "Administrator");  
+                strcpy(grant_access, "administrator");
             } 
             else if(validate_result == SUPERVISOR_ACCESS)
             {
                 sprintf(number, "%lu", make_keyuri_access(validate_result));
                 strcpy(grant_msg, "Supervisor");  
+                strcpy(grant_access, "supervisor");
 
             }
+            else if(validate_result == VIEWER_ACCESS)
+            {
+                strcpy(number, viewer_key_str);
+                strcpy(grant_msg, "Viewer");
+                strcpy(grant_access, "viewer");
+            }
             else if(validate_result == MAX_ADMIN)
             {
                 strcpy(number, "0");
                 strcpy(grant_msg, "No empty slot available for Supervisor access.");  
             }
+            else if(validate_result == MAX_VIEWER)
+            {
+                strcpy(number, "0");
+                strcpy(grant_msg, "No empty slot available for Supervisor or viewer access.");
+            }
             cJSON *key_json_obj = cJSON_CreateObject();
 
             cJSON *valuejSON = cJSON_CreateString(number);
@@ -625,6 +1209,9 @@ static esp_err_t login_handler(httpd_req_t *req)
             valuejSON = cJSON_CreateString(grant_msg);
             cJSON_AddItemToObject(key_json_obj, "msg", valuejSON);
 
+            valuejSON = cJSON_CreateString(grant_access);
+            cJSON_AddItemToObject(key_json_obj, "access", valuejSON);
+
             char *json_print = cJSON_Print(key_json_obj);
             sprintf(key_resp_json,"%s", json_print);
             cJSON_free(json_print);
@@ -723,38 +1310,82 @@ void GETALL(fpm_wsockets_t *xclient)
 void SetSensorSend(fpm_wsockets_t *xclient, uint8_t direction)
 {
     static uint8_t i;
+    static uint32_t now;
+    static uint32_t slack;
     if((direction == ALL_CLIENT) || (xclient == NULL))
     {
+        now = xTaskGetTickCount();
+        slack = fpm_acquisition_period() / 2;
         for(i = 0; i < MAX_WS_CLIENTS; i++)
         {
             if((fpm_wsockets[i].fd != 0) && (fpm_wsockets[i].ws_startup_init_done == 1))
             {
+                if(fpm_wsockets[i].sub_mode == SUB_NONE)
+                {
+                    ws_stats.sub_skipped++;
+                    continue;
+                }
+                if(WsRateDue(fpm_wsockets[i].rate_interval, &fpm_wsockets[i].rate_timestamp, now, slack) == false)
+                {
+                    ws_stats.rate_skipped++;
+                    continue;
+                }
                 fpm_wsockets[i].send_meter_electrical = true;
             }
         }
+        ViewersMark(VIEWER_SEND_ELECTRICAL);
     }
     else if(direction == OTHER_CLIENT)
     {
         for(i = 0; i < MAX_WS_CLIENTS; i++)
         {
-            if((&fpm_wsockets[i] != xclient) && (fpm_wsockets[i].fd != 0)){fpm_wsockets[i].send_meter_electrical = true;}
+            if((&fpm_wsockets[i] != xclient) && (fpm_wsockets[i].fd != 0) && (fpm_wsockets[i].sub_mode != SUB_NONE)){fpm_wsockets[i].send_meter_electrical = true;}
         }
     }
     else if(direction == THIS_CLIENT){xclient->send_meter_electrical = true;}
 }
 
-void QueClientUIWrMeter(fpm_wsockets_t *xclient, uint8_t direction)
+// One pending bit per interval type; the message buffer is rebuilt at every close, so a
+// client that is still behind simply gets the newest interval.
+void SetAggregateSend(uint8_t type)
 {
-    static char wrmeter_str_admin[100];
-    static char wrmeter_str_svisor[100];
     static uint8_t i;
-    static char access_title[20];
+    for(i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if((fpm_wsockets[i].fd != 0) && (fpm_wsockets[i].ws_startup_init_done == 1))
+        {
+            fpm_wsockets[i].send_meter_aggregate |= (1 << type);
+        }
+    }
+    ViewersMark(VIEWER_SEND_AGGREGATE << type);
+}
 
-    char *json_print;
-    cJSON* wrmeter_json_obj; 
-    cJSON *valuejSON;
-    wrmeter_json_obj = cJSON_CreateObject();
-    strcpy(access_title, "administrator");
+// Only the latest event is kept; a client still sending the previous one gets the new one.
+void SetBurstSend(void)
+{
+    static uint8_t i;
+    for(i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if((fpm_wsockets[i].fd != 0) && (fpm_wsockets[i].ws_startup_init_done == 1))
+        {
+            fpm_wsockets[i].send_meter_burst = true;
+        }
+    }
+    ViewersMark(VIEWER_SEND_BURST);
+}
+
+void QueClientUIWrMeter(fpm_wsockets_t *xclient, uint8_t direction)
+{
+    static char wrmeter_str_admin[100];
+    static char wrmeter_str_svisor[100];
+    static uint8_t i;
+    static char access_title[20];
+
+    char *json_print;
+    cJSON* wrmeter_json_obj; 
+    cJSON *valuejSON;
+    wrmeter_json_obj = cJSON_CreateObject();
+    strcpy(access_title, "administrator");
     valuejSON = cJSON_CreateString(access_title);
     cJSON_AddItemToObject(wrmeter_json_obj, "access", valuejSON);
     strcpy(wrmeter_str_admin, "&console#wrmeter=");
@@ -773,45 +1404,21 @@ void QueClientUIWrMeter(fpm_wsockets_t *xclient, uint8_t direction)
     cJSON_free(json_print);
     cJSON_Delete(wrmeter_json_obj);
 
-    if(direction == ALL_CLIENT)
-    {
-        for(i = 0; i < MAX_WS_CLIENTS; i++)
-        {
-            if(fpm_wsockets[i].fd != 0)
-            {
-                if(fpm_wsockets[i].access == ADMINISTRATOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], wrmeter_str_admin);}
-                else if(fpm_wsockets[i].access == SUPERVISOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], wrmeter_str_svisor);}
-            }
-        }
-    }
-    else if(direction == THIS_CLIENT)
-    {
-        if(xclient->access == ADMINISTRATOR_ACCESS){ClientQueTextMessageOut(xclient, wrmeter_str_admin);}
-        else if(xclient->access == SUPERVISOR_ACCESS){ClientQueTextMessageOut(xclient, wrmeter_str_svisor);}
-    }
-    else if(direction == OTHER_CLIENT)
-    {
-        for(i = 0; i < MAX_WS_CLIENTS; i++)
-        {
-            if((fpm_wsockets[i].fd != 0) && (xclient != &fpm_wsockets[i]))
-            {
-                if(fpm_wsockets[i].access == ADMINISTRATOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], wrmeter_str_admin);}
-                else if(fpm_wsockets[i].access == SUPERVISOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], wrmeter_str_svisor);}
-            }
-        }
-    }
+    WSClientsSetState(xclient, WS_STATE_WRMETER, wrmeter_str_admin, wrmeter_str_svisor, direction);
 }
 
-void QueClientUISetting(fpm_wsockets_t *xclient, uint8_t direction)
+// Body of "&console#setting=": the full set for administrators, the access alone otherwise.
+static cJSON *UISettingJSON(bool admin)
 {
-    static char setting_str_admin[450];
-    static char setting_str_svisor[100];
-    static uint8_t i;
-
-    char *json_print;
     cJSON *valuejSON;
     cJSON* setting_json_obj;
     setting_json_obj = cJSON_CreateObject();
+    if(admin == false)
+    {
+        valuejSON = cJSON_CreateString("supervisor");
+        cJSON_AddItemToObject(setting_json_obj, "access", valuejSON);
+        return setting_json_obj;
+    }
     valuejSON = cJSON_CreateString("administrator");
     cJSON_AddItemToObject(setting_json_obj, "access", valuejSON);
     valuejSON = cJSON_CreateString(username_admin);
@@ -838,53 +1445,34 @@ void QueClientUISetting(fpm_wsockets_t *xclient, uint8_t direction)
     cJSON_AddItemToObject(setting_json_obj, "ethernet_status_msg", valuejSON);
     valuejSON = cJSON_CreateString(ethen);
     cJSON_AddItemToObject(setting_json_obj, "ethen", valuejSON);
+    return setting_json_obj;
+}
+
+void QueClientUISetting(fpm_wsockets_t *xclient, uint8_t direction)
+{
+    static char setting_str_admin[450];
+    static char setting_str_svisor[100];
 
+    char *json_print;
+    cJSON* setting_json_obj;
+    setting_json_obj = UISettingJSON(true);
     strcpy(setting_str_admin, "&console#setting=");
     json_print = cJSON_Print(setting_json_obj);
     strcat(setting_str_admin, json_print);
     cJSON_free(json_print);
     cJSON_Delete(setting_json_obj);
 
-    setting_json_obj = cJSON_CreateObject();
-    valuejSON = cJSON_CreateString("supervisor");
-    cJSON_AddItemToObject(setting_json_obj, "access", valuejSON);
+    setting_json_obj = UISettingJSON(false);
     strcpy(setting_str_svisor, "&console#setting=");
     json_print = cJSON_Print(setting_json_obj);
     strcat(setting_str_svisor, json_print);
     cJSON_free(json_print);
     cJSON_Delete(setting_json_obj);
-    if(direction == ALL_CLIENT)
-    {
-        for(i = 0; i < MAX_WS_CLIENTS; i++)
-        {
-            if(fpm_wsockets[i].fd != 0)
-            {
-                if(fpm_wsockets[i].access == ADMINISTRATOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], setting_str_admin);}
-                else if(fpm_wsockets[i].access == SUPERVISOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], setting_str_svisor);}
-            }
-        }
-    }
-    else if(direction == THIS_CLIENT)
-    {
-        if(xclient->access == ADMINISTRATOR_ACCESS){ClientQueTextMessageOut(xclient, setting_str_admin);}
-        else if(xclient->access == SUPERVISOR_ACCESS){ClientQueTextMessageOut(xclient, setting_str_svisor);}
-    }
-    else if(direction == OTHER_CLIENT)
-    {
-        for(i = 0; i < MAX_WS_CLIENTS; i++)
-        {
-            if((fpm_wsockets[i].fd != 0) && (xclient != &fpm_wsockets[i]))
-            {
-                if(fpm_wsockets[i].access == ADMINISTRATOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], setting_str_admin);}
-                else if(fpm_wsockets[i].access == SUPERVISOR_ACCESS){ClientQueTextMessageOut(&fpm_wsockets[i], setting_str_svisor);}
-            }
-        }
-    }
+    WSClientsSetState(xclient, WS_STATE_SETTING, setting_str_admin, setting_str_svisor, direction);
 }
 
-void QueClientUIInfor(fpm_wsockets_t *xclient, uint8_t direction)
+static cJSON *UIInforJSON(void)
 {
-    static char infor_str[350];
     cJSON *valuejSON;
     cJSON* infor_json_obj;
 
@@ -916,11 +1504,19 @@ void QueClientUIInfor(fpm_wsockets_t *xclient, uint8_t direction)
     cJSON_AddItemToObject(infor_json_obj, "ethsub", valuejSON);
     valuejSON = cJSON_CreateString(serial);
     cJSON_AddItemToObject(infor_json_obj, "serial", valuejSON);
+    return infor_json_obj;
+}
 
+void QueClientUIInfor(fpm_wsockets_t *xclient, uint8_t direction)
+{
+    static char infor_str[350];
+    cJSON* infor_json_obj;
+
+    infor_json_obj = UIInforJSON();
     strcpy(infor_str, "&console#infor=");
     char *json_print = cJSON_Print(infor_json_obj);
     strcat(infor_str, json_print);
-    WSClientsQueText(xclient, infor_str, direction);
+    WSClientsSetState(xclient, WS_STATE_INFOR, infor_str, infor_str, direction);
     cJSON_free(json_print);
     cJSON_Delete(infor_json_obj);
 }
@@ -971,6 +1567,16 @@ void REFRESHCONNECTION(fpm_wsockets_t *xclient)
 void clear_new_ws_client(fpm_wsockets_t *fpm_wsocket)
 {
     static uint8_t i;
+    ClientReleaseQue(fpm_wsocket->textmessage_in, WS_CLIENT_TXTMSG_BFFR_CNT, fpm_wsocket->textmessage_in_idx_read, fpm_wsocket->textmessage_in_idx_write);
+    ClientReleaseQue(fpm_wsocket->textmessage_out, WS_CLIENT_TXTMSG_BFFR_CNT, fpm_wsocket->textmessage_out_idx_read, fpm_wsocket->textmessage_out_idx_write);
+    ClientReleaseQue(fpm_wsocket->textmessage_out_priority, WS_CLIENT_PRIORITY_CNT, fpm_wsocket->textmessage_out_priority_idx_read, fpm_wsocket->textmessage_out_priority_idx_write);
+    ClientReleaseState(fpm_wsocket);
+    ClientReleaseReplay(fpm_wsocket);
+    fpm_wsocket->parked = false;
+    fpm_wsocket->resume_attached = false;
+    fpm_wsocket->batch = false;
+    fpm_wsocket->boot_admitted = false;
+    fpm_wsocket->boot_key_idx = 0;
     fpm_wsocket->fd = 0;
     fpm_wsocket->handle =NULL;
     for(i = 0; i < APP_ASSOC_SOCKET_ALLOCATION; i++)
@@ -984,14 +1590,22 @@ void clear_new_ws_client(fpm_wsockets_t *fpm_wsocket)
     fpm_wsocket->textmessage_in_time_stamp = fpm_wsocket->textmessage_out_time_stamp = xTaskGetTickCount();
     ClientResetQueTextMessageIn(fpm_wsocket);
     ClientResetQueTextMessageOut(fpm_wsocket);
-    fpm_wsocket->textmessage_out_priority = NULL;
+    fpm_wsocket->textmessage_out_priority_idx_write = 0;
+    fpm_wsocket->textmessage_out_priority_idx_read = 0;
+    fpm_wsocket->priority_run = 0;
     fpm_wsocket->ws_startup_init_done = 0;
-    fpm_wsocket->expecting_response = false;
+    fpm_wsocket->textmessage_out_acked = 0;
     fpm_wsocket->rdmeter_confirm_get = 0;
     fpm_wsocket->setting_confirm_get = 0;
     fpm_wsocket->infor_confirm_get = 0;
     fpm_wsocket->send_meter_infoconfig = false;
     fpm_wsocket->send_meter_electrical = false;
+    fpm_wsocket->send_meter_aggregate = 0;
+    fpm_wsocket->send_meter_burst = false;
+    fpm_wsocket->sub_mode = SUB_ALL;
+    fpm_wsocket->rate_interval = CONFIG_FPM_WS_RATE_MIN;
+    fpm_wsocket->rate_timestamp = 0;
+    fpm_wsocket->alarm_seq = 0;
     fpm_wsocket->pending_close = false;
     fpm_wsocket->textmessage_in_idx_write = 0;
     fpm_wsocket->textmessage_in_idx_read = 0;
@@ -1001,6 +1615,93 @@ void clear_new_ws_client(fpm_wsockets_t *fpm_wsocket)
     fpm_wsocket->time_persistent_timestamp = xTaskGetTickCount();
 }
 
+// A reattached session that does not resume starts over like a new connection on the
+// same socket.
+static void ClientSessionRestart(fpm_wsockets_t *xclient)
+{
+    static httpd_handle_t *handle;
+    static int assoc_fd[APP_ASSOC_SOCKET_ALLOCATION];
+    static uint64_t entry;
+    static int fd;
+    fd = xclient->fd;
+    handle = xclient->handle;
+    entry = xclient->entry_number;
+    memcpy(assoc_fd, xclient->assoc_fd, sizeof(assoc_fd));
+    clear_new_ws_client(xclient);
+    xclient->handle = handle;
+    xclient->entry_number = entry;
+    memcpy(xclient->assoc_fd, assoc_fd, sizeof(assoc_fd));
+    xclient->fd = fd;
+    ws_stats.resume_refused++;
+}
+
+// "&console#resume=<next count ID the UI expects>" on a reattached session. What the
+// UI never got is put back at the front of the control lane under the same count IDs,
+// preceded by "&console#resumed"; meter buffers in the gap are marked to go out again
+// with their newest content. false when the gap is not within the window or there is
+// no room, the caller then starts the session over.
+static bool ClientResume(fpm_wsockets_t *xclient, unsigned long expected)
+{
+    static fpm_msg_t *replay[WS_SEND_WINDOW + 1];
+    static uint8_t refresh;
+    static uint8_t count;
+    static uint8_t used;
+    static uint8_t slot;
+    static unsigned long cntid;
+    if((expected - xclient->textmessage_out_acked) > (xclient->textmessage_out_cntid - xclient->textmessage_out_acked))
+    {
+        return false;
+    }
+    used = (xclient->textmessage_out_priority_idx_write + WS_CLIENT_PRIORITY_CNT - xclient->textmessage_out_priority_idx_read) % WS_CLIENT_PRIORITY_CNT;
+    replay[0] = fpm_msgpool_alloc("&console#resumed");
+    if(replay[0] == NULL)
+    {
+        return false;
+    }
+    count = 1;
+    refresh = 0;
+    for(cntid = expected; cntid != xclient->textmessage_out_cntid; cntid++)
+    {
+        slot = (uint8_t)(cntid % WS_SEND_WINDOW);
+        refresh |= xclient->replay_refresh[slot];
+        if(xclient->replay[slot] != NULL)
+        {
+            fpm_msgpool_ref(xclient->replay[slot]);
+            replay[count++] = xclient->replay[slot];
+        }
+    }
+    if(used + count >= WS_CLIENT_PRIORITY_CNT)
+    {
+        while(count > 0)
+        {
+            fpm_msgpool_release(replay[--count]);
+        }
+        return false;
+    }
+    ws_stats.replayed += count - 1;
+    while(count > 0)
+    {
+        xclient->textmessage_out_priority_idx_read = (xclient->textmessage_out_priority_idx_read == 0) ? (WS_CLIENT_PRIORITY_CNT - 1) : (xclient->textmessage_out_priority_idx_read - 1);
+        xclient->textmessage_out_priority[xclient->textmessage_out_priority_idx_read] = replay[--count];
+    }
+    ClientReleaseReplay(xclient);
+    xclient->textmessage_out_cntid = xclient->textmessage_out_acked = expected;
+    xclient->priority_run = 0;
+    xclient->send_meter_electrical |= ((refresh & REPLAY_ELECTRICAL) != 0) || (xclient->sub_mode != SUB_NONE);
+    xclient->send_meter_infoconfig |= ((refresh & REPLAY_INFOCONFIG) != 0);
+    xclient->send_meter_burst |= ((refresh & REPLAY_BURST) != 0);
+    xclient->send_meter_aggregate |= (refresh / REPLAY_AGGREGATE);
+    xclient->time_persistent_timestamp = xTaskGetTickCount() - ONESECOND_TIME_PERSISTENT_PERIOD;
+    if(xclient->parked_state_gen != ws_state_gen)
+    {
+        QueClientUIWrMeter(xclient, THIS_CLIENT);
+        QueClientUISetting(xclient, THIS_CLIENT);
+        QueClientUIInfor(xclient, THIS_CLIENT);
+    }
+    ws_stats.resumed++;
+    return true;
+}
+
 int get_prior_fd(fpm_wsockets_t* curr_client)
 {
     static uint8_t i;
@@ -1022,24 +1723,62 @@ int get_prior_fd(fpm_wsockets_t* curr_client)
 void register_new_ws(httpd_req_t *req)
 {
     static uint8_t i, j, k, in_fd_cnt;
+    static uint32_t key;
+    static fpm_wsockets_t *xclient;
     size_t clients = APP_ASSOC_SOCKET_ALLOCATION;
     int client_fds[APP_ASSOC_SOCKET_ALLOCATION];
     static int fd;
     static uint8_t new_ws_register_slot;
+    static bool supervisor;
     fd = httpd_req_to_sockfd(req);
+    ViewersCloseFd(fd);
 
+    // the key is in the URI: a session parked under it takes the socket back as it is
+    key = (uint32_t)strtoul(&req->uri[3], NULL, 10);
     new_ws_register_slot = MAX_WS_CLIENTS;
     for(i = 0; i < MAX_WS_CLIENTS; i++)
     {
-        if(fpm_wsockets[i].fd == 0)
+        if((fpm_wsockets[i].fd == 0) && (fpm_wsockets[i].parked == true) && (fpm_wsockets[i].key == key) && (fpm_key_valid(key) == true))
         {
             new_ws_register_slot = i;
             break;
         }
     }
-    if(new_ws_register_slot < MAX_WS_CLIENTS)
+    // free slots before parked ones
+    for(i = 0; (i < MAX_WS_CLIENTS) && (new_ws_register_slot == MAX_WS_CLIENTS); i++)
+    {
+        if((fpm_wsockets[i].fd == 0) && (fpm_wsockets[i].parked == false))
+        {
+            new_ws_register_slot = i;
+        }
+    }
+    for(i = 0; (i < MAX_WS_CLIENTS) && (new_ws_register_slot == MAX_WS_CLIENTS); i++)
+    {
+        if(fpm_wsockets[i].fd == 0)
+        {
+            new_ws_register_slot = i;
+        }
+    }
+    if((new_ws_register_slot < MAX_WS_CLIENTS) && (fpm_wsockets[new_ws_register_slot].parked == true) && (fpm_wsockets[new_ws_register_slot].key == key))
+    {
+        xclient = &fpm_wsockets[new_ws_register_slot];
+        ClientReleaseQue(xclient->textmessage_in, WS_CLIENT_TXTMSG_BFFR_CNT, xclient->textmessage_in_idx_read, xclient->textmessage_in_idx_write);
+        xclient->textmessage_in_idx_write = xclient->textmessage_in_idx_read;
+        xclient->textmessage_in_time_stamp = xclient->textmessage_out_time_stamp = xTaskGetTickCount();
+        for(j = 0; j < APP_ASSOC_SOCKET_ALLOCATION; j++)
+        {
+            xclient->assoc_fd[j] = 0;
+        }
+        xclient->parked = false;
+        xclient->resume_attached = true;
+        ESP_LOGI(TAG,"Parked session reattached");
+    }
+    else if(new_ws_register_slot < MAX_WS_CLIENTS)
     {
         clear_new_ws_client(&fpm_wsockets[new_ws_register_slot]);
+    }
+    if(new_ws_register_slot < MAX_WS_CLIENTS)
+    {
         fpm_wsockets[new_ws_register_slot].fd = fd;
         fpm_wsockets[new_ws_register_slot].handle = req->handle;
         fpm_wsockets[new_ws_register_slot].entry_number = entry_number;
@@ -1075,7 +1814,17 @@ void register_new_ws(httpd_req_t *req)
             in_fd_cnt++;
         }
     }
-    if(in_fd_cnt >= MAX_WS_CLIENTS)
+    // a supervisor key is only let in past the sessions when no viewer could be
+    // admitted instead; otherwise it takes the spare slot and nobody is pushed out
+    supervisor = false;
+    for(i = 0; i < WS_URI_ALLOCATION; i++)
+    {
+        if((key != 0) && (key == key_uint32[i]) && (page_access_number[i] == SUPERVISOR_ACCESS))
+        {
+            supervisor = true;
+        }
+    }
+    if((in_fd_cnt >= MAX_WS_CLIENTS) && ((supervisor == false) || (ViewerRoom() == false)))
     {
         if(replace_fd == 0)
         {
@@ -1093,6 +1842,14 @@ void remove_websocket(int fd)
         {
             httpd_sess_trigger_close(server, fd);
             ESP_LOGI(TAG,"Remove websocket fd = %d\r\n", fpm_wsockets[i].fd);
+            // a started session is kept for WS_PARK_TIMEOUT so a reconnect can resume it
+            if((fpm_wsockets[i].ws_startup_init_done == 1) && (fpm_wsockets[i].auth_status == AUTHENTICATED_TRUE) && (fd != replace_fd))
+            {
+                fpm_wsockets[i].parked = true;
+                fpm_wsockets[i].parked_timestamp = xTaskGetTickCount();
+                fpm_wsockets[i].parked_state_gen = ws_state_gen;
+                ws_stats.parked++;
+            }
             fpm_wsockets[i].fd = 0;
             k = 0;
             for(j = 0; j < APP_ASSOC_SOCKET_ALLOCATION; j++)
@@ -1123,11 +1880,72 @@ fpm_wsockets_t *get_ws_client_from_sock_descriptor(int id)
     return NULL;
 }
 
+// A /wsboot socket holds no session slot and can push nobody out until its hello has
+// passed the credential check, here in the httpd task like POST /login. The key and its
+// URI handler are assigned here too, so the URI table is only ever changed on the httpd
+// task; the main loop just writes the key files. Refusals and the viewer redirect are
+// answered on the socket directly.
+static void BootAdmit(httpd_req_t *req, char *payload)
+{
+    static enum_validate_result_t validate_result;
+    static httpd_ws_frame_t frame;
+    static char json_str[200];
+    static char welcome_str[150];
+    static fpm_wsockets_t *xclient;
+    static char *end;
+    if(strncmp(payload, "&console#hello=", 15) != 0)
+    {
+        return;
+    }
+    ws_stats.boots++;
+    strncpy(json_str, &payload[15], sizeof(json_str) - 1);
+    json_str[sizeof(json_str) - 1] = 0;
+    end = strchr(json_str, '*');
+    if(end != NULL)
+    {
+        *end = 0;
+    }
+    validate_result = validate_credential(json_str, NULL);
+    if((validate_result == ADMINISTRATOR_ACCESS) || (validate_result == SUPERVISOR_ACCESS))
+    {
+        register_new_ws(req);
+        xclient = get_ws_client_from_sock_descriptor(httpd_req_to_sockfd(req));
+        if(xclient != NULL)
+        {
+            xclient->access = validate_result;
+            xclient->boot_key_idx = assign_keyuri_access(validate_result);
+            xclient->boot_admitted = true;
+        }
+        return;
+    }
+    if(validate_result == VIEWER_ACCESS)
+    {
+        sprintf(welcome_str, "&console#welcome={\"key\":\"%s\",\"access\":\"viewer\",\"msg\":\"Viewer\"}", viewer_key_str);
+    }
+    else
+    {
+        ws_stats.boot_refused++;
+        sprintf(welcome_str, "&console#welcome={\"key\":\"0\",\"msg\":\"%s\"}",
+                (validate_result == MAX_ADMIN) ? "No empty slot available for Supervisor access." :
+                (validate_result == MAX_VIEWER) ? "No empty slot available for Supervisor or viewer access." : "Username/Password error.");
+    }
+    memset(&frame, 0, sizeof(httpd_ws_frame_t));
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = (uint8_t*)welcome_str;
+    frame.len = strlen(welcome_str);
+    httpd_ws_send_frame(req, &frame);
+}
+
 esp_err_t ws_handler(httpd_req_t *req)
 {
    static int fd;
     if (req->method == HTTP_GET)
     {
+        if(req->user_ctx == uri_wsboot)
+        {
+            ViewersCloseFd(httpd_req_to_sockfd(req));
+            return ESP_OK;
+        }
         register_new_ws(req);
         ESP_LOGI(TAG, "Handshake done, the new connection was opened");
         return ESP_OK;
@@ -1167,6 +1985,11 @@ esp_err_t ws_handler(httpd_req_t *req)
     {
         if (ws_pkt.type == HTTPD_WS_TYPE_TEXT)
         {
+            if((get_ws_client_from_sock_descriptor(fd) == NULL) && (req->user_ctx == uri_wsboot))
+            {
+                BootAdmit(req, (char*)ws_pkt.payload);
+            }
+            ClientAckReceived(get_ws_client_from_sock_descriptor(fd), (char*)ws_pkt.payload);
             ClientQueTextMessageIn(get_ws_client_from_sock_descriptor(fd), (char*)ws_pkt.payload);
             free(buf);
             return ESP_OK;
@@ -1178,7 +2001,6 @@ esp_err_t ws_handler(httpd_req_t *req)
                 ESP_LOGI(TAG, "Got a WS PING frame, Replying PONG");
                 ws_pkt.type = HTTPD_WS_TYPE_PONG;
                 ret = httpd_ws_send_frame(req, &ws_pkt);
-                get_ws_client_from_sock_descriptor(fd)->expecting_response = false;
                 if (ret != ESP_OK)
                 {
                     ESP_LOGI(TAG, "httpd_ws_send_frame failed with %d", ret);
@@ -1198,8 +2020,195 @@ esp_err_t ws_handler(httpd_req_t *req)
     return ESP_OK;
 }
 
+// Handshake: the viewer is allocated here, within the runtime limit and heap reserve;
+// a refused one is told "#close" like a session that was replaced.
+esp_err_t viewer_ws_handler(httpd_req_t *req)
+{
+    static httpd_ws_frame_t ws_pkt;
+    static fpm_viewer_t *viewer;
+    static int fd;
+    uint8_t *buf = NULL;
+    fd = httpd_req_to_sockfd(req);
+    if(req->method == HTTP_GET)
+    {
+        ViewersCloseFd(fd);
+        viewer = NULL;
+        if(ViewerAdmit() == true)
+        {
+            viewer = calloc(1, sizeof(fpm_viewer_t));
+            viewer_stats.refused_heap += (viewer == NULL) ? 1 : 0;
+        }
+        if(viewer == NULL)
+        {
+            memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+            ws_pkt.type = HTTPD_WS_TYPE_TEXT;
+            ws_pkt.payload = (uint8_t*)"&console#close";
+            ws_pkt.len = strlen((char*)ws_pkt.payload);
+            httpd_ws_send_frame(req, &ws_pkt);
+            ESP_LOGI(TAG, "Viewer refused, fd = %d", fd);
+            return ESP_FAIL;
+        }
+        viewer->fd = fd;
+        viewer->in_time_stamp = viewer->persistent_timestamp = xTaskGetTickCount();
+        portENTER_CRITICAL(&viewer_mux);
+        viewer->next = fpm_viewers;
+        fpm_viewers = viewer;
+        viewer_stats.active++;
+        if(viewer_stats.active > viewer_stats.peak)
+        {
+            viewer_stats.peak = viewer_stats.active;
+        }
+        portEXIT_CRITICAL(&viewer_mux);
+        viewer_stats.admitted++;
+        ESP_LOGI(TAG, "Register viewer fd = %d, %u viewers", fd, viewer_stats.active);
+        return ESP_OK;
+    }
+    memset(&ws_pkt, 0, sizeof(httpd_ws_frame_t));
+    esp_err_t ret = httpd_ws_recv_frame(req, &ws_pkt, 0);
+    if(ret != ESP_OK)
+    {
+        ViewersCloseFd(fd);
+        return ret;
+    }
+    if(ws_pkt.len)
+    {
+        buf = calloc(1, ws_pkt.len + 1);
+        if(buf == NULL)
+        {
+            ViewersCloseFd(fd);
+            return ESP_ERR_NO_MEM;
+        }
+        ws_pkt.payload = buf;
+        ret = httpd_ws_recv_frame(req, &ws_pkt, ws_pkt.len);
+        if(ret != ESP_OK)
+        {
+            free(buf);
+            ViewersCloseFd(fd);
+            return ret;
+        }
+    }
+    if(ws_pkt.type == HTTPD_WS_TYPE_TEXT)
+    {
+        ViewerFrameReceived(fd, (char*)ws_pkt.payload);
+    }
+    else if(ws_pkt.type == HTTPD_WS_TYPE_PING)
+    {
+        ws_pkt.type = HTTPD_WS_TYPE_PONG;
+        ret = httpd_ws_send_frame(req, &ws_pkt);
+    }
+    else if(ws_pkt.type == HTTPD_WS_TYPE_CLOSE)
+    {
+        ViewersCloseFd(fd);
+    }
+    free(buf);
+    return ret;
+}
+
+static char *ws_stats_json(void)
+{
+    static uint8_t i;
+    cJSON *stats_json_obj = cJSON_CreateObject();
+    cJSON *inflight_array = cJSON_CreateArray();
+    cJSON_AddItemToObject(stats_json_obj, "window", cJSON_CreateNumber(WS_SEND_WINDOW));
+    cJSON_AddItemToObject(stats_json_obj, "sent", cJSON_CreateNumber(ws_stats.sent));
+    cJSON_AddItemToObject(stats_json_obj, "acks", cJSON_CreateNumber(ws_stats.acks));
+    cJSON_AddItemToObject(stats_json_obj, "legacyacks", cJSON_CreateNumber(ws_stats.legacy_acks));
+    cJSON_AddItemToObject(stats_json_obj, "windowfull", cJSON_CreateNumber(ws_stats.window_full));
+    cJSON_AddItemToObject(stats_json_obj, "notwritable", cJSON_CreateNumber(ws_stats.not_writable));
+    cJSON_AddItemToObject(stats_json_obj, "conflated", cJSON_CreateNumber(ws_stats.conflated));
+    cJSON_AddItemToObject(stats_json_obj, "controlsent", cJSON_CreateNumber(ws_stats.control_sent));
+    cJSON_AddItemToObject(stats_json_obj, "bulkturns", cJSON_CreateNumber(ws_stats.bulk_turns));
+    cJSON_AddItemToObject(stats_json_obj, "subfull", cJSON_CreateNumber(ws_stats.sub_full));
+    cJSON_AddItemToObject(stats_json_obj, "subpartial", cJSON_CreateNumber(ws_stats.sub_partial));
+    cJSON_AddItemToObject(stats_json_obj, "subskipped", cJSON_CreateNumber(ws_stats.sub_skipped));
+    cJSON_AddItemToObject(stats_json_obj, "subsaved", cJSON_CreateNumber(ws_stats.sub_saved));
+    cJSON_AddItemToObject(stats_json_obj, "rateskipped", cJSON_CreateNumber(ws_stats.rate_skipped));
+    cJSON_AddItemToObject(stats_json_obj, "ratemin", cJSON_CreateNumber(CONFIG_FPM_WS_RATE_MIN));
+    cJSON_AddItemToObject(stats_json_obj, "parked", cJSON_CreateNumber(ws_stats.parked));
+    cJSON_AddItemToObject(stats_json_obj, "resumed", cJSON_CreateNumber(ws_stats.resumed));
+    cJSON_AddItemToObject(stats_json_obj, "resumerefused", cJSON_CreateNumber(ws_stats.resume_refused));
+    cJSON_AddItemToObject(stats_json_obj, "replayed", cJSON_CreateNumber(ws_stats.replayed));
+    cJSON_AddItemToObject(stats_json_obj, "batches", cJSON_CreateNumber(ws_stats.batches));
+    cJSON_AddItemToObject(stats_json_obj, "batched", cJSON_CreateNumber(ws_stats.batched));
+    cJSON_AddItemToObject(stats_json_obj, "boots", cJSON_CreateNumber(ws_stats.boots));
+    cJSON_AddItemToObject(stats_json_obj, "bootrefused", cJSON_CreateNumber(ws_stats.boot_refused));
+    cJSON_AddItemToObject(stats_json_obj, "ttfrlogin", cJSON_CreateNumber(ws_stats.ttfr_login));
+    cJSON_AddItemToObject(stats_json_obj, "ttfrboot", cJSON_CreateNumber(ws_stats.ttfr_boot));
+    cJSON_AddItemToObject(stats_json_obj, "inflightmax", cJSON_CreateNumber(ws_stats.inflight_max));
+    for(i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if(fpm_wsockets[i].fd != 0)
+        {
+            cJSON_AddItemToArray(inflight_array, cJSON_CreateNumber(ClientInFlight(&fpm_wsockets[i])));
+        }
+    }
+    cJSON_AddItemToObject(stats_json_obj, "inflight", inflight_array);
+    cJSON *viewer_json_obj = cJSON_CreateObject();
+    cJSON_AddItemToObject(viewer_json_obj, "active", cJSON_CreateNumber(viewer_stats.active));
+    cJSON_AddItemToObject(viewer_json_obj, "limit", cJSON_CreateNumber(viewer_limit));
+    cJSON_AddItemToObject(viewer_json_obj, "peak", cJSON_CreateNumber(viewer_stats.peak));
+    cJSON_AddItemToObject(viewer_json_obj, "admitted", cJSON_CreateNumber(viewer_stats.admitted));
+    cJSON_AddItemToObject(viewer_json_obj, "refusedlimit", cJSON_CreateNumber(viewer_stats.refused_limit));
+    cJSON_AddItemToObject(viewer_json_obj, "refusedheap", cJSON_CreateNumber(viewer_stats.refused_heap));
+    cJSON_AddItemToObject(viewer_json_obj, "dropped", cJSON_CreateNumber(viewer_stats.dropped));
+    cJSON_AddItemToObject(viewer_json_obj, "sent", cJSON_CreateNumber(viewer_stats.sent));
+    cJSON_AddItemToObject(viewer_json_obj, "heaphold", cJSON_CreateNumber(viewer_stats.heap_hold));
+    cJSON_AddItemToObject(viewer_json_obj, "bytes", cJSON_CreateNumber(viewer_stats.active * sizeof(fpm_viewer_t)));
+    cJSON_AddItemToObject(viewer_json_obj, "heapfree", cJSON_CreateNumber(esp_get_free_heap_size()));
+    cJSON_AddItemToObject(stats_json_obj, "viewers", viewer_json_obj);
+    char *json_print = cJSON_PrintUnformatted(stats_json_obj);
+    cJSON_Delete(stats_json_obj);
+    return json_print;
+}
+
+static char *custommsg_stats_json(const char *name)
+{
+    if(strcmp(name, "busstats") == 0)
+    {
+        return fpm_arbiter_stats_json();
+    }
+    else if(strcmp(name, "acqstats") == 0)
+    {
+        return fpm_acquisition_stats_json();
+    }
+    else if(strcmp(name, "histstats") == 0)
+    {
+        return fpm_history_stats_json();
+    }
+    else if(strcmp(name, "trendstats") == 0)
+    {
+        return fpm_trend_stats_json();
+    }
+    else if(strcmp(name, "aggrstats") == 0)
+    {
+        return fpm_aggregate_stats_json();
+    }
+    else if(strcmp(name, "energystats") == 0)
+    {
+        return fpm_energy_stats_json();
+    }
+    else if(strcmp(name, "alarmstats") == 0)
+    {
+        return fpm_alarm_stats_json();
+    }
+    else if(strcmp(name, "burststats") == 0)
+    {
+        return fpm_burst_stats_json();
+    }
+    else if(strcmp(name, "wsstats") == 0)
+    {
+        return ws_stats_json();
+    }
+    else if(strcmp(name, "poolstats") == 0)
+    {
+        return fpm_msgpool_stats_json();
+    }
+    return NULL;
+}
+
 static esp_err_t custommsg_handler(httpd_req_t *req)
 {
+    static char *json_print;
     static char filepath[FILE_PATH_MAX];
     static const char *filename;
     static char buf[100];
@@ -1273,6 +2282,20 @@ static esp_err_t custommsg_handler(httpd_req_t *req)
                     httpd_resp_send_chunk(req, NULL, 0);
                     return ESP_OK;
                 }
+                else if((json_print = custommsg_stats_json(valuejSON->valuestring)) != NULL)
+                {
+                    if(httpd_resp_send_chunk(req, json_print, strlen(json_print)) != ESP_OK)
+                    {
+                        cJSON_free(json_print);
+                        ESP_LOGI(TAG, "Sending response failed!");
+                        httpd_resp_sendstr_chunk(req, NULL);
+                        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Failed to send response");
+                        return ESP_FAIL;
+                    }
+                    cJSON_free(json_print);
+                    httpd_resp_send_chunk(req, NULL, 0);
+                    return ESP_OK;
+                }
             }
         }
     }
@@ -1280,15 +2303,382 @@ static esp_err_t custommsg_handler(httpd_req_t *req)
     return ESP_FAIL;
 }
 
-static esp_err_t bootupdate_handler(httpd_req_t *req)
+bool fpm_key_valid(uint32_t key)
 {
-    char filepath[FILE_PATH_MAX];
-    static ota_return_t ota_return;
-    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
-                                             req->uri + sizeof("/bootupdate") - 1, sizeof(filepath));
-    if (!filename)
+    static uint8_t i;
+    if(key == 0)
     {
-        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
+        return false;
+    }
+    for(i = 0; i < WS_URI_ALLOCATION; i++)
+    {
+        if(key == key_uint32[i])
+        {
+            return true;
+        }
+    }
+    return (key == viewer_key);
+}
+
+static esp_err_t trend_handler(httpd_req_t *req)
+{
+    static char query[40];
+    static char key_query[20];
+    static uint8_t trend_chunk[TREND_CHUNK_RECORDS * sizeof(fpm_trend_record_t)];
+    static fpm_trend_iter_t it;
+    static fpm_trend_record_t record;
+    static uint16_t chunk_len;
+    if((httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK)
+    || (httpd_query_key_value(query, "key", key_query, sizeof(key_query)) != ESP_OK)
+    || (fpm_key_valid((uint32_t)strtoul(key_query, NULL, 10)) == false))
+    {
+        httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authorized");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/octet-stream");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    chunk_len = fpm_trend_header(trend_chunk, (uint16_t)fpm_trend_open(&it));
+    while(fpm_trend_next(&it, &record) == true)
+    {
+        memcpy(&trend_chunk[chunk_len], &record, sizeof(record));
+        chunk_len += sizeof(record);
+        if(chunk_len + sizeof(record) > sizeof(trend_chunk))
+        {
+            if(httpd_resp_send_chunk(req, (char*)trend_chunk, chunk_len) != ESP_OK)
+            {
+                ESP_LOGI(TAG, "Trend send failed!");
+                httpd_resp_sendstr_chunk(req, NULL);
+                return ESP_FAIL;
+            }
+            chunk_len = 0;
+        }
+    }
+    if(chunk_len != 0)
+    {
+        httpd_resp_send_chunk(req, (char*)trend_chunk, chunk_len);
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+static uint16_t history_csv_line(char *dst, const fpm_history_record_t *record)
+{
+    static struct tm timeinfo;
+    static time_t record_time;
+    static uint16_t len;
+    static uint16_t scale;
+    static uint8_t i;
+    record_time = (time_t)record->time_sec;
+    gmtime_r(&record_time, &timeinfo);
+    len = strftime(dst, 24, "%Y-%m-%dT%H:%M:%SZ", &timeinfo);
+    len += sprintf(&dst[len], ",%u,%04X", record->samples, record->quality_mask);
+    for(i = 0; i < TREND_CHANNEL_COUNT; i++)
+    {
+        if(record->value[i] == INT16_MIN)
+        {
+            dst[len++] = ',';
+            continue;
+        }
+        scale = fpm_trend_channel_scale(i);
+        len += sprintf(&dst[len], ",%s%d.%0*d", (record->value[i] < 0) ? "-" : "", abs(record->value[i]) / scale, (scale >= 1000) ? 3 : ((scale >= 100) ? 2 : 1), abs(record->value[i]) % scale);
+    }
+    dst[len++] = '\r';
+    dst[len++] = '\n';
+    return len;
+}
+
+// GET /history?key=&from=&to=&type=1m|15m&fmt=csv|bin, from/to in UTC epoch seconds.
+// Records are pulled one at a time from the mapped history partition into a fixed
+// chunk buffer, so memory use does not depend on the range requested.
+static esp_err_t history_handler(httpd_req_t *req)
+{
+    static char query[120];
+    static char param[24];
+    static char history_chunk[HISTORY_CHUNK_SIZE];
+    static fpm_history_iter_t it;
+    static fpm_history_record_t record;
+    static uint32_t from_time;
+    static uint32_t to_time;
+    static uint8_t type;
+    static bool binary;
+    static uint16_t chunk_len;
+    static uint8_t i;
+    if((httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK)
+    || (httpd_query_key_value(query, "key", param, sizeof(param)) != ESP_OK)
+    || (fpm_key_valid((uint32_t)strtoul(param, NULL, 10)) == false))
+    {
+        httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authorized");
+        return ESP_FAIL;
+    }
+    from_time = (httpd_query_key_value(query, "from", param, sizeof(param)) == ESP_OK) ? (uint32_t)strtoul(param, NULL, 10) : 0;
+    to_time = (httpd_query_key_value(query, "to", param, sizeof(param)) == ESP_OK) ? (uint32_t)strtoul(param, NULL, 10) : UINT32_MAX;
+    type = ((httpd_query_key_value(query, "type", param, sizeof(param)) == ESP_OK) && (strcmp(param, "1m") == 0)) ? HISTORY_RECORD_1MIN : HISTORY_RECORD_15MIN;
+    binary = (httpd_query_key_value(query, "fmt", param, sizeof(param)) == ESP_OK) && (strcmp(param, "bin") == 0);
+    if(fpm_history_seek(&it, from_time, to_time, type) == false)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No history");
+        return ESP_FAIL;
+    }
+    chunk_len = 0;
+    if(binary == true)
+    {
+        httpd_resp_set_type(req, "application/octet-stream");
+        httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=history.bin");
+        memcpy(history_chunk, "FPMH", 4);
+        chunk_len = 4;
+        history_chunk[chunk_len++] = HISTORY_BLOB_VERSION;
+        history_chunk[chunk_len++] = TREND_CHANNEL_COUNT;
+        history_chunk[chunk_len++] = (char)(sizeof(fpm_history_record_t) & 0xFF);
+        history_chunk[chunk_len++] = (char)(sizeof(fpm_history_record_t) >> 8);
+        chunk_len += fpm_trend_channel_desc((uint8_t*)&history_chunk[chunk_len]);
+    }
+    else
+    {
+        httpd_resp_set_type(req, "text/csv");
+        httpd_resp_set_hdr(req, "Content-Disposition", "attachment; filename=history.csv");
+        chunk_len = sprintf(history_chunk, "time,samples,quality");
+        for(i = 0; i < TREND_CHANNEL_COUNT; i++)
+        {
+            chunk_len += sprintf(&history_chunk[chunk_len], ",%s", fpm_trend_channel_name(i));
+        }
+        history_chunk[chunk_len++] = '\r';
+        history_chunk[chunk_len++] = '\n';
+    }
+    while(fpm_history_next(&it, &record) == true)
+    {
+        if(binary == true)
+        {
+            memcpy(&history_chunk[chunk_len], &record, sizeof(record));
+            chunk_len += sizeof(record);
+        }
+        else
+        {
+            chunk_len += history_csv_line(&history_chunk[chunk_len], &record);
+        }
+        // a CSV line is at most 20 + 13 + 12 * 9 characters
+        if(chunk_len > HISTORY_CHUNK_SIZE - 160)
+        {
+            if(httpd_resp_send_chunk(req, history_chunk, chunk_len) != ESP_OK)
+            {
+                ESP_LOGI(TAG, "History send failed!");
+                httpd_resp_sendstr_chunk(req, NULL);
+                return ESP_FAIL;
+            }
+            chunk_len = 0;
+        }
+    }
+    if(chunk_len != 0)
+    {
+        httpd_resp_send_chunk(req, history_chunk, chunk_len);
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+static bool historyq_flush(fpm_historyq_ctx_t *ctx)
+{
+    if(httpd_resp_send_chunk(ctx->req, ctx->chunk, ctx->len) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "History query send failed!");
+        return false;
+    }
+    ctx->len = 0;
+    return true;
+}
+
+// Points are [time_ms,value] for lttb and [time_ms,min,avg,max,count] for minmax,
+// values in the channel's scaled integer units.
+static bool historyq_emit(void *ctx_ptr, const fpm_downsample_point_t *point)
+{
+    static fpm_historyq_ctx_t *ctx;
+    ctx = (fpm_historyq_ctx_t*)ctx_ptr;
+    if(ctx->first == false)
+    {
+        ctx->chunk[ctx->len++] = ',';
+    }
+    ctx->first = false;
+    if(ctx->mode == DOWNSAMPLE_MODE_LTTB)
+    {
+        ctx->len += sprintf(&ctx->chunk[ctx->len], "[%llu,%d]", (unsigned long long)point->time_ms, point->value);
+    }
+    else
+    {
+        ctx->len += sprintf(&ctx->chunk[ctx->len], "[%llu,%d,%.1f,%d,%u]", (unsigned long long)point->time_ms, point->min, point->avg, point->max, point->count);
+    }
+    if(ctx->len > HISTORY_CHUNK_SIZE - 64)
+    {
+        return historyq_flush(ctx);
+    }
+    return true;
+}
+
+// GET /historyq?key=&src=trend|1m|15m&ch=V1&from=&to=&points=&mode=lttb|minmax
+// Downsampled series of one channel for charting; the reply size depends only on
+// the point count, never on the range.
+static esp_err_t historyq_handler(httpd_req_t *req)
+{
+    static char query[160];
+    static char param[24];
+    static fpm_historyq_ctx_t ctx;
+    static fpm_downsample_query_t ds_query;
+    static uint16_t emitted;
+    static uint8_t i;
+    if((httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK)
+    || (httpd_query_key_value(query, "key", param, sizeof(param)) != ESP_OK)
+    || (fpm_key_valid((uint32_t)strtoul(param, NULL, 10)) == false))
+    {
+        httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authorized");
+        return ESP_FAIL;
+    }
+    memset(&ds_query, 0, sizeof(ds_query));
+    ds_query.channel = TREND_CHANNEL_COUNT;
+    if(httpd_query_key_value(query, "ch", param, sizeof(param)) == ESP_OK)
+    {
+        for(i = 0; i < TREND_CHANNEL_COUNT; i++)
+        {
+            if(strcmp(param, fpm_trend_channel_name(i)) == 0)
+            {
+                ds_query.channel = i;
+            }
+        }
+    }
+    ds_query.source = DOWNSAMPLE_SOURCE_15MIN;
+    if(httpd_query_key_value(query, "src", param, sizeof(param)) == ESP_OK)
+    {
+        if(strcmp(param, "trend") == 0)
+        {
+            ds_query.source = DOWNSAMPLE_SOURCE_TREND;
+        }
+        else if(strcmp(param, "1m") == 0)
+        {
+            ds_query.source = DOWNSAMPLE_SOURCE_1MIN;
+        }
+    }
+    ds_query.mode = ((httpd_query_key_value(query, "mode", param, sizeof(param)) == ESP_OK) && (strcmp(param, "minmax") == 0)) ? DOWNSAMPLE_MODE_MINMAX : DOWNSAMPLE_MODE_LTTB;
+    ds_query.from_time = (httpd_query_key_value(query, "from", param, sizeof(param)) == ESP_OK) ? (uint32_t)strtoul(param, NULL, 10) : 0;
+    ds_query.to_time = (httpd_query_key_value(query, "to", param, sizeof(param)) == ESP_OK) ? (uint32_t)strtoul(param, NULL, 10) : UINT32_MAX;
+    ds_query.points = (httpd_query_key_value(query, "points", param, sizeof(param)) == ESP_OK) ? (uint16_t)strtoul(param, NULL, 10) : 200;
+    if((ds_query.channel >= TREND_CHANNEL_COUNT) || (ds_query.points < 2) || (ds_query.points > DOWNSAMPLE_MAX_POINTS))
+    {
+        httpd_resp_send_err(req, HTTPD_400_BAD_REQUEST, "Bad query");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    ctx.req = req;
+    ctx.mode = ds_query.mode;
+    ctx.first = true;
+    ctx.len = sprintf(ctx.chunk, "{\"ch\":\"%s\",\"scale\":%u,\"mode\":\"%s\",\"p\":[", fpm_trend_channel_name(ds_query.channel), fpm_trend_channel_scale(ds_query.channel), (ds_query.mode == DOWNSAMPLE_MODE_LTTB) ? "lttb" : "minmax");
+    emitted = fpm_downsample_run(&ds_query, historyq_emit, &ctx);
+    ctx.len += sprintf(&ctx.chunk[ctx.len], "],\"n\":%u,\"us\":%lu}", emitted, downsample_stats.run_us_last);
+    if(historyq_flush(&ctx) == false)
+    {
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+// One record as {"k","t0","t1","f","d":[...]}, deltas in counter order of "c".
+static bool energy_emit(void *ctx_ptr, const fpm_energy_record_t *record)
+{
+    static fpm_historyq_ctx_t *ctx;
+    static uint8_t i;
+    ctx = (fpm_historyq_ctx_t*)ctx_ptr;
+    if(ctx->first == false)
+    {
+        ctx->chunk[ctx->len++] = ',';
+    }
+    ctx->first = false;
+    ctx->len += sprintf(&ctx->chunk[ctx->len], "{\"k\":%lu,\"t0\":%lu,\"t1\":%lu,\"f\":%u,\"d\":[", record->key, record->start_time, record->end_time, record->flags);
+    for(i = 0; i < ENERGY_COUNTER_COUNT; i++)
+    {
+        ctx->len += sprintf(&ctx->chunk[ctx->len], "%s%.3f", (i == 0) ? "" : ",", record->delta[i]);
+    }
+    ctx->len += sprintf(&ctx->chunk[ctx->len], "]}");
+    if(ctx->len > HISTORY_CHUNK_SIZE - 200)
+    {
+        return historyq_flush(ctx);
+    }
+    return true;
+}
+
+// GET /energy?key=&period=hour|day|month&from=&to=, from/to in UTC epoch seconds.
+// Closed periods come from the record files, "open" is the period in progress.
+static esp_err_t energy_handler(httpd_req_t *req)
+{
+    static char query[120];
+    static char param[24];
+    static fpm_historyq_ctx_t ctx;
+    static fpm_energy_record_t current;
+    static uint32_t from_time;
+    static uint32_t to_time;
+    static uint16_t emitted;
+    static uint8_t period;
+    static uint8_t i;
+    if((httpd_req_get_url_query_str(req, query, sizeof(query)) != ESP_OK)
+    || (httpd_query_key_value(query, "key", param, sizeof(param)) != ESP_OK)
+    || (fpm_key_valid((uint32_t)strtoul(param, NULL, 10)) == false))
+    {
+        httpd_resp_send_err(req, HTTPD_401_UNAUTHORIZED, "Not authorized");
+        return ESP_FAIL;
+    }
+    period = ENERGY_PERIOD_DAY;
+    if(httpd_query_key_value(query, "period", param, sizeof(param)) == ESP_OK)
+    {
+        for(i = 0; i < ENERGY_PERIOD_COUNT; i++)
+        {
+            if(strcmp(param, fpm_energy_period_name(i)) == 0)
+            {
+                period = i;
+            }
+        }
+    }
+    from_time = (httpd_query_key_value(query, "from", param, sizeof(param)) == ESP_OK) ? (uint32_t)strtoul(param, NULL, 10) : 0;
+    to_time = (httpd_query_key_value(query, "to", param, sizeof(param)) == ESP_OK) ? (uint32_t)strtoul(param, NULL, 10) : UINT32_MAX;
+    if(sntp_time_valid == false)
+    {
+        httpd_resp_send_err(req, HTTPD_404_NOT_FOUND, "No time sync");
+        return ESP_FAIL;
+    }
+    httpd_resp_set_type(req, "application/json");
+    httpd_resp_set_hdr(req, "Cache-Control", "no-store");
+    ctx.req = req;
+    ctx.first = true;
+    ctx.len = sprintf(ctx.chunk, "{\"period\":\"%s\",\"c\":[", fpm_energy_period_name(period));
+    for(i = 0; i < ENERGY_COUNTER_COUNT; i++)
+    {
+        ctx.len += sprintf(&ctx.chunk[ctx.len], "%s\"%s\"", (i == 0) ? "" : ",", fpm_energy_counter_name(i));
+    }
+    ctx.len += sprintf(&ctx.chunk[ctx.len], "],\"r\":[");
+    emitted = fpm_energy_query(period, from_time, to_time, energy_emit, &ctx);
+    ctx.len += sprintf(&ctx.chunk[ctx.len], "],\"n\":%u", emitted);
+    if(fpm_energy_current(period, &current) == true)
+    {
+        ctx.len += sprintf(&ctx.chunk[ctx.len], ",\"open\":");
+        ctx.first = true;
+        energy_emit(&ctx, &current);
+    }
+    ctx.chunk[ctx.len++] = '}';
+    if(historyq_flush(&ctx) == false)
+    {
+        httpd_resp_sendstr_chunk(req, NULL);
+        return ESP_FAIL;
+    }
+    httpd_resp_send_chunk(req, NULL, 0);
+    return ESP_OK;
+}
+
+static esp_err_t bootupdate_handler(httpd_req_t *req)
+{
+    char filepath[FILE_PATH_MAX];
+    static ota_return_t ota_return;
+    const char *filename = get_path_from_uri(filepath, ((struct file_server_data *)req->user_ctx)->base_path,
+                                             req->uri + sizeof("/bootupdate") - 1, sizeof(filepath));
+    if (!filename)
+    {
+        httpd_resp_send_err(req, HTTPD_500_INTERNAL_SERVER_ERROR, "Filename too long");
         return ESP_FAIL;
     }
     if (filename[strlen(filename) - 1] == '/')
@@ -1468,6 +2858,49 @@ bool has_clients(void)
     return false;
 }
 
+// A viewer acks at least every clock message, so one silent for CLEAN_SOCKETS_INTERVAL
+// is gone. Closed viewers are unlinked under the lock and freed outside it.
+static void CleanViewers(void)
+{
+    static fpm_viewer_t *viewer;
+    static fpm_viewer_t **link;
+    static fpm_viewer_t *gone;
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        if((viewer->closing == false) && (xTaskGetTickCount() - viewer->in_time_stamp >= CLEAN_SOCKETS_INTERVAL))
+        {
+            ESP_LOGI(TAG,"Persistent remove viewer fd = %d", viewer->fd);
+            ViewerClose(viewer);
+        }
+    }
+    gone = NULL;
+    portENTER_CRITICAL(&viewer_mux);
+    link = &fpm_viewers;
+    while(*link != NULL)
+    {
+        if((*link)->closing == true)
+        {
+            viewer = *link;
+            *link = viewer->next;
+            viewer->next = gone;
+            gone = viewer;
+            viewer_stats.active--;
+        }
+        else
+        {
+            link = &(*link)->next;
+        }
+    }
+    portEXIT_CRITICAL(&viewer_mux);
+    while(gone != NULL)
+    {
+        viewer = gone;
+        gone = viewer->next;
+        ESP_LOGI(TAG,"Remove viewer fd = %d", viewer->fd);
+        free(viewer);
+    }
+}
+
 void CleanSockets_IdleWsClients(void)
 {
     static uint8_t i;
@@ -1483,71 +2916,275 @@ void CleanSockets_IdleWsClients(void)
                 send_ui_textmessages_timestamp = xTaskGetTickCount();
             }
         }
+        else if((fpm_wsockets[i].parked == true) && (xTaskGetTickCount() - fpm_wsockets[i].parked_timestamp >= WS_PARK_TIMEOUT))
+        {
+            fpm_wsockets[i].parked = false;
+        }
     }
+    CleanViewers();
 }
 
-void WsClientsAutoMsg(void)
+// Offsets of the parameter objects of the rdmeter document with the CID of each, so a
+// subscribed subset is cut out of the shared document instead of serialized again.
+// The document is cJSON output: objects are flat and strings escape their quotes.
+static void ElectricalIndexBuild(void)
 {
-    static bool modbus_toggle_ReadWrite = MODBUS_READ;
-    if(strcmp(ethernet_status_msg, back_ethernet_status_msg) != 0)
+    static char *p;
+    static char *start;
+    static uint16_t cid;
+    static uint16_t reg;
+    static uint8_t depth;
+    static bool quoted;
+    electrical_gen++;
+    electrical_frag_count = 0;
+    electrical_tail_off = 0;
+    metermsg_electrical[metermsg_electrical_len] = 0;
+    p = strstr(metermsg_electrical, "\"WAGO8793040\":[");
+    if(p == NULL)
     {
-        QueClientUISetting(NULL, ALL_CLIENT);
-        QueClientUIInfor(NULL, ALL_CLIENT);
-        strcpy(back_ethernet_status_msg, ethernet_status_msg);
+        return;
     }
-    sensor_elapsed = xTaskGetTickCount() - sensor_timestamp;
-
-    if(modbus_toggle_ReadWrite == MODBUS_READ)
+    p += 15;
+    electrical_head_len = p - metermsg_electrical;
+    cid = 0;
+    while(*p == '{')
     {
-        if(sensor_elapsed > 1000)
+        while((cid < WS_SUB_CIDS) && (fpm_modbus_cid_listed(cid, &reg) == false))
+        {
+            cid++;
+        }
+        if(cid >= WS_SUB_CIDS)
+        {
+            electrical_frag_count = 0;
+            return;
+        }
+        start = p;
+        depth = 0;
+        quoted = false;
+        do
         {
-            static _enum_fpm_modbus_read enum_modbus_read;
-            enum_modbus_read = fpm_modbus_read_jSON("&console#rdmeter=", metermsg_electrical, &metermsg_electrical_len);
-            switch(enum_modbus_read)
+            if(quoted == true)
             {
-                case MODBUSREAD_JSON_READY:
-                    SetSensorSend(NULL, ALL_CLIENT);
-                    sensor_timestamp = xTaskGetTickCount();
-                    if(enum_modbus_write == MODBUSWRITE_SEND)
-                    {
-                        modbus_toggle_ReadWrite = MODBUS_WRITE;
-                    }
-                break;    
-                case MODBUSREAD_JSON_UARTFREE:
-                    if(enum_modbus_write == MODBUSWRITE_SEND)
-                    {
-                        modbus_toggle_ReadWrite = MODBUS_WRITE;
-                    }
-                break;
-                default:
-                break;
+                if((*p == '\\') && (p[1] != 0))
+                {
+                    p++;
+                }
+                else if(*p == '"')
+                {
+                    quoted = false;
+                }
             }
+            else if(*p == '"')
+            {
+                quoted = true;
+            }
+            else if(*p == '{')
+            {
+                depth++;
+            }
+            else if(*p == '}')
+            {
+                depth--;
+            }
+            p++;
+        }while((*p != 0) && (depth != 0));
+        if(depth != 0)
+        {
+            electrical_frag_count = 0;
+            return;
+        }
+        electrical_frag_off[electrical_frag_count] = start - metermsg_electrical;
+        electrical_frag_len[electrical_frag_count] = p - start;
+        electrical_frag_cid[electrical_frag_count] = (uint8_t)cid;
+        electrical_frag_count++;
+        cid++;
+        if(*p == ',')
+        {
+            p++;
+        }
+    }
+    if(*p != ']')
+    {
+        electrical_frag_count = 0;
+        return;
+    }
+    electrical_tail_off = p - metermsg_electrical;
+}
+
+// rdmeter message for a client with a CID subscription: its rows of the shared document,
+// each tagged with its row number so the page still finds the right line. Clients with
+// the same set reuse the last cut. NULL when there is no index or the cut does not fit.
+static char *ElectricalSubset(fpm_wsockets_t *xclient)
+{
+    static uint16_t i;
+    static uint16_t rows;
+    static uint16_t tail_len;
+    static uint8_t cid;
+    if((electrical_frag_count == 0) || (electrical_tail_off == 0))
+    {
+        return NULL;
+    }
+    if((subset_gen == electrical_gen) && (memcmp(subset_mask, xclient->sub_mask, sizeof(subset_mask)) == 0))
+    {
+        metermsg_subset[metermsg_subset_len] = 0;
+        return metermsg_subset;
+    }
+    subset_gen = 0;
+    memcpy(metermsg_subset, metermsg_electrical, electrical_head_len);
+    metermsg_subset_len = electrical_head_len;
+    rows = 0;
+    for(i = 0; i < electrical_frag_count; i++)
+    {
+        cid = electrical_frag_cid[i];
+        if((xclient->sub_mask[cid >> 5] & (1UL << (cid & 31))) == 0)
+        {
+            continue;
         }
+        if(metermsg_subset_len + electrical_frag_len[i] + 16 >= ELECTRICAL_SUBSET_SIZE)
+        {
+            return NULL;
+        }
+        metermsg_subset_len += sprintf(&metermsg_subset[metermsg_subset_len], "%s{\"idx\":%u,", (rows > 0) ? "," : "", i);
+        memcpy(&metermsg_subset[metermsg_subset_len], &metermsg_electrical[electrical_frag_off[i] + 1], electrical_frag_len[i] - 1);
+        metermsg_subset_len += electrical_frag_len[i] - 1;
+        rows++;
     }
-    else if(modbus_toggle_ReadWrite == MODBUS_WRITE)
+    tail_len = metermsg_electrical_len - electrical_tail_off;
+    if(metermsg_subset_len + tail_len + WS_MSG_CNTID_RESERVE >= ELECTRICAL_SUBSET_SIZE)
     {
-        enum_modbus_write = fpm_modbus_write(enum_modbus_write);
-        static char modbus_write_return_msg[100];
-        switch(enum_modbus_write)
+        return NULL;
+    }
+    memcpy(&metermsg_subset[metermsg_subset_len], &metermsg_electrical[electrical_tail_off], tail_len);
+    metermsg_subset_len += tail_len;
+    metermsg_subset[metermsg_subset_len] = 0;
+    memcpy(subset_mask, xclient->sub_mask, sizeof(subset_mask));
+    subset_gen = electrical_gen;
+    return metermsg_subset;
+}
+
+// "&console#subscribe=all", or a comma list of group names and register addresses
+// (decimal or 0x hex) of the rows the page shows.
+static void ClientSubscribe(fpm_wsockets_t *xclient, char *list)
+{
+    static char *token;
+    static char *saveptr;
+    static int16_t sample_cid;
+    static uint16_t cid;
+    static uint16_t reg;
+    static uint8_t g;
+    static bool group;
+    memset(xclient->sub_mask, 0, sizeof(xclient->sub_mask));
+    xclient->sub_mode = SUB_SET;
+    for(token = strtok_r(list, ",", &saveptr); token != NULL; token = strtok_r(NULL, ",", &saveptr))
+    {
+        if(strcmp(token, "all") == 0)
         {
-            case MODBUSWRITE_OK:
-                modbus_toggle_ReadWrite = MODBUS_READ;
-                modbus_restart_cid();
-                ClientQueTextMessageOut(modbuswrite_xclient, "&console#mbresp=Write Successful");
-                enum_modbus_write = MODBUSWRITE_DEFAULT;                    
-            break;
-            case MODBUSWRITE_NOT_OK:
-            case MODBUSWRITE_CMD_ERROR:
-                modbus_toggle_ReadWrite = MODBUS_READ;
-                sprintf(modbus_write_return_msg, "&console#mbresp=Error(%lu)", modbus_error);
-                ClientQueTextMessageOut(modbuswrite_xclient, modbus_write_return_msg);
-                enum_modbus_write = MODBUSWRITE_DEFAULT;
-            break;
-            default:
-            break;    
+            xclient->sub_mode = SUB_ALL;
+            return;
+        }
+        group = false;
+        for(g = 0; g < sizeof(ws_sub_groups) / sizeof(ws_sub_groups[0]); g++)
+        {
+            if(strcmp(token, ws_sub_groups[g].name) != 0)
+            {
+                continue;
+            }
+            group = true;
+            for(cid = 0; cid < WS_SUB_CIDS; cid++)
+            {
+                if((fpm_modbus_cid_listed(cid, &reg) == true) && (reg >= ws_sub_groups[g].first) && (reg <= ws_sub_groups[g].last))
+                {
+                    xclient->sub_mask[cid >> 5] |= 1UL << (cid & 31);
+                }
+            }
         }
+        if(group == false)
+        {
+            sample_cid = fpm_modbus_sample_index((uint16_t)strtoul(token, NULL, 0));
+            if((sample_cid >= 0) && (sample_cid < WS_SUB_CIDS))
+            {
+                xclient->sub_mask[sample_cid >> 5] |= 1UL << (sample_cid & 31);
+            }
+        }
+    }
+}
+
+static _enum_fpm_arbiter_step ArbiterPollStep(void *ctx)
+{
+    static _enum_fpm_modbus_read enum_modbus_read;
+    fpm_acquisition_sample_started();
+    enum_modbus_read = fpm_modbus_read_jSON("&console#rdmeter=", metermsg_electrical, &metermsg_electrical_len);
+    switch(enum_modbus_read)
+    {
+        case MODBUSREAD_JSON_READY:
+            return ARBITER_STEP_DONE;
+        case MODBUSREAD_JSON_UARTFREE:
+            return ARBITER_STEP_YIELD;
+        default:
+            return ARBITER_STEP_BUSY;
+    }
+}
+
+static void ArbiterPollDone(void *ctx)
+{
+    fpm_acquisition_sample_done();
+    fpm_trend_append();
+    fpm_aggregate_sample();
+    fpm_energy_sample();
+    fpm_alarm_evaluate();
+    fpm_burst_sample();
+    ElectricalIndexBuild();
+    SetSensorSend(NULL, ALL_CLIENT);
+    sensor_timestamp = xTaskGetTickCount();
+}
+
+static _enum_fpm_arbiter_step ArbiterWriteStep(void *ctx)
+{
+    enum_modbus_write = fpm_modbus_write(enum_modbus_write);
+    switch(enum_modbus_write)
+    {
+        case MODBUSWRITE_OK:
+        case MODBUSWRITE_NOT_OK:
+        case MODBUSWRITE_CMD_ERROR:
+            return ARBITER_STEP_DONE;
+        default:
+            return ARBITER_STEP_BUSY;
     }
+}
 
+static void ArbiterWriteDone(void *ctx)
+{
+    static char modbus_write_return_msg[100];
+    switch(enum_modbus_write)
+    {
+        case MODBUSWRITE_OK:
+            modbus_restart_cid();
+            ClientQueControlMessageOut(modbuswrite_xclient, "&console#mbresp=Write Successful");
+        break;
+        default:
+            sprintf(modbus_write_return_msg, "&console#mbresp=Error(%lu)", modbus_error);
+            ClientQueControlMessageOut(modbuswrite_xclient, modbus_write_return_msg);
+        break;
+    }
+    enum_modbus_write = MODBUSWRITE_DEFAULT;
+}
+
+void WsClientsAutoMsg(void)
+{
+    if(strcmp(ethernet_status_msg, back_ethernet_status_msg) != 0)
+    {
+        QueClientUISetting(NULL, ALL_CLIENT);
+        QueClientUIInfor(NULL, ALL_CLIENT);
+        strcpy(back_ethernet_status_msg, ethernet_status_msg);
+    }
+    SaveNewKeys();
+    sensor_elapsed = xTaskGetTickCount() - sensor_timestamp;
+
+    if(fpm_acquisition_due(fpm_arbiter_pending(ARBITER_CLASS_POLL)) == true)
+    {
+        fpm_arbiter_submit(ARBITER_CLASS_POLL, ARBITER_PRIORITY_POLL, fpm_acquisition_period(), ARBITER_POLL_STEP_DEADLINE, ArbiterPollStep, ArbiterPollDone, NULL);
+    }
+    fpm_arbiter_process();
 }
 
 void WsClientsAuthenticationInit(void)
@@ -1564,12 +3201,70 @@ void WsClientsAuthenticationInit(void)
             {
                 fpm_wsockets[i].ws_startup_init_done = 1;
                 strcpy(validate_str, "&console#validate=1");
-                ClientQueTextMessageOut(&fpm_wsockets[i], validate_str);
+                ClientQueControlMessageOut(&fpm_wsockets[i], validate_str);
             }
         }
     }
 }
 
+// "&console#hello={"username","password","sub","rate"}" as the first message on /wsboot
+// stands for POST /login, new_ws, start and the rdmeterz/validate exchange. BootAdmit
+// has checked the credentials and given the socket its slot and key; the answer is
+// "&console#welcome=" with the key, access, settings and information, followed in the
+// same send pass by the electrical snapshot and the meter information, so the page
+// shows readings one round trip after the socket opens.
+static void ClientHello(fpm_wsockets_t *xclient, char *json_str, uint32_t cntID)
+{
+    static char welcome_str[1200];
+    static uint8_t idx;
+    cJSON *welcome_json_obj;
+    cJSON *json_parse;
+    cJSON *valuejSON;
+    char *json_print;
+    xclient->boot_admitted = false;
+    welcome_json_obj = cJSON_CreateObject();
+    idx = xclient->boot_key_idx;
+    save_new_key |= 1UL << idx;
+    xclient->auth_status = AUTHENTICATED_TRUE;
+    xclient->key = key_uint32[idx];
+    xclient->textmessage_in_cntid = cntID;
+    xclient->batch = true;
+    json_parse = cJSON_Parse(json_str);
+    valuejSON = cJSON_GetObjectItemCaseSensitive(json_parse, "sub");
+    if(cJSON_IsString(valuejSON))
+    {
+        ClientSubscribe(xclient, valuejSON->valuestring);
+    }
+    valuejSON = cJSON_GetObjectItemCaseSensitive(json_parse, "rate");
+    if(cJSON_IsString(valuejSON))
+    {
+        xclient->rate_interval = WsRateClamp(valuejSON->valuestring);
+        cJSON_AddItemToObject(welcome_json_obj, "rate", cJSON_CreateNumber(xclient->rate_interval));
+    }
+    cJSON_Delete(json_parse);
+    cJSON_AddItemToObject(welcome_json_obj, "key", cJSON_CreateString(key_str[idx]));
+    cJSON_AddItemToObject(welcome_json_obj, "access", cJSON_CreateString((xclient->access == ADMINISTRATOR_ACCESS) ? "administrator" : "supervisor"));
+    cJSON_AddItemToObject(welcome_json_obj, "msg", cJSON_CreateString((xclient->access == ADMINISTRATOR_ACCESS) ? "Administrator" : "Supervisor"));
+    cJSON_AddItemToObject(welcome_json_obj, "setting", UISettingJSON(xclient->access == ADMINISTRATOR_ACCESS));
+    cJSON_AddItemToObject(welcome_json_obj, "infor", UIInforJSON());
+    // started straight away: the snapshot and meter information take the bulk
+    // slots of the window behind the welcome, before any persistent message
+    xclient->ws_startup_init_done = 1;
+    xclient->rdmeter_confirm_get = 1;
+    xclient->time_persistent_timestamp = xTaskGetTickCount();
+    if(xclient->sub_mode != SUB_NONE)
+    {
+        xclient->send_meter_electrical = true;
+    }
+    xclient->send_meter_infoconfig = true;
+    strcpy(welcome_str, "&console#welcome=");
+    json_print = cJSON_PrintUnformatted(welcome_json_obj);
+    strncat(welcome_str, json_print, sizeof(welcome_str) - strlen(welcome_str) - 1);
+    cJSON_free(json_print);
+    cJSON_Delete(welcome_json_obj);
+    ClientQueControlMessageOut(xclient, welcome_str);
+}
+
 void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
 {
     static uint8_t i;
@@ -1580,7 +3275,15 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
     static uint32_t cntID;
     cJSON *json_parse;
     cJSON *valuejSON;
-    ESP_LOGI(TAG, "Client %d ui -> %s", xclient->fd, textmessage);
+    // a hello carries the password in clear, only its name goes to the log
+    if(memcmp((char*)textmessage, "&console#hello=", 15) == 0)
+    {
+        ESP_LOGI(TAG, "Client %d ui -> &console#hello=<redacted>", xclient->fd);
+    }
+    else
+    {
+        ESP_LOGI(TAG, "Client %d ui -> %s", xclient->fd, textmessage);
+    }
 
     if(memcmp((char*)textmessage, "&console", 8) == 0)
     { 
@@ -1591,6 +3294,17 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
         delimiter_nxt_location = strchr(delimiter_nxt_location, '*');
         delimiter_nxt_location++;
         cntID = (uint32_t)strtoul(delimiter_nxt_location, &dmmyptr, 10);
+        if(xclient->resume_attached == true)
+        {
+            xclient->resume_attached = false;
+            if((memcmp((char*)&textmessage[8], "#resume=", 8) == 0) && (key == xclient->key)
+            && (ClientResume(xclient, strtoul(&textmessage[16], NULL, 10)) == true))
+            {
+                xclient->textmessage_in_cntid = cntID + 1;
+                return;
+            }
+            ClientSessionRestart(xclient);
+        }
         for(i = 0; i < WS_URI_ALLOCATION; i++)
         {
             if((key == key_uint32[i]) && (key != 0))
@@ -1607,8 +3321,10 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
         }
         memset(out_str, 0, sizeof(out_str));
         strcpy(out_str, "&console#");
-        if(memcmp((char*)&textmessage[8], "#new_ws=", 8) == 0)
+        if((memcmp((char*)&textmessage[8], "#new_ws=", 8) == 0) || (memcmp((char*)&textmessage[8], "#resume=", 8) == 0))
         {
+            // pages that resume or say so in new_ws unpack "&batch#" frames
+            xclient->batch = (memcmp((char*)&textmessage[8], "#resume=", 8) == 0) || (strncmp((char*)&textmessage[16], "batch", 5) == 0);
             if(xclient->auth_status == AUTHENTICATED_TRUE)
             {
                 if(xclient->get_started == 1)
@@ -1627,7 +3343,14 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
             else
             {
                 strcat(out_str, "load=logon");
-                ClientQueTextMessageOut(xclient, out_str);
+                ClientQueControlMessageOut(xclient, out_str);
+            }
+        }
+        else if(memcmp((char*)&textmessage[8], "#hello=", 7) == 0)
+        {
+            if((xclient->auth_status != AUTHENTICATED_TRUE) && (xclient->boot_admitted == true))
+            {
+                ClientHello(xclient, &textmessage[15], cntID);
             }
         }
         else if(memcmp((char*)&textmessage[8], "#start", 6) == 0)
@@ -1646,7 +3369,7 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
                 else
                 {
                     strcat(out_str, "load=logon");
-                    ClientQueTextMessageOut(xclient, out_str);
+                    ClientQueControlMessageOut(xclient, out_str);
                 }
             }
         }
@@ -1657,6 +3380,7 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
         }
         else if(memcmp((char*)&textmessage[8], "#close", 6) == 0){}
         else if(memcmp((char*)&textmessage[8], "#persistent", 11) == 0){}
+        else if(memcmp((char*)&textmessage[8], "#ack", 4) == 0){}
         else if(memcmp((char*)&textmessage[8], "#validate=1z", 12) == 0){}
         else if(memcmp((char*)&textmessage[8], "#get=start", 10) == 0){}
         else if(memcmp((char*)&textmessage[8], "#get=end", 8) == 0)
@@ -1671,20 +3395,21 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
             {
                 uploadtimeout = xTaskGetTickCount(); 
                 strcat(out_str, "uploadnow");
-                ClientQueTextMessageOut(xclient, out_str);
+                ClientQueControlMessageOut(xclient, out_str);
             }
             else if(memcmp((char*)&textmessage[8], "#modbuswr?", 10) == 0)
             {
                 printf("Get modbus IN = %s\r\n", &textmessage[18]);
                 strcpy(modbus_write_str, &textmessage[18]);
-                if(enum_modbus_write == MODBUSWRITE_DEFAULT)
+                if((enum_modbus_write == MODBUSWRITE_DEFAULT)
+                && (fpm_arbiter_submit(ARBITER_CLASS_WRITE, ARBITER_PRIORITY_WRITE, MODBUS_WRITE_DEADLINE, 0, ArbiterWriteStep, ArbiterWriteDone, NULL) >= 0))
                 {
                     modbuswrite_xclient = xclient;
                     enum_modbus_write = MODBUSWRITE_SEND;
                 }
                 else
                 {
-                    ClientQueTextMessageOut(xclient, "&console#mbresp=Write Not Successful");
+                    ClientQueControlMessageOut(xclient, "&console#mbresp=Write Not Successful");
                 }
             }
             else if(memcmp((char*)&textmessage[8], "#setting=", 9) == 0)
@@ -1712,8 +3437,9 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
                         }
                         cJSON_Delete(json_parse);
                     }
+                    ViewerKeyRotate();
                     strcat(out_str, "confirm_set_logonad");
-                    ClientQueTextMessageOut(xclient, out_str);
+                    ClientQueControlMessageOut(xclient, out_str);
                 }
                 else if(memcmp((char*)&textmessage[17], "logonsv?", 8) == 0)
                 {
@@ -1738,8 +3464,9 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
                         }
                         cJSON_Delete(json_parse);
                     }
+                    ViewerKeyRotate();
                     strcat(out_str, "confirm_set_logonsv");
-                    ClientQueTextMessageOut(xclient, out_str);
+                    ClientQueControlMessageOut(xclient, out_str);
                 }
                 else if(memcmp((char*)&textmessage[17], "wifipass?", 9) == 0)
                 {
@@ -1759,7 +3486,7 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
                         cJSON_Delete(json_parse);
                     }
                     strcat(out_str, "confirm_set_wifiap");
-                    ClientQueTextMessageOut(xclient, out_str);
+                    ClientQueControlMessageOut(xclient, out_str);
                 }
                 else if(memcmp((char*)&textmessage[17], "ethernet?", 9) == 0)
                 {
@@ -1802,12 +3529,47 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
                         }
                     }
                     strcat(out_str, "confirm_set_ethernet");
-                    ClientQueTextMessageOut(xclient, out_str);
+                    ClientQueControlMessageOut(xclient, out_str);
+                }
+                else if((memcmp((char*)&textmessage[17], "viewers?", 8) == 0) && (xclient->access == ADMINISTRATOR_ACCESS))
+                {
+                    json_parse = cJSON_Parse(&textmessage[25]);
+                    if(json_parse == NULL)
+                    {
+                        ESP_LOGI(TAG, "Web server script error.");
+                    }
+                    else
+                    {
+                        valuejSON = cJSON_GetObjectItemCaseSensitive(json_parse, "limit");
+                        if(cJSON_IsString(valuejSON))
+                        {
+                            viewer_limit = MIN((uint16_t)atol(valuejSON->valuestring), CONFIG_FPM_VIEWER_MAX);
+                            sprintf(viewer_limit_str, "%u", viewer_limit);
+                            settings_file_json("/data/viewerlimit.json", "limit", viewer_limit_str, WRITE_SETTING);
+                        }
+                        cJSON_Delete(json_parse);
+                    }
+                    strcat(out_str, "confirm_set_viewers");
+                    ClientQueControlMessageOut(xclient, out_str);
                 }
                 QueClientUISetting(xclient, OTHER_CLIENT);  
             }
             else if(memcmp((char*)&textmessage[8], "#rdmeter?", 9) == 0){SetSensorSend(xclient, THIS_CLIENT);} 
             else if(memcmp((char*)&textmessage[8], "#rdmeterz", 9) == 0){xclient->rdmeter_confirm_get = 1;} 
+            else if(memcmp((char*)&textmessage[8], "#subscribe=", 11) == 0){ClientSubscribe(xclient, &textmessage[19]); SetSensorSend(xclient, THIS_CLIENT);}
+            else if(memcmp((char*)&textmessage[8], "#unsubscribe", 12) == 0){xclient->sub_mode = SUB_NONE; xclient->send_meter_electrical = false;}
+            else if(memcmp((char*)&textmessage[8], "#rate=", 6) == 0)
+            {
+                xclient->rate_interval = WsRateClamp(&textmessage[14]);
+                sprintf(&out_str[9], "rate=%lu", xclient->rate_interval);
+                ClientQueControlMessageOut(xclient, out_str);
+            }
+            else if(memcmp((char*)&textmessage[8], "#ttfr=", 6) == 0)
+            {
+                // page measured time from submitting the logon to the first reading shown
+                if(memcmp((char*)&textmessage[14], "boot,", 5) == 0){ws_stats.ttfr_boot = (uint32_t)strtoul(&textmessage[19], NULL, 10);}
+                else if(memcmp((char*)&textmessage[14], "login,", 6) == 0){ws_stats.ttfr_login = (uint32_t)strtoul(&textmessage[20], NULL, 10);}
+            }
             else if(memcmp((char*)&textmessage[8], "#setting?", 9) == 0){QueClientUISetting(xclient, THIS_CLIENT);}
             else if(memcmp((char*)&textmessage[8], "#settingz", 9) == 0){xclient->setting_confirm_get = 1;}
             else if(memcmp((char*)&textmessage[8], "#wrmeter?", 9) == 0){QueClientUIWrMeter(xclient, THIS_CLIENT); }
@@ -1819,7 +3581,7 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
         else
         {
             strcat(out_str, "load=logon");
-            ClientQueTextMessageOut(xclient, out_str);
+            ClientQueControlMessageOut(xclient, out_str);
         }
         xclient->textmessage_in_cntid++;
     } 
@@ -1828,18 +3590,22 @@ void ProcessWsDataFD(fpm_wsockets_t *xclient, char *textmessage)
 void WsClientsProcessData(void)
 {
     static uint8_t process_idx = 0;
+    static fpm_msg_t *msg;
     if(fpm_wsockets[process_idx].fd != 0)
     {
         if(fpm_wsockets[process_idx].textmessage_in_idx_write != fpm_wsockets[process_idx].textmessage_in_idx_read)
         {
-            ProcessWsDataFD(&fpm_wsockets[process_idx], &fpm_wsockets[process_idx].textmessage_in[fpm_wsockets[process_idx].textmessage_in_idx_read][0]);
+            // taken off the queue first: processing may reset the queue
+            msg = fpm_wsockets[process_idx].textmessage_in[fpm_wsockets[process_idx].textmessage_in_idx_read];
+            fpm_wsockets[process_idx].textmessage_in[fpm_wsockets[process_idx].textmessage_in_idx_read] = NULL;
             fpm_wsockets[process_idx].textmessage_in_idx_read++;
             if(fpm_wsockets[process_idx].textmessage_in_idx_read >= WS_CLIENT_TXTMSG_BFFR_CNT)
             {
                 fpm_wsockets[process_idx].textmessage_in_idx_read = 0;
             }
+            ProcessWsDataFD(&fpm_wsockets[process_idx], fpm_msgpool_text(msg));
+            fpm_msgpool_release(msg);
             fpm_wsockets[process_idx].textmessage_in_time_stamp = xTaskGetTickCount();
-            fpm_wsockets[process_idx].expecting_response = false;
         }
     }
     process_idx++;
@@ -1862,30 +3628,108 @@ bool AllClientsExpectingResponse(void)
     {
         if(fpm_wsockets[i].fd != 0)
         {
-            if(fpm_wsockets[i].expecting_response == true)
+            if(ClientInFlight(&fpm_wsockets[i]) >= WS_SEND_WINDOW)
             {
                 return true;
             }
         }
     }
-    return false;
+    return false;
+}
+
+// Zero-timeout select on the client socket: a send is only started when lwIP has room
+// for it, so a slow client never blocks the main loop inside httpd_ws_send_data.
+static bool ClientSocketWritable(int fd)
+{
+    static fd_set write_fds;
+    static struct timeval tv;
+    FD_ZERO(&write_fds);
+    FD_SET(fd, &write_fds);
+    tv.tv_sec = 0;
+    tv.tv_usec = 0;
+    return (select(fd + 1, NULL, &write_fds, NULL, &tv) > 0);
+}
+
+// Sends what clientSendWs collected for one client as a single frame,
+// "&batch#msg\x1emsg...", each message still with its own count ID. A lone message goes
+// out plain.
+static bool ClientBatchFlush(fpm_wsockets_t* xclient)
+{
+    static httpd_ws_frame_t frame;
+    static uint8_t count;
+    if(ws_batch_count == 0)
+    {
+        return true;
+    }
+    count = ws_batch_count;
+    ws_batch_count = 0;
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = (uint8_t*)((count == 1) ? &ws_batch[7] : ws_batch);
+    frame.len = ws_batch_len - ((count == 1) ? 7 : 0);
+    if(httpd_ws_send_data(server, xclient->fd, &frame) != ESP_OK)
+    {
+        ESP_LOGI(TAG, "Client %d batch of %u lost", xclient->fd, count);
+        return false;
+    }
+    ws_stats.sent++;
+    if(count > 1)
+    {
+        ws_stats.batches++;
+        ws_stats.batched += count;
+        ESP_LOGI(TAG, "Client %d ui <- batch of %u", xclient->fd, count);
+    }
+    return true;
 }
 
+// A client whose page unpacks batches has its messages collected up to WS_BATCH_SIZE,
+// one TCP segment; ClientBatchFlush sends them after the client's turn in the send
+// loop, or before a message that does not fit. Larger messages go out on their own.
 bool clientSendWs(fpm_wsockets_t* xclient, char *txtmsg)
 {
     static char cntid_str[20];
     static httpd_ws_frame_t frame;
     static char short_str_buffer[100];
+    static size_t len;
     strcat(txtmsg, "*");
     sprintf(cntid_str, "%lu", xclient->textmessage_out_cntid);
     strcat(txtmsg, cntid_str);
+    len = strlen(txtmsg);
+    if(xclient->batch == true)
+    {
+        if((ws_batch_count > 0) && (ws_batch_len + 1 + len > WS_BATCH_SIZE) && (ClientBatchFlush(xclient) == false))
+        {
+            return 0;
+        }
+        if(len + 7 <= WS_BATCH_SIZE)
+        {
+            if(ws_batch_count == 0)
+            {
+                strcpy(ws_batch, "&batch#");
+                ws_batch_len = 7;
+            }
+            else
+            {
+                ws_batch[ws_batch_len++] = WS_BATCH_SEPARATOR;
+            }
+            memcpy(&ws_batch[ws_batch_len], txtmsg, len);
+            ws_batch_len += len;
+            ws_batch_count++;
+            xclient->textmessage_out_time_stamp = xTaskGetTickCount();
+            xclient->textmessage_out_cntid++;
+            if(ClientInFlight(xclient) > ws_stats.inflight_max)
+            {
+                ws_stats.inflight_max = ClientInFlight(xclient);
+            }
+            return 1;
+        }
+    }
     frame.type = HTTPD_WS_TYPE_TEXT;
     frame.payload = (uint8_t*)txtmsg;
-    frame.len = strlen(txtmsg);
+    frame.len = len;
     xclient->textmessage_out_time_stamp = xTaskGetTickCount();
     if(httpd_ws_send_data(server, xclient->fd, &frame) == ESP_OK)
     {
-        xclient->expecting_response = true;
+        ws_stats.sent++;
         memset(short_str_buffer, 0, sizeof(short_str_buffer));
         memcpy(short_str_buffer, txtmsg, 30);
         strcat(short_str_buffer, "...");
@@ -1893,6 +3737,10 @@ bool clientSendWs(fpm_wsockets_t* xclient, char *txtmsg)
         //ESP_LOGI(TAG, "Client %d ui <- %s", fpm_wsockets[fpm_wsockets_idx].fd, _send_ptr);
         ESP_LOGI(TAG, "Client %d ui <- %s", xclient->fd, short_str_buffer);
         xclient->textmessage_out_cntid++;
+        if(ClientInFlight(xclient) > ws_stats.inflight_max)
+        {
+            ws_stats.inflight_max = ClientInFlight(xclient);
+        }
         return 1;
     }
     return 0;
@@ -1968,75 +3816,409 @@ char *build_persistent_str(void)
     return persistent_str;
     
 }
-void WsClientsSend_AppendCntID(void)
+// Alarm events skip the send window: they go out as soon as the main loop
+// comes round, without a count ID, and the UI does not answer them. A client that has
+// just started replays what is left in the event ring. A client whose socket has no room
+// is skipped this pass; alarm_seq is left alone so the event goes out on a later one.
+static void WsSendAlarm(int fd, uint32_t *alarm_seq)
+{
+    static char alarm_msg[250];
+    static httpd_ws_frame_t frame;
+    if(*alarm_seq < fpm_alarm_seq_oldest())
+    {
+        *alarm_seq = fpm_alarm_seq_oldest();
+    }
+    if(*alarm_seq >= fpm_alarm_seq_next())
+    {
+        return;
+    }
+    if(ClientSocketWritable(fd) == false)
+    {
+        ws_stats.not_writable++;
+        return;
+    }
+    if(fpm_alarm_event_msg(*alarm_seq, alarm_msg, sizeof(alarm_msg)) == false)
+    {
+        (*alarm_seq)++;
+        return;
+    }
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = (uint8_t*)alarm_msg;
+    frame.len = strlen(alarm_msg);
+    if(httpd_ws_send_data(server, fd, &frame) == ESP_OK)
+    {
+        ESP_LOGI(TAG, "Client %d ui <- alarm %lu", fd, *alarm_seq);
+        (*alarm_seq)++;
+    }
+}
+
+static void WsClientsSendAlarms(void)
+{
+    static fpm_viewer_t *viewer;
+    static uint8_t i;
+    for(i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        if((fpm_wsockets[i].fd != 0) && (fpm_wsockets[i].ws_startup_init_done == 1))
+        {
+            WsSendAlarm(fpm_wsockets[i].fd, &fpm_wsockets[i].alarm_seq);
+        }
+    }
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        if((viewer->started == true) && (viewer->closing == false))
+        {
+            WsSendAlarm(viewer->fd, &viewer->alarm_seq);
+        }
+    }
+}
+
+// Next message for one client, in priority order: command responses strictly queued,
+// then the conflated state and meter messages, each only in its newest version.
+// false when there was nothing to send or the send failed.
+static bool ClientSendNext(fpm_wsockets_t *xclient)
+{
+    static uint8_t aggregate_type;
+    static uint8_t slot;
+    static char *electrical_msg;
+    if((xTaskGetTickCount() - xclient->time_persistent_timestamp >= ONESECOND_TIME_PERSISTENT_PERIOD) && (xclient->ws_startup_init_done == 1))
+    {
+        if(clientSendWs(xclient, build_persistent_str()) == 1)
+        {
+            ClientReplayKeep(xclient, NULL, 0);
+            xclient->time_persistent_timestamp = xTaskGetTickCount();
+            return true;
+        }
+    }
+    else if(xclient->textmessage_out_idx_read != xclient->textmessage_out_idx_write)
+    {
+        if(clientSendWs(xclient, fpm_msgpool_text(xclient->textmessage_out[xclient->textmessage_out_idx_read])) == 1)
+        {
+            ClientReplayKeep(xclient, xclient->textmessage_out[xclient->textmessage_out_idx_read], 0);
+            fpm_msgpool_release(xclient->textmessage_out[xclient->textmessage_out_idx_read]);
+            xclient->textmessage_out[xclient->textmessage_out_idx_read] = NULL;
+            xclient->textmessage_out_idx_read++;
+            if(xclient->textmessage_out_idx_read >= WS_CLIENT_TXTMSG_BFFR_CNT)
+            {
+                xclient->textmessage_out_idx_read = 0;
+            }
+            return true;
+        }
+    }
+    else if(ClientStatePending(xclient) < WS_STATE_COUNT)
+    {
+        slot = ClientStatePending(xclient);
+        if(clientSendWs(xclient, fpm_msgpool_text(xclient->textmessage_state[slot])) == 1)
+        {
+            ClientReplayKeep(xclient, xclient->textmessage_state[slot], 0);
+            fpm_msgpool_release(xclient->textmessage_state[slot]);
+            xclient->textmessage_state[slot] = NULL;
+            return true;
+        }
+    }
+    else if(xclient->send_meter_burst == true)
+    {
+        metermsg_burst[metermsg_burst_len] = 0;
+        if(clientSendWs(xclient, metermsg_burst) == 1)
+        {
+            ClientReplayKeep(xclient, NULL, REPLAY_BURST);
+            xclient->send_meter_burst = false;
+            return true;
+        }
+    }
+    else if(xclient->send_meter_aggregate != 0)
+    {
+        aggregate_type = (xclient->send_meter_aggregate & (1 << HISTORY_RECORD_1MIN)) ? HISTORY_RECORD_1MIN : HISTORY_RECORD_15MIN;
+        metermsg_aggregate[aggregate_type][metermsg_aggregate_len[aggregate_type]] = 0;
+        if(clientSendWs(xclient, metermsg_aggregate[aggregate_type]) == 1)
+        {
+            ClientReplayKeep(xclient, NULL, REPLAY_AGGREGATE << aggregate_type);
+            xclient->send_meter_aggregate &= ~(1 << aggregate_type);
+            return true;
+        }
+    }
+    else if(xclient->send_meter_electrical == true)
+    {
+        metermsg_electrical[metermsg_electrical_len] = 0;
+        electrical_msg = (xclient->sub_mode == SUB_SET) ? ElectricalSubset(xclient) : NULL;
+        if(electrical_msg == NULL)
+        {
+            electrical_msg = metermsg_electrical;
+        }
+        if(clientSendWs(xclient, electrical_msg) == 1)
+        {
+            ClientReplayKeep(xclient, NULL, REPLAY_ELECTRICAL);
+            xclient->send_meter_electrical = false;
+            if(electrical_msg == metermsg_subset)
+            {
+                ws_stats.sub_partial++;
+                ws_stats.sub_saved += metermsg_electrical_len - metermsg_subset_len;
+            }
+            else
+            {
+                ws_stats.sub_full++;
+            }
+            return true;
+        }
+    }
+    else if(xclient->send_meter_infoconfig == true)
+    {
+        metermsg_infoconfig[metermsg_infoconfig_len] = 0;
+        if(clientSendWs(xclient, metermsg_infoconfig) == 1)
+        {
+            ClientReplayKeep(xclient, NULL, REPLAY_INFOCONFIG);
+            xclient->send_meter_infoconfig = false;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool ClientSendPending(fpm_wsockets_t *xclient)
+{
+    return (IsClientTextMessageOutQueEmpty(xclient) == false) || (xclient->send_meter_infoconfig == true)
+        || ((xTaskGetTickCount() - xclient->time_persistent_timestamp >= ONESECOND_TIME_PERSISTENT_PERIOD) && (xclient->ws_startup_init_done == 1));
+}
+
+static uint8_t ViewerInFlight(fpm_viewer_t *viewer)
+{
+    return (uint8_t)(viewer->out_cntid - viewer->out_acked);
+}
+
+static bool ViewerSendPending(fpm_viewer_t *viewer)
+{
+    return (viewer->pending != 0) || (xTaskGetTickCount() - viewer->persistent_timestamp >= ONESECOND_TIME_PERSISTENT_PERIOD);
+}
+
+static void ViewerSent(fpm_viewer_t *viewer, uint8_t pending)
+{
+    portENTER_CRITICAL(&viewer_mux);
+    viewer->pending &= ~pending;
+    portEXIT_CRITICAL(&viewer_mux);
+}
+
+static bool viewerSendWs(fpm_viewer_t *viewer, char *txtmsg)
 {
+    static char cntid_str[20];
     static httpd_ws_frame_t frame;
-    if(xTaskGetTickCount() - send_ui_textmessages_timestamp >= target_send_ui_text_message_delay)
+    strcat(txtmsg, "*");
+    sprintf(cntid_str, "%lu", viewer->out_cntid);
+    strcat(txtmsg, cntid_str);
+    frame.type = HTTPD_WS_TYPE_TEXT;
+    frame.payload = (uint8_t*)txtmsg;
+    frame.len = strlen(txtmsg);
+    if(httpd_ws_send_data(server, viewer->fd, &frame) == ESP_OK)
+    {
+        viewer_stats.sent++;
+        viewer->out_cntid++;
+        return 1;
+    }
+    return 0;
+}
+
+// Same order as ClientSendNext; the meter messages are the buffers the sessions are
+// sent, re-terminated before every send, and the clock message is built once per pass
+// for all viewers. false only when the send failed.
+static bool ViewerSendNext(fpm_viewer_t *viewer)
+{
+    static char viewer_msg[40];
+    static uint8_t aggregate_type;
+    if(viewer->pending & VIEWER_SEND_START)
+    {
+        strcpy(viewer_msg, "&console#start");
+        ViewerSent(viewer, VIEWER_SEND_START);
+        return viewerSendWs(viewer, viewer_msg);
+    }
+    else if(xTaskGetTickCount() - viewer->persistent_timestamp >= ONESECOND_TIME_PERSISTENT_PERIOD)
+    {
+        viewer->persistent_timestamp = xTaskGetTickCount();
+        if(viewer_persistent == NULL)
+        {
+            viewer_persistent = build_persistent_str();
+            viewer_persistent_len = strlen(viewer_persistent);
+        }
+        viewer_persistent[viewer_persistent_len] = 0;
+        return viewerSendWs(viewer, viewer_persistent);
+    }
+    else if(viewer->pending & VIEWER_SEND_VALIDATE)
+    {
+        strcpy(viewer_msg, "&console#validate=1");
+        ViewerSent(viewer, VIEWER_SEND_VALIDATE);
+        return viewerSendWs(viewer, viewer_msg);
+    }
+    else if(viewer->pending & VIEWER_SEND_BURST)
+    {
+        metermsg_burst[metermsg_burst_len] = 0;
+        ViewerSent(viewer, VIEWER_SEND_BURST);
+        return viewerSendWs(viewer, metermsg_burst);
+    }
+    else if(viewer->pending & ((VIEWER_SEND_AGGREGATE << HISTORY_RECORD_1MIN) | (VIEWER_SEND_AGGREGATE << HISTORY_RECORD_15MIN)))
+    {
+        aggregate_type = (viewer->pending & (VIEWER_SEND_AGGREGATE << HISTORY_RECORD_1MIN)) ? HISTORY_RECORD_1MIN : HISTORY_RECORD_15MIN;
+        metermsg_aggregate[aggregate_type][metermsg_aggregate_len[aggregate_type]] = 0;
+        ViewerSent(viewer, VIEWER_SEND_AGGREGATE << aggregate_type);
+        return viewerSendWs(viewer, metermsg_aggregate[aggregate_type]);
+    }
+    else if(viewer->pending & VIEWER_SEND_ELECTRICAL)
+    {
+        metermsg_electrical[metermsg_electrical_len] = 0;
+        ViewerSent(viewer, VIEWER_SEND_ELECTRICAL);
+        return viewerSendWs(viewer, metermsg_electrical);
+    }
+    else if(viewer->pending & VIEWER_SEND_INFOCONFIG)
+    {
+        metermsg_infoconfig[metermsg_infoconfig_len] = 0;
+        ViewerSent(viewer, VIEWER_SEND_INFOCONFIG);
+        return viewerSendWs(viewer, metermsg_infoconfig);
+    }
+    return 1;
+}
+
+// Viewers go after the sessions, with the same window but no control lane, and are
+// held back altogether while the heap is below half the reserve.
+static void WsViewersSend(void)
+{
+    static fpm_viewer_t *viewer;
+    if(fpm_viewers == NULL)
+    {
+        return;
+    }
+    if(esp_get_free_heap_size() < CONFIG_FPM_VIEWER_HEAP_RESERVE / 2)
     {
-        if(replace_fd)
+        viewer_stats.heap_hold++;
+        return;
+    }
+    viewer_persistent = NULL;
+    for(viewer = fpm_viewers; viewer != NULL; viewer = viewer->next)
+    {
+        while((viewer->started == true) && (viewer->closing == false) && (ViewerSendPending(viewer) == true))
         {
-            frame.type = HTTPD_WS_TYPE_TEXT;
-            frame.payload = (uint8_t*)"&console#close";
-            frame.len = strlen((char*)frame.payload);
-            if(httpd_ws_send_data(server, replace_fd, &frame) == ESP_OK)
+            if(ViewerInFlight(viewer) >= WS_SEND_WINDOW)
+            {
+                ws_stats.window_full++;
+                break;
+            }
+            if(ClientSocketWritable(viewer->fd) == false)
+            {
+                ws_stats.not_writable++;
+                break;
+            }
+            if(ViewerSendNext(viewer) == false)
             {
-                ESP_LOGI(TAG, "Client %d ui <- %s", replace_fd, frame.payload);
-                replace_fd = 0;
+                ESP_LOGI(TAG, "Viewer fd = %d send failed", viewer->fd);
+                ViewerClose(viewer);
+                break;
             }
-            target_send_ui_text_message_delay = SLOW_SEND_UI_TEXT_MESSAGE_DELAY;       
-            send_ui_textmessages_timestamp = xTaskGetTickCount();
         }
-        else if((fpm_wsockets[fpm_wsockets_idx].fd != 0) && (fpm_wsockets[fpm_wsockets_idx].expecting_response == false))
+    }
+}
+
+static bool ClientSendControl(fpm_wsockets_t *xclient)
+{
+    if(clientSendWs(xclient, fpm_msgpool_text(xclient->textmessage_out_priority[xclient->textmessage_out_priority_idx_read])) == 0)
+    {
+        return false;
+    }
+    ClientReplayKeep(xclient, xclient->textmessage_out_priority[xclient->textmessage_out_priority_idx_read], 0);
+    fpm_msgpool_release(xclient->textmessage_out_priority[xclient->textmessage_out_priority_idx_read]);
+    xclient->textmessage_out_priority[xclient->textmessage_out_priority_idx_read] = NULL;
+    xclient->textmessage_out_priority_idx_read++;
+    if(xclient->textmessage_out_priority_idx_read >= WS_CLIENT_PRIORITY_CNT)
+    {
+        xclient->textmessage_out_priority_idx_read = 0;
+    }
+    ws_stats.control_sent++;
+    return true;
+}
+
+// Up to WS_SEND_WINDOW messages per client are in flight, released by the cumulative
+// acks in ClientAckReceived. Sends are paced by the socket having room, not by a fixed
+// delay; the delay only still holds the bulk lane back after plain HTTP requests.
+// The control lane has strict priority and one window slot bulk may not take, so a
+// write response never waits behind meter frames; after WS_CONTROL_BURST control
+// messages in a row a pending bulk message gets a turn.
+void WsClientsSend_AppendCntID(void)
+{
+    static httpd_ws_frame_t frame;
+    static fpm_wsockets_t *xclient;
+    static uint8_t i;
+    static bool bulk_hold;
+    static bool control;
+    static bool bulk;
+    WsClientsSendAlarms();
+    bulk_hold = (xTaskGetTickCount() - send_ui_textmessages_timestamp < target_send_ui_text_message_delay);
+    if((replace_fd) && (bulk_hold == false))
+    {
+        frame.type = HTTPD_WS_TYPE_TEXT;
+        frame.payload = (uint8_t*)"&console#close";
+        frame.len = strlen((char*)frame.payload);
+        if(httpd_ws_send_data(server, replace_fd, &frame) == ESP_OK)
+        {
+            ESP_LOGI(TAG, "Client %d ui <- %s", replace_fd, frame.payload);
+            replace_fd = 0;
+        }
+        target_send_ui_text_message_delay = SLOW_SEND_UI_TEXT_MESSAGE_DELAY;       
+        send_ui_textmessages_timestamp = xTaskGetTickCount();
+        return;
+    }
+    for(i = 0; i < MAX_WS_CLIENTS; i++)
+    {
+        // the starting client rotates so no one always goes first
+        xclient = &fpm_wsockets[(fpm_wsockets_idx + i) % MAX_WS_CLIENTS];
+        // a reattached session sends nothing before its resume has renumbered the stream
+        while((xclient->fd != 0) && (xclient->resume_attached == false))
         {
-            if((xTaskGetTickCount() - fpm_wsockets[fpm_wsockets_idx].time_persistent_timestamp >= ONESECOND_TIME_PERSISTENT_PERIOD) && (fpm_wsockets[fpm_wsockets_idx].ws_startup_init_done == 1))
+            control = (xclient->textmessage_out_priority_idx_read != xclient->textmessage_out_priority_idx_write);
+            bulk = (bulk_hold == false) && (ClientSendPending(xclient) == true)
+                && (ClientInFlight(xclient) < WS_SEND_WINDOW - WS_CONTROL_RESERVE);
+            if((control == false) && (bulk == false))
             {
-                if(clientSendWs(&fpm_wsockets[fpm_wsockets_idx], build_persistent_str()) == 1)
+                if((bulk_hold == false) && (ClientSendPending(xclient) == true))
                 {
-                    fpm_wsockets[fpm_wsockets_idx].time_persistent_timestamp = xTaskGetTickCount();
+                    ws_stats.window_full++;
                 }
-                target_send_ui_text_message_delay = SLOW_SEND_UI_TEXT_MESSAGE_DELAY;
-                send_ui_textmessages_timestamp = xTaskGetTickCount();
+                break;
+            }
+            if((control == true) && (ClientInFlight(xclient) >= WS_SEND_WINDOW))
+            {
+                ws_stats.window_full++;
+                break;
+            }
+            if(ClientSocketWritable(xclient->fd) == false)
+            {
+                ws_stats.not_writable++;
+                break;
             }
-            else if(fpm_wsockets[fpm_wsockets_idx].textmessage_out_idx_read != fpm_wsockets[fpm_wsockets_idx].textmessage_out_idx_write)
+            if((control == true) && ((bulk == false) || (xclient->priority_run < WS_CONTROL_BURST)))
             {
-                if(clientSendWs(&fpm_wsockets[fpm_wsockets_idx], fpm_wsockets[fpm_wsockets_idx].textmessage_out[fpm_wsockets[fpm_wsockets_idx].textmessage_out_idx_read]) == 1)
+                if(ClientSendControl(xclient) == false)
                 {
-                    fpm_wsockets[fpm_wsockets_idx].textmessage_out_idx_read++;
-                    if(fpm_wsockets[fpm_wsockets_idx].textmessage_out_idx_read >= WS_CLIENT_TXTMSG_BFFR_CNT)
-                    {
-                        fpm_wsockets[fpm_wsockets_idx].textmessage_out_idx_read = 0;
-                    }
+                    break;
                 }
-                target_send_ui_text_message_delay = SLOW_SEND_UI_TEXT_MESSAGE_DELAY;
-                send_ui_textmessages_timestamp = xTaskGetTickCount();
+                xclient->priority_run += (bulk == true) ? 1 : 0;
             }
-            else if((fpm_wsockets[fpm_wsockets_idx].send_meter_infoconfig == true) || (fpm_wsockets[fpm_wsockets_idx].send_meter_electrical == true))
-            {   
-                if(fpm_wsockets[fpm_wsockets_idx].send_meter_electrical == true)
+            else
+            {
+                if(ClientSendNext(xclient) == false)
                 {
-                    metermsg_electrical[metermsg_electrical_len] = 0;
-                    if(clientSendWs(&fpm_wsockets[fpm_wsockets_idx], metermsg_electrical) == 1)
-                    {
-                        fpm_wsockets[fpm_wsockets_idx].send_meter_electrical = false;
-                    }
+                    break;
                 }
-                else if(fpm_wsockets[fpm_wsockets_idx].send_meter_infoconfig == true)
+                if(control == true)
                 {
-                    metermsg_infoconfig[metermsg_infoconfig_len] = 0;
-                    if(clientSendWs(&fpm_wsockets[fpm_wsockets_idx], metermsg_infoconfig) == 1)
-                    {
-                        fpm_wsockets[fpm_wsockets_idx].send_meter_infoconfig = false;
-                    }
+                    ws_stats.bulk_turns++;
                 }
-                target_send_ui_text_message_delay = SLOW_SEND_UI_TEXT_MESSAGE_DELAY;
-                send_ui_textmessages_timestamp = xTaskGetTickCount();
-            }     
+                xclient->priority_run = 0;
+            }
         }
-        fpm_wsockets_idx++;
-        if(fpm_wsockets_idx >= MAX_WS_CLIENTS)
-        {
-            fpm_wsockets_idx = 0;
-        }       
+        ClientBatchFlush(xclient);
+    }
+    if(bulk_hold == false)
+    {
+        WsViewersSend();
+    }
+    fpm_wsockets_idx++;
+    if(fpm_wsockets_idx >= MAX_WS_CLIENTS)
+    {
+        fpm_wsockets_idx = 0;
     }
 }
 
@@ -2094,6 +4276,13 @@ void init_fpm_swsockets(void)
     settings_file_json("/data/uriidx", "idx", uri_idx_str, READ_SETTING);
     uri_idx_int = (uint8_t)atol(uri_idx_str);
 
+    // one key and URI shared by all viewers, new at every start
+    ViewerKeyNew();
+    sprintf(viewer_ws_uri, "/ws%s", viewer_key_str);
+    sprintf(viewer_limit_str, "%d", CONFIG_FPM_VIEWER_MAX);
+    settings_file_json("/data/viewerlimit.json", "limit", viewer_limit_str, READ_SETTING);
+    viewer_limit = MIN((uint16_t)atol(viewer_limit_str), CONFIG_FPM_VIEWER_MAX);
+
     settings_file_json("/data/ethen.json", "ethen", ethen, READ_SETTING);
     settings_file_json("/data/wifiappsw.json", "wifiappsw", wifiappsw, READ_SETTING);
     if(strcmp(ethen, "No") == 0)
@@ -2148,8 +4337,15 @@ static esp_err_t _ws_handler(httpd_req_t *req)
     async_now = ASYNC_BUSY;
     ret = ws_handler(req);
     async_now = ASYNC_IDLE;
-    target_send_ui_text_message_delay = FAST_SEND_UI_TEXT_MESSAGE_DELAY;
-    send_ui_textmessages_timestamp = xTaskGetTickCount();
+    return ret;
+}
+
+static esp_err_t _viewer_ws_handler(httpd_req_t *req)
+{
+    static esp_err_t ret;
+    async_now = ASYNC_BUSY;
+    ret = viewer_ws_handler(req);
+    async_now = ASYNC_IDLE;
     return ret;
 }
 
@@ -2179,6 +4375,58 @@ static esp_err_t _custommsg_handler(httpd_req_t *req)
     return ret;
 }
 
+static esp_err_t _trend_handler(httpd_req_t *req)
+{
+    static esp_err_t ret;
+    async_now = ASYNC_BUSY;
+    register_new_socket(req);
+    ret = trend_handler(req);
+    remove_socket(req);
+    async_now = ASYNC_IDLE;
+    target_send_ui_text_message_delay = FAST_SEND_UI_TEXT_MESSAGE_DELAY;
+    send_ui_textmessages_timestamp = xTaskGetTickCount();
+    return ret;
+}
+
+static esp_err_t _history_handler(httpd_req_t *req)
+{
+    static esp_err_t ret;
+    async_now = ASYNC_BUSY;
+    register_new_socket(req);
+    ret = history_handler(req);
+    remove_socket(req);
+    async_now = ASYNC_IDLE;
+    target_send_ui_text_message_delay = FAST_SEND_UI_TEXT_MESSAGE_DELAY;
+    send_ui_textmessages_timestamp = xTaskGetTickCount();
+    return ret;
+}
+
+static esp_err_t _historyq_handler(httpd_req_t *req)
+{
+    static esp_err_t ret;
+    async_now = ASYNC_BUSY;
+    register_new_socket(req);
+    ret = historyq_handler(req);
+    remove_socket(req);
+    async_now = ASYNC_IDLE;
+    target_send_ui_text_message_delay = FAST_SEND_UI_TEXT_MESSAGE_DELAY;
+    send_ui_textmessages_timestamp = xTaskGetTickCount();
+    return ret;
+}
+
+static esp_err_t _energy_handler(httpd_req_t *req)
+{
+    static esp_err_t ret;
+    async_now = ASYNC_BUSY;
+    register_new_socket(req);
+    ret = energy_handler(req);
+    remove_socket(req);
+    async_now = ASYNC_IDLE;
+    target_send_ui_text_message_delay = FAST_SEND_UI_TEXT_MESSAGE_DELAY;
+    send_ui_textmessages_timestamp = xTaskGetTickCount();
+    return ret;
+}
+
 static esp_err_t _bootupdate_handler(httpd_req_t *req)
 {
     static esp_err_t ret;
@@ -2264,6 +4512,34 @@ esp_err_t WebServerStart(void)
     custommsg.handler    = _custommsg_handler;
     custommsg.user_ctx   = server_data;
     httpd_register_uri_handler(server, &custommsg);
+
+    static httpd_uri_t trend;
+    trend.uri        = uri_trend;
+    trend.method     = HTTP_GET;
+    trend.handler    = _trend_handler;
+    trend.user_ctx   = server_data;
+    httpd_register_uri_handler(server, &trend);
+
+    static httpd_uri_t history;
+    history.uri        = uri_history;
+    history.method     = HTTP_GET;
+    history.handler    = _history_handler;
+    history.user_ctx   = server_data;
+    httpd_register_uri_handler(server, &history);
+
+    static httpd_uri_t historyq;
+    historyq.uri        = uri_historyq;
+    historyq.method     = HTTP_GET;
+    historyq.handler    = _historyq_handler;
+    historyq.user_ctx   = server_data;
+    httpd_register_uri_handler(server, &historyq);
+
+    static httpd_uri_t energy;
+    energy.uri        = uri_energy;
+    energy.method     = HTTP_GET;
+    energy.handler    = _energy_handler;
+    energy.user_ctx   = server_data;
+    httpd_register_uri_handler(server, &energy);
     
     static httpd_uri_t bootupdate;
     bootupdate.uri       = uri_bootupdate;
@@ -2289,5 +4565,23 @@ esp_err_t WebServerStart(void)
         ws[i].handle_ws_control_frames = true;
         httpd_register_uri_handler(server, &ws[i]);
     }
+
+    static httpd_uri_t boot_ws;
+    boot_ws.uri        = uri_wsboot;
+    boot_ws.method     = HTTP_GET;
+    boot_ws.handler    = _ws_handler;
+    // frames carry no URI, the handler context tells the boot socket apart
+    boot_ws.user_ctx   = (void*)uri_wsboot;
+    boot_ws.is_websocket = true;
+    boot_ws.handle_ws_control_frames = true;
+    httpd_register_uri_handler(server, &boot_ws);
+
+    viewer_ws.uri        = viewer_ws_uri;
+    viewer_ws.method     = HTTP_GET;
+    viewer_ws.handler    = _viewer_ws_handler;
+    viewer_ws.user_ctx   = NULL;
+    viewer_ws.is_websocket = true;
+    viewer_ws.handle_ws_control_frames = true;
+    httpd_register_uri_handler(server, &viewer_ws);
     return ESP_OK;
 }
\ No newline at end of file
@@ -18,6 +18,10 @@ void app_main(void)
     esp_log_level_set("*", ESP_LOG_NONE); 
     esp_log_level_set("WEB", ESP_LOG_INFO); 
     spiffs(); 
+    fpm_tscodec_selftest();
+    fpm_history_init();
+    fpm_energy_init();
+    fpm_alarm_init();
     ESP_ERROR_CHECK(esp_netif_init());
     ESP_ERROR_CHECK(esp_event_loop_create_default());
     init_fpm_swsockets();
@@ -26,7 +30,10 @@ void app_main(void)
     while(fpm_modbus_read_jSON("&console#inform=", metermsg_infoconfig, &metermsg_infoconfig_len) != MODBUSREAD_JSON_READY){vTaskDelay(pdMS_TO_TICKS(2));}
     init_fpm_modbus(WAGO_SET_ELEC);
     while(fpm_modbus_read_jSON("&console#rdmeter=", metermsg_electrical, &metermsg_electrical_len) != MODBUSREAD_JSON_READY){vTaskDelay(pdMS_TO_TICKS(2));}
-    sensor_timestamp = xTaskGetTickCount(); 
+    sensor_timestamp = xTaskGetTickCount();
+#ifdef CONFIG_FPM_MBSLAVE_ENABLE
+    start_mbslave_uart_task();
+#endif
     wifiap();
     strcpy(ethernet_status_msg, "Not Connected");
     if(strcmp(ethen, "Yes") == 0)
@@ -52,6 +59,6 @@ void app_main(void)
             CleanSockets_IdleWsClients();
         }
         WsClientsAutoMsg();
-        vTaskDelay(pdMS_TO_TICKS(25));
+        vTaskDelay(pdMS_TO_TICKS(fpm_acquisition_loop_delay(25)));
     }
 }
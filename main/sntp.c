@@ -19,9 +19,12 @@
 
 static const char *TAG = "SNTP";
 
+bool sntp_time_valid = false;
+
 void time_sync_notification_cb(struct timeval *tv)
 {
     ESP_LOGI(TAG, "Notification of a time synchronization event");
+    sntp_time_valid = true;
 }
 
 static void print_servers(void)
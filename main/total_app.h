@@ -15,14 +15,68 @@
 #define ASYNC_IDLE 0
 #define ASYNC_BUSY 1
 
+#define AUTHENTICATED_FALSE 0
+#define AUTHENTICATED_TRUE 1
+
 #define APP_SOCKET_ALLOCATION (7)
 #define SIMULTANEOUS_CLIENTS 2
 #define MAX_WS_CLIENTS (SIMULTANEOUS_CLIENTS + 1)
 #define APP_ASSOC_SOCKET_ALLOCATION 10
 #define WS_URI_ALLOCATION (MAX_WS_CLIENTS * 2)
 
-#define WS_CLIENT_TXTMSG_BFFR_CNT 18
-#define WS_CLIENT_TXTMSG_BFFR_SIZE_450 450
+#define WS_CLIENT_TXTMSG_BFFR_CNT 32
+#define WS_CLIENT_PRIORITY_CNT 8
+#define WS_SEND_WINDOW 4
+#define WS_MSG_CNTID_RESERVE 16
+// rdmeter subscription bitmap, one bit per descriptor index
+#define WS_SUB_WORDS 5
+#define WS_SUB_CIDS (WS_SUB_WORDS * 32)
+
+#define MSGPOOL_SMALL_SIZE 128
+#define MSGPOOL_SMALL_COUNT 48
+#define MSGPOOL_MEDIUM_SIZE 512
+#define MSGPOOL_MEDIUM_COUNT 24
+#define MSGPOOL_LARGE_SIZE 2048
+#define MSGPOOL_LARGE_COUNT 4
+#define MSGPOOL_CLASS_COUNT 3
+
+#define TREND_CHANNEL_COUNT 12
+#define TREND_BLOB_VERSION 1
+#define TREND_FLAG_UTC 0x8000
+#define TREND_BLOCK_SIZE 512
+
+#define TSCODEC_MAX_FIELDS 16
+
+#define HISTORY_RECORD_1MIN 0
+#define HISTORY_RECORD_15MIN 1
+#define HISTORY_RECORD_TYPE_COUNT 2
+#define HISTORY_BLOB_VERSION 1
+
+#define DOWNSAMPLE_MAX_POINTS 500
+
+#define AGGREGATE_MAX_CIDS 160
+#define AGGREGATE_MSG_SIZE 6144
+
+#define BURST_MAX_PRE 10
+#define BURST_MAX_POST 100
+#define BURST_MSG_SIZE 8192
+
+#define DERIVED_DEMAND_SLOTS 60
+#define DERIVED_FLAG_VOLTAGE 0x01
+#define DERIVED_FLAG_CURRENT 0x02
+#define DERIVED_FLAG_LOADING 0x04
+#define DERIVED_FLAG_DEMAND 0x08
+#define DERIVED_FLAG_DEMAND_MAX 0x10
+
+#define ENERGY_PERIOD_HOUR 0
+#define ENERGY_PERIOD_DAY 1
+#define ENERGY_PERIOD_MONTH 2
+#define ENERGY_PERIOD_COUNT 3
+#define ENERGY_COUNTER_COUNT 8
+#define ENERGY_FLAG_PARTIAL 0x01
+#define ENERGY_FLAG_LATE 0x02
+#define ENERGY_FLAG_RESET 0x04
+#define ENERGY_FLAG_OPEN 0x08
 
 #define MODBUS_READ 0
 #define MODBUS_WRITE 1
@@ -37,8 +91,8 @@
         .task_caps          = (MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT),       \
         .server_port        = 80,                       \
         .ctrl_port          = ESP_HTTPD_DEF_CTRL_PORT,  \
-        .max_open_sockets   = 7,                        \
-        .max_uri_handlers   = 13,                        \
+        .max_open_sockets   = (7 + CONFIG_FPM_VIEWER_MAX),  \
+        .max_uri_handlers   = 19,                        \
         .max_resp_headers   = 8,                        \
         .backlog_conn       = 5,                        \
         .lru_purge_enable   = false,                    \
@@ -81,6 +135,21 @@ typedef enum
     MODBUSREAD_JSON_UARTFREE
 }_enum_fpm_modbus_read;
 
+typedef enum
+{
+    MODBUSBLOCK_BUSY,
+    MODBUSBLOCK_OK,
+    MODBUSBLOCK_FAIL
+}_enum_fpm_modbus_block;
+
+typedef enum
+{
+    WS_STATE_SETTING,
+    WS_STATE_WRMETER,
+    WS_STATE_INFOR,
+    WS_STATE_COUNT
+}_enum_ws_state_slot;
+
 typedef enum
 {
     MODBUSWRITE_DEFAULT,
@@ -92,6 +161,333 @@ typedef enum
     MODBUSWRITE_OK
 }_enum_fpm_modbus_write;
 
+typedef enum
+{
+    SAMPLE_QUALITY_GOOD,
+    SAMPLE_QUALITY_STALE,
+    SAMPLE_QUALITY_TIMEOUT,
+    SAMPLE_QUALITY_CRC,
+    SAMPLE_QUALITY_EXCEPTION
+}_enum_fpm_sample_quality;
+
+typedef struct
+{
+    int64_t mono_us;
+    uint32_t utc_sec;
+    uint16_t utc_ms;
+    uint8_t quality;
+    uint8_t exception_code;
+}fpm_sample_meta_t;
+
+typedef struct
+{
+    uint32_t time_sec;
+    uint16_t time_ms;
+    uint16_t quality_mask;
+    int16_t value[TREND_CHANNEL_COUNT];
+}fpm_trend_record_t;
+
+typedef struct
+{
+    uint8_t *buf;
+    uint32_t bitpos;
+    uint64_t prev_time;
+    int64_t prev_delta;
+    uint16_t size;
+    uint16_t count;
+    uint16_t prev_mask;
+    uint8_t nfields;
+    int16_t prev[TSCODEC_MAX_FIELDS];
+}fpm_tscodec_enc_t;
+
+typedef struct
+{
+    const uint8_t *buf;
+    uint32_t bitpos;
+    uint64_t prev_time;
+    int64_t prev_delta;
+    uint16_t remaining;
+    uint16_t prev_mask;
+    uint8_t nfields;
+    bool first;
+    int16_t prev[TSCODEC_MAX_FIELDS];
+}fpm_tscodec_dec_t;
+
+typedef struct
+{
+    uint32_t records;
+    uint32_t raw_bytes;
+    uint32_t encoded_bytes;
+    uint64_t encode_us;
+    uint32_t decoded_bytes;
+    uint64_t decode_us;
+}fpm_tscodec_stats_t;
+
+typedef struct
+{
+    uint32_t block_no;
+    uint32_t seq;
+    uint32_t seq_end;
+    fpm_tscodec_dec_t dec;
+    uint8_t data[TREND_BLOCK_SIZE];
+}fpm_trend_iter_t;
+
+typedef struct
+{
+    uint32_t time_sec;
+    uint16_t samples;
+    uint16_t quality_mask;
+    uint8_t type;
+    uint8_t reserved;
+    int16_t value[TREND_CHANNEL_COUNT];
+    uint16_t crc;
+}fpm_history_record_t;
+
+typedef struct
+{
+    uint32_t from_time;
+    uint32_t to_time;
+    uint32_t sector_seq;
+    uint16_t sector;
+    uint16_t offset;
+    uint8_t pending_idx;
+    uint8_t type;
+    bool in_pending;
+    fpm_tscodec_dec_t dec;
+}fpm_history_iter_t;
+
+typedef enum
+{
+    DOWNSAMPLE_SOURCE_TREND,
+    DOWNSAMPLE_SOURCE_1MIN,
+    DOWNSAMPLE_SOURCE_15MIN
+}_enum_fpm_downsample_source;
+
+typedef enum
+{
+    DOWNSAMPLE_MODE_LTTB,
+    DOWNSAMPLE_MODE_MINMAX
+}_enum_fpm_downsample_mode;
+
+typedef struct
+{
+    uint32_t from_time;
+    uint32_t to_time;
+    uint16_t points;
+    uint8_t source;
+    uint8_t mode;
+    uint8_t channel;
+}fpm_downsample_query_t;
+
+typedef struct
+{
+    uint64_t time_ms;
+    float avg;
+    uint16_t count;
+    int16_t value;
+    int16_t min;
+    int16_t max;
+}fpm_downsample_point_t;
+
+typedef bool (*fpm_downsample_emit_t)(void *ctx, const fpm_downsample_point_t *point);
+
+typedef struct
+{
+    uint32_t queries;
+    uint32_t scanned;
+    uint32_t emitted;
+    uint32_t run_us_last;
+    uint32_t run_us_max;
+}fpm_downsample_stats_t;
+
+typedef struct
+{
+    uint32_t sweeps;
+    uint32_t sweep_us_last;
+    uint32_t sweep_us_max;
+    uint64_t sweep_us_total;
+    uint32_t closed;
+    uint32_t close_us_last;
+    uint32_t close_us_max;
+}fpm_aggregate_stats_t;
+
+typedef struct
+{
+    float voltage_unbalance;
+    float current_unbalance;
+    float neutral_current;
+    float loading[3];
+    float demand;
+    float demand_max;
+    int64_t demand_max_mono_us;
+    uint64_t demand_max_utc_ms;
+    uint8_t flags;
+    uint8_t flags_held;
+}fpm_derived_t;
+
+// Consumption of one hour, day or month: counter deltas between the snapshots taken at
+// its two boundaries. Stored as is in the SPIFFS record files.
+typedef struct
+{
+    uint32_t key;
+    uint32_t start_time;
+    uint32_t end_time;
+    float delta[ENERGY_COUNTER_COUNT];
+    uint8_t type;
+    uint8_t flags;
+    uint16_t crc;
+}fpm_energy_record_t;
+
+typedef bool (*fpm_energy_emit_t)(void *ctx, const fpm_energy_record_t *record);
+
+typedef struct
+{
+    uint32_t records_written;
+    uint32_t state_writes;
+    uint32_t queries;
+}fpm_energy_stats_t;
+
+typedef struct
+{
+    uint32_t evaluations;
+    uint32_t events;
+    uint32_t rejected;
+    uint32_t eval_us_last;
+    uint32_t eval_us_max;
+}fpm_alarm_stats_t;
+
+// Pooled websocket message; broadcasts are stored once and referenced from every
+// client queue they are in.
+typedef struct
+{
+    char *data;
+    uint16_t len;
+    uint8_t cls;
+    uint8_t refs;
+}fpm_msg_t;
+
+typedef struct
+{
+    uint32_t allocs;
+    uint32_t exhausted;
+    uint32_t oversize;
+    uint32_t que_full;
+    uint8_t class_peak[MSGPOOL_CLASS_COUNT];
+}fpm_msgpool_stats_t;
+
+typedef struct
+{
+    uint32_t sent;
+    uint32_t acks;
+    uint32_t legacy_acks;
+    uint32_t window_full;
+    uint32_t not_writable;
+    uint32_t conflated;
+    uint32_t control_sent;
+    uint32_t bulk_turns;
+    uint32_t sub_full;
+    uint32_t sub_partial;
+    uint32_t sub_skipped;
+    uint32_t sub_saved;
+    uint32_t rate_skipped;
+    uint32_t parked;
+    uint32_t resumed;
+    uint32_t resume_refused;
+    uint32_t replayed;
+    uint32_t batches;
+    uint32_t batched;
+    uint32_t boots;
+    uint32_t boot_refused;
+    uint32_t ttfr_login;
+    uint32_t ttfr_boot;
+    uint8_t inflight_max;
+}fpm_ws_stats_t;
+
+typedef struct
+{
+    uint16_t active;
+    uint16_t peak;
+    uint32_t admitted;
+    uint32_t refused_limit;
+    uint32_t refused_heap;
+    uint32_t dropped;
+    uint32_t sent;
+    uint32_t heap_hold;
+}fpm_viewer_stats_t;
+
+typedef struct
+{
+    uint32_t triggers;
+    uint32_t events;
+    uint32_t reads;
+    uint32_t failed;
+    uint32_t samples;
+    uint32_t dropped;
+    uint16_t last_samples;
+    uint32_t last_rate;
+}fpm_burst_stats_t;
+
+typedef struct
+{
+    uint32_t appended;
+    uint32_t flushes;
+    uint32_t flushed_records;
+    uint32_t flash_writes;
+    uint32_t flush_us_last;
+    uint32_t flush_us_max;
+    uint64_t flush_us_total;
+    uint32_t erases;
+    uint32_t erase_us_max;
+    uint32_t queries;
+    uint32_t seek_us_last;
+    uint32_t seek_us_max;
+    uint32_t records_read;
+    uint32_t crc_errors;
+    fpm_tscodec_stats_t codec;
+}fpm_history_stats_t;
+
+typedef enum
+{
+    ARBITER_STEP_BUSY,
+    ARBITER_STEP_YIELD,
+    ARBITER_STEP_DONE
+}_enum_fpm_arbiter_step;
+
+typedef enum
+{
+    ARBITER_CLASS_POLL,
+    ARBITER_CLASS_WRITE,
+    ARBITER_CLASS_BURST,
+    ARBITER_CLASS_COUNT
+}_enum_fpm_arbiter_class;
+
+typedef _enum_fpm_arbiter_step (*fpm_arbiter_step_fn)(void *ctx);
+typedef void (*fpm_arbiter_done_fn)(void *ctx);
+
+typedef struct
+{
+    uint32_t submitted;
+    uint32_t completed;
+    uint32_t missed;
+    uint32_t starved;
+    uint32_t rejected;
+    uint32_t max_latency;
+}fpm_arbiter_stats_t;
+
+typedef struct
+{
+    bool aligned;
+    uint32_t samples;
+    uint32_t jitter_last;
+    uint32_t jitter_max;
+    uint64_t jitter_sum;
+    uint32_t sweep_last;
+    uint32_t sweep_max;
+    uint32_t overruns;
+    uint32_t skipped;
+    uint32_t realigned;
+}fpm_acquisition_stats_t;
+
 typedef struct
 {
     httpd_handle_t *handle;
@@ -112,21 +508,59 @@ typedef struct
     uint8_t setting_confirm_get;
     uint8_t infor_confirm_get;
     uint8_t inform_confirm_get;
-    bool expecting_response;
-    char *textmessage_out_priority;
-    char textmessage_out[WS_CLIENT_TXTMSG_BFFR_CNT][WS_CLIENT_TXTMSG_BFFR_SIZE_450];
-    char textmessage_in[WS_CLIENT_TXTMSG_BFFR_CNT][WS_CLIENT_TXTMSG_BFFR_SIZE_450];
+    unsigned long textmessage_out_acked;
+    fpm_msg_t *textmessage_out_priority[WS_CLIENT_PRIORITY_CNT];
+    uint8_t textmessage_out_priority_idx_write;
+    uint8_t textmessage_out_priority_idx_read;
+    uint8_t priority_run;
+    fpm_msg_t *textmessage_out[WS_CLIENT_TXTMSG_BFFR_CNT];
+    fpm_msg_t *textmessage_in[WS_CLIENT_TXTMSG_BFFR_CNT];
+    fpm_msg_t *textmessage_state[WS_STATE_COUNT];
     uint8_t textmessage_in_idx_write;
     uint8_t textmessage_in_idx_read;
     uint8_t textmessage_out_idx_write;
     uint8_t textmessage_out_idx_read;
     bool send_meter_infoconfig;
     bool send_meter_electrical;
+    uint8_t send_meter_aggregate;
+    bool send_meter_burst;
+    uint8_t sub_mode;
+    uint32_t sub_mask[WS_SUB_WORDS];
+    uint32_t rate_interval;
+    uint32_t rate_timestamp;
+    fpm_msg_t *replay[WS_SEND_WINDOW];
+    uint8_t replay_refresh[WS_SEND_WINDOW];
+    bool parked;
+    bool resume_attached;
+    bool batch;
+    bool boot_admitted;
+    uint8_t boot_key_idx;
+    uint32_t parked_timestamp;
+    uint32_t parked_state_gen;
+    uint32_t alarm_seq;
     uint8_t pending_close;
     uint64_t entry_number;
     uint32_t time_persistent_timestamp;
 }fpm_wsockets_t;
 
+// Read-only dashboard: no queues of its own, it is sent the shared meter buffers
+// straight from the sweep, so a connection costs this struct and its socket.
+typedef struct fpm_viewer_s
+{
+    struct fpm_viewer_s *next;
+    int fd;
+    unsigned long out_cntid;
+    unsigned long out_acked;
+    uint32_t in_time_stamp;
+    uint32_t persistent_timestamp;
+    uint32_t alarm_seq;
+    uint32_t rate_interval;
+    uint32_t rate_timestamp;
+    uint8_t pending;
+    bool started;
+    bool closing;
+}fpm_viewer_t;
+
 typedef struct
 {
     int fd;
@@ -185,9 +619,99 @@ esp_err_t esp_ota_begin_spiffs(const esp_partition_t *partition, size_t image_si
 extern void ota_boot_init(void);
 extern void ota_spiffs_init(void);
 extern bool AsyncClientProcess(void);
+extern bool ViewersWatching(void);
 extern void modbus_restart_cid(void);
+extern uint8_t fpm_modbus_cached_register(uint16_t reg_address, uint16_t *value);
+extern bool fpm_modbus_get_sample(uint16_t reg_address, float *value, fpm_sample_meta_t *meta);
+extern uint16_t fpm_modbus_sample_vector(float *values, uint8_t *quality, uint16_t *reg_address, uint16_t max);
+extern int16_t fpm_modbus_sample_index(uint16_t reg_address);
+extern bool fpm_modbus_sample_at(uint16_t sample_cid, float *value, uint8_t *quality);
+extern int64_t fpm_modbus_sample_time(uint16_t sample_cid);
+extern bool fpm_modbus_cid_listed(uint16_t sample_cid, uint16_t *reg_address);
+extern void fpm_aggregate_sample(void);
+extern char *fpm_aggregate_stats_json(void);
+extern fpm_aggregate_stats_t aggregate_stats;
+extern char metermsg_aggregate[HISTORY_RECORD_TYPE_COUNT][AGGREGATE_MSG_SIZE];
+extern uint16_t metermsg_aggregate_len[HISTORY_RECORD_TYPE_COUNT];
+extern void fpm_derived_sample(int64_t sweep_mono_us, uint64_t sweep_utc_ms);
+extern void fpm_derived_json_add(cJSON *sensor_json_obj);
+extern fpm_derived_t derived;
+extern void fpm_energy_init(void);
+extern void fpm_energy_sample(void);
+extern uint32_t fpm_energy_key(uint8_t period, uint32_t utc);
+extern bool fpm_energy_current(uint8_t period, fpm_energy_record_t *record);
+extern uint16_t fpm_energy_query(uint8_t period, uint32_t from_time, uint32_t to_time, fpm_energy_emit_t emit, void *ctx);
+extern const char *fpm_energy_counter_name(uint8_t counter);
+extern const char *fpm_energy_period_name(uint8_t period);
+extern char *fpm_energy_stats_json(void);
+extern fpm_energy_stats_t energy_stats;
+extern void fpm_alarm_init(void);
+extern void fpm_alarm_evaluate(void);
+extern uint32_t fpm_alarm_seq_next(void);
+extern uint32_t fpm_alarm_seq_oldest(void);
+extern bool fpm_alarm_event_msg(uint32_t seq, char *buf, uint16_t size);
+extern char *fpm_alarm_stats_json(void);
+extern fpm_alarm_stats_t alarm_stats;
+extern fpm_msg_t *fpm_msgpool_alloc(const char *str);
+extern void fpm_msgpool_que_full(void);
+extern void fpm_msgpool_ref(fpm_msg_t *msg);
+extern void fpm_msgpool_release(fpm_msg_t *msg);
+extern char *fpm_msgpool_text(fpm_msg_t *msg);
+extern char *fpm_msgpool_stats_json(void);
+extern fpm_msgpool_stats_t msgpool_stats;
+extern _enum_fpm_modbus_block fpm_modbus_read_block(uint16_t start_address, uint16_t quantity, uint16_t *regs);
+extern void fpm_burst_sample(void);
+extern bool fpm_burst_active(void);
+extern char *fpm_burst_stats_json(void);
+extern fpm_burst_stats_t burst_stats;
+extern char metermsg_burst[BURST_MSG_SIZE];
+extern uint16_t metermsg_burst_len;
+extern void start_mbslave_uart_task(void);
+extern uint32_t mbslave_request_timestamp;
+extern uint32_t mbslave_request_count;
+extern int8_t fpm_arbiter_submit(_enum_fpm_arbiter_class txn_class, uint8_t priority, uint32_t deadline_ms, uint32_t step_deadline_ms, fpm_arbiter_step_fn step, fpm_arbiter_done_fn done, void *ctx);
+extern bool fpm_arbiter_pending(_enum_fpm_arbiter_class txn_class);
+extern void fpm_arbiter_process(void);
+extern char *fpm_arbiter_stats_json(void);
+extern fpm_arbiter_stats_t arbiter_stats[ARBITER_CLASS_COUNT];
+extern uint32_t fpm_acquisition_period(void);
+extern bool fpm_acquisition_full_rate(void);
+extern bool fpm_acquisition_due(bool busy);
+extern void fpm_acquisition_sample_started(void);
+extern void fpm_acquisition_sample_done(void);
+extern uint32_t fpm_acquisition_loop_delay(uint32_t loop_delay);
+extern char *fpm_acquisition_stats_json(void);
+extern fpm_acquisition_stats_t acquisition_stats;
+extern bool sntp_time_valid;
+extern const fpm_trend_record_t *fpm_trend_append(void);
+extern uint32_t fpm_trend_open(fpm_trend_iter_t *it);
+extern bool fpm_trend_next(fpm_trend_iter_t *it, fpm_trend_record_t *record);
+extern char *fpm_trend_stats_json(void);
+extern uint16_t fpm_trend_header(uint8_t *dst, uint16_t record_count);
+extern uint16_t fpm_trend_channel_desc(uint8_t *dst);
+extern const char *fpm_trend_channel_name(uint8_t channel);
+extern uint16_t fpm_trend_channel_scale(uint8_t channel);
+extern uint16_t fpm_trend_channel_register(uint8_t channel);
+extern int16_t fpm_trend_scale(float value, uint16_t scale);
+extern bool fpm_key_valid(uint32_t key);
+extern void fpm_history_init(void);
+extern void fpm_history_interval(uint8_t type, uint32_t end_time, uint16_t samples, uint16_t quality_mask, const int16_t *value);
+extern bool fpm_history_seek(fpm_history_iter_t *it, uint32_t from_time, uint32_t to_time, uint8_t type);
+extern bool fpm_history_next(fpm_history_iter_t *it, fpm_history_record_t *record);
+extern char *fpm_history_stats_json(void);
+extern uint16_t fpm_downsample_run(const fpm_downsample_query_t *query, fpm_downsample_emit_t emit, void *ctx);
+extern fpm_downsample_stats_t downsample_stats;
+extern void fpm_tscodec_enc_init(fpm_tscodec_enc_t *enc, uint8_t *buf, uint16_t size, uint8_t nfields);
+extern bool fpm_tscodec_enc_put(fpm_tscodec_enc_t *enc, uint64_t time, uint16_t mask, const int16_t *fields);
+extern uint16_t fpm_tscodec_enc_bytes(const fpm_tscodec_enc_t *enc);
+extern void fpm_tscodec_dec_init(fpm_tscodec_dec_t *dec, const uint8_t *buf, uint16_t count, uint8_t nfields);
+extern bool fpm_tscodec_dec_next(fpm_tscodec_dec_t *dec, uint64_t *time, uint16_t *mask, int16_t *fields);
+extern bool fpm_tscodec_selftest(void);
+extern void fpm_tscodec_stats_add(cJSON *stats_json_obj, const fpm_tscodec_stats_t *stats);
 
 extern void WsClientsProcessData(void);
+extern void SetAggregateSend(uint8_t type);
+extern void SetBurstSend(void);
 extern void WsClientsSend_AppendCntID(void);
 extern void WsClientsAuthenticationInit(void);
 extern void WsClientsAutoMsg(void);
@@ -0,0 +1,74 @@
+#include <stdio.h>
+#include <math.h>
+#include "total_app.h"
+
+// Per-sweep cost of fpm_aggregate_sample for BENCH_CIDS parameters over both intervals,
+// read from the same aggregate_stats the firmware reports in "aggrstats". Built twice by
+// the Makefile: once on the fused scalar loop and once through dsps_*_f32 (the host
+// dsp/dsps_math.h has the plain C bodies of the esp-dsp ANSI fallbacks, so that build
+// measures the six separate vector passes, not the ESP32 assembly).
+
+#define BENCH_CIDS 130
+#define BENCH_SWEEPS 200000
+
+bool sntp_time_valid = false;
+static uint32_t rng = 1;
+static float bench_value[BENCH_CIDS];
+
+static uint32_t bench_rand(void)
+{
+    rng = (rng * 1103515245u) + 12345u;
+    return rng >> 8;
+}
+
+// A meter table of BENCH_CIDS parameters drifting slowly, one in fifty not good.
+uint16_t fpm_modbus_sample_vector(float *values, uint8_t *quality, uint16_t *reg_address, uint16_t max)
+{
+    uint16_t i;
+    for(i = 0; (i < BENCH_CIDS) && (i < max); i++)
+    {
+        bench_value[i] += ((float)(bench_rand() % 201) - 100.0f) / 1000.0f;
+        values[i] = bench_value[i];
+        quality[i] = ((bench_rand() % 50) == 0) ? SAMPLE_QUALITY_STALE : SAMPLE_QUALITY_GOOD;
+        reg_address[i] = (uint16_t)(0x5000 + (i * 2));
+    }
+    return i;
+}
+
+void fpm_history_interval(uint8_t type, uint32_t end_time, uint16_t samples, uint16_t quality_mask, const int16_t *value){}
+uint16_t fpm_trend_channel_register(uint8_t channel){return (uint16_t)(0x5000 + (channel * 2));}
+uint16_t fpm_trend_channel_scale(uint8_t channel){return 10;}
+int16_t fpm_trend_scale(float value, uint16_t scale){return (int16_t)(value * scale);}
+void SetAggregateSend(uint8_t type){}
+
+int main(void)
+{
+    uint32_t i;
+    int64_t start;
+    int64_t stub_us;
+    for(i = 0; i < BENCH_CIDS; i++)
+    {
+        bench_value[i] = 230.0f + (float)i;
+    }
+    // the input stub alone, so its share can be taken off the sweep figure
+    start = esp_timer_get_time();
+    for(i = 0; i < BENCH_SWEEPS; i++)
+    {
+        static float x[AGGREGATE_MAX_CIDS];
+        static uint8_t q[AGGREGATE_MAX_CIDS];
+        static uint16_t r[AGGREGATE_MAX_CIDS];
+        fpm_modbus_sample_vector(x, q, r, AGGREGATE_MAX_CIDS);
+    }
+    stub_us = esp_timer_get_time() - start;
+    for(i = 0; i < BENCH_SWEEPS; i++)
+    {
+        fpm_aggregate_sample();
+    }
+    printf("%s path, %d CIDs x %d intervals, %u sweeps\n", AGGREGATE_BENCH_PATH, BENCH_CIDS, HISTORY_RECORD_TYPE_COUNT, aggregate_stats.sweeps);
+    printf("sweep avg %.3f us (input copy %.3f us, update %.3f us), max %u us\n",
+           (double)aggregate_stats.sweep_us_total / aggregate_stats.sweeps,
+           (double)stub_us / BENCH_SWEEPS,
+           ((double)aggregate_stats.sweep_us_total - (double)stub_us) / aggregate_stats.sweeps,
+           aggregate_stats.sweep_us_max);
+    return 0;
+}
@@ -0,0 +1,32 @@
+#pragma once
+#include "idf_shim.h"
+
+// Host stand-ins with the signatures of esp-dsp's dsps_add/sub/mul_f32 and the loop
+// bodies of their ANSI versions; only for test/host/aggregate_bench.
+
+static inline esp_err_t dsps_add_f32(const float *input1, const float *input2, float *output, int len, int step1, int step2, int step_out)
+{
+    for(int i = 0; i < len; i++)
+    {
+        output[i * step_out] = input1[i * step1] + input2[i * step2];
+    }
+    return ESP_OK;
+}
+
+static inline esp_err_t dsps_sub_f32(const float *input1, const float *input2, float *output, int len, int step1, int step2, int step_out)
+{
+    for(int i = 0; i < len; i++)
+    {
+        output[i * step_out] = input1[i * step1] - input2[i * step2];
+    }
+    return ESP_OK;
+}
+
+static inline esp_err_t dsps_mul_f32(const float *input1, const float *input2, float *output, int len, int step1, int step2, int step_out)
+{
+    for(int i = 0; i < len; i++)
+    {
+        output[i * step_out] = input1[i * step1] * input2[i * step2];
+    }
+    return ESP_OK;
+}
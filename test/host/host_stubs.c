@@ -0,0 +1,13 @@
+#include "total_app.h"
+
+// cJSON is an IDF component; the host programs only need the calls to link, so every
+// object is NULL and printing yields NULL, which the callers already handle.
+cJSON *cJSON_CreateObject(void){return NULL;}
+cJSON *cJSON_CreateArray(void){return NULL;}
+cJSON *cJSON_CreateNumber(double num){return NULL;}
+cJSON *cJSON_CreateBool(int boolean){return NULL;}
+void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item){}
+void cJSON_AddItemToArray(cJSON *array, cJSON *item){}
+char *cJSON_Print(const cJSON *item){return NULL;}
+char *cJSON_PrintUnformatted(const cJSON *item){return NULL;}
+void cJSON_Delete(cJSON *item){}
@@ -0,0 +1,37 @@
+#pragma once
+// Just enough of the ESP-IDF types for total_app.h and the platform-free modules to
+// compile on a host. Nothing here is linked into the firmware.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef int esp_err_t;
+#define ESP_OK 0
+typedef void *httpd_handle_t;
+typedef struct httpd_req httpd_req_t;
+typedef uint32_t esp_ota_handle_t;
+typedef struct esp_partition esp_partition_t;
+
+typedef struct cJSON cJSON;
+cJSON *cJSON_CreateObject(void);
+cJSON *cJSON_CreateArray(void);
+cJSON *cJSON_CreateNumber(double num);
+cJSON *cJSON_CreateBool(int boolean);
+void cJSON_AddItemToObject(cJSON *object, const char *string, cJSON *item);
+void cJSON_AddItemToArray(cJSON *array, cJSON *item);
+char *cJSON_Print(const cJSON *item);
+char *cJSON_PrintUnformatted(const cJSON *item);
+void cJSON_Delete(cJSON *item);
+
+#define ESP_LOGI(tag, format, ...) do{}while(0)
+#define ESP_LOGW(tag, format, ...) do{}while(0)
+#define ESP_LOGE(tag, format, ...) do{}while(0)
+
+static inline int64_t esp_timer_get_time(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((int64_t)ts.tv_sec * 1000000) + (ts.tv_nsec / 1000);
+}
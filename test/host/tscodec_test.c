@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "total_app.h"
+
+// Host round trip and throughput of main/fpm_tscodec.c on trend shaped data: 12 scaled
+// channels, 1 s sweeps in ms with a few ms of jitter, slow random walk values. Blocks
+// are TREND_BLOCK_SIZE like the RAM ring; a refused record opens the next block.
+
+#define TEST_RECORDS 200000
+#define TEST_BLOCKS_MAX 20000
+#define TEST_FIELDS TREND_CHANNEL_COUNT
+
+typedef struct
+{
+    uint64_t time;
+    uint16_t mask;
+    int16_t fields[TEST_FIELDS];
+}test_record_t;
+
+typedef struct
+{
+    uint8_t buf[TREND_BLOCK_SIZE];
+    uint32_t first;
+    uint16_t count;
+    uint16_t bytes;
+}test_block_t;
+
+static test_record_t records[TEST_RECORDS];
+static test_block_t blocks[TEST_BLOCKS_MAX];
+static uint32_t block_count;
+static uint32_t rng = 1;
+
+static uint32_t test_rand(void)
+{
+    rng = (rng * 1103515245u) + 12345u;
+    return rng >> 8;
+}
+
+static void make_records(void)
+{
+    uint64_t time = 1000;
+    uint32_t i;
+    uint8_t ch;
+    for(ch = 0; ch < TEST_FIELDS; ch++)
+    {
+        records[0].fields[ch] = (int16_t)(2300 + (ch * 100));
+    }
+    for(i = 0; i < TEST_RECORDS; i++)
+    {
+        if(i > 0)
+        {
+            records[i] = records[i - 1];
+            time += 1000 + (test_rand() % 9) - 4;
+            // the UTC step at SNTP sync, and a late sweep now and then
+            if(i == TEST_RECORDS / 2)
+            {
+                time += 1790000000000ULL;
+            }
+            else if((test_rand() % 500) == 0)
+            {
+                time += 1000 * (1 + (test_rand() % 5));
+            }
+            for(ch = 0; ch < TEST_FIELDS; ch++)
+            {
+                records[i].fields[ch] = (int16_t)(records[i].fields[ch] + (int16_t)(test_rand() % 7) - 3);
+            }
+            records[i].mask = ((test_rand() % 1000) == 0) ? (uint16_t)(test_rand() & 0x0FFF) : 0;
+        }
+        records[i].time = time;
+    }
+}
+
+static bool encode_all(void)
+{
+    fpm_tscodec_enc_t enc;
+    uint32_t i;
+    block_count = 0;
+    fpm_tscodec_enc_init(&enc, blocks[0].buf, TREND_BLOCK_SIZE, TEST_FIELDS);
+    blocks[0].first = 0;
+    for(i = 0; i < TEST_RECORDS; i++)
+    {
+        if(fpm_tscodec_enc_put(&enc, records[i].time, records[i].mask, records[i].fields) == true)
+        {
+            continue;
+        }
+        blocks[block_count].count = enc.count;
+        blocks[block_count].bytes = fpm_tscodec_enc_bytes(&enc);
+        block_count++;
+        if(block_count >= TEST_BLOCKS_MAX)
+        {
+            return false;
+        }
+        memset(blocks[block_count].buf, 0, TREND_BLOCK_SIZE);
+        fpm_tscodec_enc_init(&enc, blocks[block_count].buf, TREND_BLOCK_SIZE, TEST_FIELDS);
+        blocks[block_count].first = i;
+        if(fpm_tscodec_enc_put(&enc, records[i].time, records[i].mask, records[i].fields) == false)
+        {
+            return false;
+        }
+    }
+    blocks[block_count].count = enc.count;
+    blocks[block_count].bytes = fpm_tscodec_enc_bytes(&enc);
+    block_count++;
+    return true;
+}
+
+static bool decode_all(bool check)
+{
+    fpm_tscodec_dec_t dec;
+    test_record_t out;
+    uint32_t b;
+    uint32_t i;
+    for(b = 0; b < block_count; b++)
+    {
+        fpm_tscodec_dec_init(&dec, blocks[b].buf, blocks[b].count, TEST_FIELDS);
+        for(i = 0; i < blocks[b].count; i++)
+        {
+            if(fpm_tscodec_dec_next(&dec, &out.time, &out.mask, out.fields) == false)
+            {
+                return false;
+            }
+            if((check == true)
+            && ((out.time != records[blocks[b].first + i].time) || (out.mask != records[blocks[b].first + i].mask)
+            || (memcmp(out.fields, records[blocks[b].first + i].fields, sizeof(out.fields)) != 0)))
+            {
+                printf("mismatch in block %u record %u\n", b, i);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+int main(void)
+{
+    int64_t start;
+    double encode_us;
+    double decode_us;
+    double raw_bytes;
+    double encoded_bytes = 0;
+    uint32_t b;
+    if(fpm_tscodec_selftest() == false)
+    {
+        printf("FAIL selftest\n");
+        return 1;
+    }
+    make_records();
+    start = esp_timer_get_time();
+    if(encode_all() == false)
+    {
+        printf("FAIL encode\n");
+        return 1;
+    }
+    encode_us = (double)(esp_timer_get_time() - start);
+    if(decode_all(true) == false)
+    {
+        printf("FAIL round trip\n");
+        return 1;
+    }
+    start = esp_timer_get_time();
+    decode_all(false);
+    decode_us = (double)(esp_timer_get_time() - start);
+    for(b = 0; b < block_count; b++)
+    {
+        encoded_bytes += blocks[b].bytes;
+    }
+    raw_bytes = (double)TEST_RECORDS * sizeof(fpm_trend_record_t);
+    printf("selftest ok, round trip ok: %u records in %u blocks\n", TEST_RECORDS, block_count);
+    printf("ratio %.2f (raw %.0f B, encoded %.0f B)\n", raw_bytes / encoded_bytes, raw_bytes, encoded_bytes);
+    printf("encode %.1f MB/s, %.3f us/record\n", raw_bytes / encode_us, encode_us / TEST_RECORDS);
+    printf("decode %.1f MB/s, %.3f us/record\n", raw_bytes / decode_us, decode_us / TEST_RECORDS);
+    return 0;
+}
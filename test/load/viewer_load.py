@@ -0,0 +1,234 @@
+#!/usr/bin/env python3
+"""Concurrent dashboard load test against a running meter.
+
+Fills the operator sessions with supervisor logons, then logs on --viewers more
+times as viewers and keeps every viewer socket open for --duration seconds,
+acknowledging frames the way data/index.html does. One more viewer than
+CONFIG_FPM_VIEWER_MAX then opens the viewer socket and must be refused with
+"&console#close".
+
+Per viewer it reports the time from socket open to the first "#rdmeter" and the
+gap between readings; the summary is what the viewer limit is sized against.
+
+    python3 viewer_load.py 192.168.4.1 --user supervisor --password supervisor
+
+Standard library only.
+"""
+
+import argparse
+import asyncio
+import base64
+import json
+import os
+import statistics
+import struct
+import sys
+import time
+import urllib.request
+
+SIMULTANEOUS_CLIENTS = 2
+
+
+class WsClient:
+    """Minimal RFC 6455 text client, enough for the meter's websocket."""
+
+    def __init__(self, reader, writer):
+        self.reader = reader
+        self.writer = writer
+
+    @classmethod
+    async def connect(cls, host, port, path):
+        reader, writer = await asyncio.open_connection(host, port)
+        key = base64.b64encode(os.urandom(16)).decode()
+        writer.write((f"GET {path} HTTP/1.1\r\nHost: {host}\r\nUpgrade: websocket\r\n"
+                      f"Connection: Upgrade\r\nSec-WebSocket-Key: {key}\r\n"
+                      "Sec-WebSocket-Version: 13\r\n\r\n").encode())
+        await writer.drain()
+        status = await reader.readline()
+        if b" 101 " not in status:
+            writer.close()
+            raise ConnectionError(f"{path}: {status.decode(errors='replace').strip()}")
+        while (await reader.readline()) not in (b"\r\n", b""):
+            pass
+        return cls(reader, writer)
+
+    async def send(self, text):
+        payload = text.encode()
+        mask = os.urandom(4)
+        header = bytes([0x81])
+        if len(payload) < 126:
+            header += bytes([0x80 | len(payload)])
+        elif len(payload) < 65536:
+            header += bytes([0x80 | 126]) + struct.pack("!H", len(payload))
+        else:
+            header += bytes([0x80 | 127]) + struct.pack("!Q", len(payload))
+        masked = bytes(b ^ mask[i & 3] for i, b in enumerate(payload))
+        self.writer.write(header + mask + masked)
+        await self.writer.drain()
+
+    async def recv(self):
+        """Next text frame, None once the socket is closed."""
+        while True:
+            try:
+                head = await self.reader.readexactly(2)
+                length = head[1] & 0x7F
+                if length == 126:
+                    length = struct.unpack("!H", await self.reader.readexactly(2))[0]
+                elif length == 127:
+                    length = struct.unpack("!Q", await self.reader.readexactly(8))[0]
+                payload = await self.reader.readexactly(length)
+            except (asyncio.IncompleteReadError, ConnectionError):
+                return None
+            opcode = head[0] & 0x0F
+            if opcode == 0x8:
+                return None
+            if opcode == 0x1:
+                return payload.decode(errors="replace")
+
+    def close(self):
+        self.writer.close()
+
+
+def logon(host, port, user, password):
+    body = json.dumps({"username": user, "password": password}).encode()
+    req = urllib.request.Request(f"http://{host}:{port}/login", data=body,
+                                 headers={"Content-type": "application/json; charset=UTF-8"})
+    with urllib.request.urlopen(req, timeout=10) as resp:
+        return json.loads(resp.read().decode())
+
+
+class Session:
+    """One page: a session or a viewer, acking like index.html (key, out, next in)."""
+
+    def __init__(self, name, key):
+        self.name = name
+        self.key = key
+        self.ws = None
+        self.out_cntid = 0
+        self.in_cntid = 0
+        self.opened = None
+        self.first_reading = None
+        self.readings = []
+        self.frames = 0
+        self.refused = False
+        self.dropped = False
+
+    async def send(self, text):
+        await self.ws.send(f"{text}*{self.key}*{self.out_cntid}*{self.in_cntid}")
+        self.out_cntid += 1
+
+    def handle(self, msg):
+        if msg.startswith("&console#close"):
+            self.refused = True
+            return
+        if msg.startswith("&console#start"):
+            self.in_cntid = 1
+            return
+        try:
+            self.in_cntid = int(msg.rsplit("*", 1)[1]) + 1
+        except (IndexError, ValueError):
+            pass
+        if msg.startswith("&console#rdmeter="):
+            now = time.monotonic()
+            if self.first_reading is None:
+                self.first_reading = now - self.opened
+            self.readings.append(now)
+
+    async def run(self, host, port, path, until):
+        self.ws = await WsClient.connect(host, port, path)
+        self.opened = time.monotonic()
+        await self.send("&console#new_ws=batch")
+        acked = self.in_cntid
+        while time.monotonic() < until:
+            try:
+                frame = await asyncio.wait_for(self.ws.recv(), timeout=until - time.monotonic())
+            except asyncio.TimeoutError:
+                break
+            if frame is None:
+                self.dropped = not self.refused
+                break
+            self.frames += 1
+            parts = frame[7:].split("\x1e") if frame.startswith("&batch#") else [frame]
+            for part in parts:
+                self.handle(part)
+            if self.refused:
+                break
+            if acked != self.in_cntid:
+                acked = self.in_cntid
+                await self.send("&console#ack")
+        self.ws.close()
+
+    def gaps(self):
+        return [b - a for a, b in zip(self.readings, self.readings[1:])]
+
+
+def percentile(values, p):
+    if not values:
+        return float("nan")
+    values = sorted(values)
+    return values[min(len(values) - 1, int(round(p / 100 * (len(values) - 1))))]
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("host")
+    parser.add_argument("--port", type=int, default=80)
+    parser.add_argument("--user", default="supervisor")
+    parser.add_argument("--password", default="supervisor")
+    parser.add_argument("--viewers", type=int, default=16, help="CONFIG_FPM_VIEWER_MAX on the meter")
+    parser.add_argument("--duration", type=float, default=60)
+    args = parser.parse_args()
+
+    until = time.monotonic() + args.duration
+    tasks = []
+    # supervisor logons take the operator sessions first; after that a supervisor
+    # logon is answered with the viewer key
+    sessions = []
+    for i in range(SIMULTANEOUS_CLIENTS + 1):
+        grant = logon(args.host, args.port, args.user, args.password)
+        if grant.get("access") == "viewer":
+            break
+        if grant.get("key", "0") == "0":
+            sys.exit(f"logon refused: {grant.get('msg')}")
+        session = Session(f"session{i}", grant["key"])
+        sessions.append(session)
+        tasks.append(asyncio.create_task(session.run(args.host, args.port, f"/ws{grant['key']}", until)))
+        await asyncio.sleep(0.5)
+
+    viewers = []
+    for i in range(args.viewers):
+        grant = logon(args.host, args.port, args.user, args.password)
+        if grant.get("access") != "viewer":
+            sys.exit(f"viewer{i}: logon answered {grant.get('msg')}, fewer viewers admitted than asked for")
+        viewer = Session(f"viewer{i}", grant["key"])
+        viewers.append(viewer)
+        tasks.append(asyncio.create_task(viewer.run(args.host, args.port, f"/ws{grant['key']}", until)))
+        await asyncio.sleep(0.2)
+    # with every viewer slot held, one more socket on the viewer URI must be refused
+    await asyncio.sleep(2.0)
+    extra = Session("extra", viewers[-1].key if viewers else "0")
+    tasks.append(asyncio.create_task(extra.run(args.host, args.port, f"/ws{extra.key}", until)))
+
+    await asyncio.gather(*tasks, return_exceptions=True)
+
+    served = [v for v in viewers if v.readings]
+    refused = [v for v in viewers + [extra] if v.refused]
+    all_gaps = [g for v in served for g in v.gaps()]
+    first = [v.first_reading for v in served]
+    for v in sessions + viewers + [extra]:
+        gaps = v.gaps()
+        print(f"{v.name:9s} frames {v.frames:5d} readings {len(v.readings):4d} "
+              f"first {v.first_reading if v.first_reading is not None else float('nan'):6.3f} s "
+              f"gap avg {statistics.mean(gaps) if gaps else float('nan'):6.3f} max {max(gaps) if gaps else float('nan'):6.3f} s"
+              f"{' refused' if v.refused else ''}{' dropped' if v.dropped else ''}")
+    print(f"\n{len(served)} viewers served for {args.duration:.0f} s next to {len(sessions)} sessions, "
+          f"{len(refused)} refused, {sum(v.dropped for v in viewers)} dropped")
+    if served:
+        print(f"first reading p50 {percentile(first, 50):.3f} s, max {max(first):.3f} s")
+        print(f"reading gap p50 {percentile(all_gaps, 50):.3f} s, p95 {percentile(all_gaps, 95):.3f} s, "
+              f"max {max(all_gaps) if all_gaps else float('nan'):.3f} s")
+    return 0 if (len(served) >= args.viewers) and (extra.refused is True) and (len(refused) == 1) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(asyncio.run(main()))